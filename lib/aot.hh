@@ -0,0 +1,101 @@
+#ifndef AOT_HH_
+#define AOT_HH_
+
+#include <cstdint>
+
+// Interface between LuisaVM and the native code generated by `lac`. This is
+// the only file included by the generated code.
+
+namespace luisavm {
+namespace aot {
+
+static const uint32_t ABI_VERSION = 3;
+
+struct Context {
+    uint32_t*      reg;            // CPU::Register
+    uint8_t const* ram;            // read directly by the loads
+    uint64_t       ram_size;
+    bool           code_written;   // the guest wrote over the translated code
+    void*          vm;
+    uint32_t       (*load)(void* vm, uint32_t addr, uint32_t sz);
+    void           (*store)(void* vm, uint32_t addr, uint32_t value, uint32_t sz);
+};
+
+inline void Fetch(Context const* c, uint32_t* r)
+{
+    for(int i=0; i<16; ++i) {
+        r[i] = c->reg[i];
+    }
+}
+
+inline void Leave(Context* c, uint32_t const* r)
+{
+    for(int i=0; i<16; ++i) {
+        c->reg[i] = r[i];
+    }
+}
+
+inline uint32_t Load(Context* c, uint32_t addr, uint32_t sz)
+{
+    if(static_cast<uint64_t>(addr) + sz <= c->ram_size) {
+        uint32_t value = 0;
+        for(uint32_t i=0; i<sz; ++i) {
+            value |= static_cast<uint32_t>(c->ram[addr + i]) << (8 * i);
+        }
+        return value;
+    }
+    return c->load(c->vm, addr, sz);
+}
+
+inline void Store(Context* c, uint32_t addr, uint32_t value, uint32_t sz)
+{
+    c->store(c->vm, addr, value, sz);
+}
+
+// the same as CPU::Apply: sets Z and S, clears the other flags
+inline void Flags(uint32_t& fl, uint32_t value)
+{
+    fl = (fl & ~0x3Fu) | (static_cast<uint32_t>(value == 0) << 2) | (((value >> 31) & 1) << 3);
+}
+
+inline void SetFlag(uint32_t& fl, int flag, bool value)
+{
+    fl = (fl & ~(1u << flag)) | (static_cast<uint32_t>(value) << flag);
+}
+
+inline void Compare(uint32_t& fl, uint32_t p0, uint32_t p1)
+{
+    uint32_t y = fl & 1;
+    uint32_t diff = p0 - p1 - y;
+    fl = (fl & ~0x3Fu)
+       | static_cast<uint32_t>((static_cast<int64_t>(p0) - static_cast<int64_t>(p1) - static_cast<int64_t>(y)) < 0)
+       | (static_cast<uint32_t>(diff == 0) << 2)
+       | (((diff >> 31) & 1) << 3)
+       | (static_cast<uint32_t>(p0 > p1) << 4)
+       | (static_cast<uint32_t>(p1 > p0) << 5);
+}
+
+inline void Push(Context* c, uint32_t* r, uint32_t value, uint32_t sz)
+{
+    r[13] -= sz - 1;
+    Store(c, r[13], value, sz);
+    r[13] -= 1;
+}
+
+inline uint32_t Pop(Context* c, uint32_t* r, uint32_t sz)
+{
+    r[13] += 1;
+    uint32_t value = Load(c, r[13], sz);
+    r[13] += sz - 1;
+    return value;
+}
+
+}  // namespace aot
+}  // namespace luisavm
+
+// symbols exported by the generated code
+extern "C" {
+    typedef uint64_t (*luisavm_aot_run_t)(luisavm::aot::Context* c, uint64_t max_cycles);
+}
+
+#endif
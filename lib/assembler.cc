@@ -254,55 +254,37 @@ void Assembler::Instruction(string const& inst, string const& pars, Pos const& p
     transform(begin(par), end(par), back_inserter(partype),
             [this](Parameter const& p){ return p.type; });
 
-    // find instruction
-    auto upgrade = [](vector<ParameterType> const& pars) -> vector<ParameterType> {
-        vector<ParameterType> p;
-        for(auto const& par: pars) {
-            p.push_back((par == V8 || par == V16) ? V32 : par);
-        }
-        return p;
-    };
-    uint8_t i=0;
-    for(auto const& op: opcodes) {   // opcodes in 'opcodes.hh'
-        if(inst == op.description && (partype == op.parameter || upgrade(partype) == op.parameter)) {
-            if(_mp.find(pos.filename) == _mp.end()) {
-                _mp[pos.filename] = {};
-            }
-            _mp[pos.filename].push_back({ pos.n_line, static_cast<uint32_t>(_text.size()) });
-            _text.push_back(i);
-            goto found;
-        }
-        ++i;
+    // find instruction (in 'opcodes.hh'); values can be encoded in wider 
+    // parameters
+    vector<ParameterType> upgraded;
+    transform(begin(partype), end(partype), back_inserter(upgraded),
+            [](ParameterType pt) { return (pt == V8 || pt == V16) ? V32 : pt; });
+    int op = FindOpcode(inst.c_str(), partype.data(), partype.size());
+    if(op == -1) {
+        op = FindOpcode(inst.c_str(), upgraded.data(), upgraded.size());
+    }
+    if(op == -1) {
+        throw runtime_error("Invalid instruction '" + inst + " " + pars + "'.");
     }
-    throw runtime_error("Invalid instruction '" + inst + " " + pars + "'.");
+    Opcode const& opcode = opcodes[static_cast<size_t>(op)];
 
-found:
-    if(par.size() == 2 && (par[0].type == REG || par[0].type == INDREG) && (par[1].type == REG || par[1].type == INDREG)) {
-        _text.push_back((par[0].value << 4) | (par[1].value & 0xF));
+    if(_mp.find(pos.filename) == _mp.end()) {
+        _mp[pos.filename] = {};
+    }
+    _mp[pos.filename].push_back({ pos.n_line, static_cast<uint32_t>(_text.size()) });
+    _text.push_back(static_cast<uint8_t>(op));
+
+    // parameters, encoded as described in the opcode
+    if(opcode.Packed()) {
+        _text.push_back(static_cast<uint8_t>((par[0].value << 4) | (par[1].value & 0xF)));
     } else {
-        for(auto const& p: par) {
-            switch(p.type) {
-                case REG: case INDREG: case V8:
-                    _text.push_back(static_cast<uint8_t>(p.value));
-                    break;
-                case V16:
-                    _text.push_back(static_cast<uint8_t>(p.value));
-                    _text.push_back(static_cast<uint8_t>(p.value >> 8));
-                    break;
-                case V32: case INDV32:
-                    if(p.label == "") {
-                        _text.push_back(static_cast<uint8_t>(p.value));
-                        _text.push_back(static_cast<uint8_t>(p.value >> 8));
-                        _text.push_back(static_cast<uint8_t>(p.value >> 16));
-                        _text.push_back(static_cast<uint8_t>(p.value >> 24));
-                    } else {
-                        _pending_labels[_text.size()] = p.label;
-                        for(int i=0; i<4; ++i) {
-                            _text.push_back(0);
-                        }
-                    }
-                    break;
-                default: throw logic_error("invalid parameter type");
+        for(size_t i=0; i<opcode.n_pars; ++i) {
+            uint8_t sz = ParameterSize(opcode.parameter[i]);
+            if(par[i].label != "") {
+                _pending_labels[_text.size()] = par[i].label;
+            }
+            for(uint8_t j=0; j<sz; ++j) {
+                _text.push_back(par[i].label == "" ? static_cast<uint8_t>(par[i].value >> (8 * j)) : 0);
             }
         }
     }
@@ -391,6 +373,12 @@ string Assembler::CreateMap() const
             ss << i << ":" << m.line << ":" << m.pc << "\n";
         }
     }
+    ss << "**\n";
+    for(auto const& kv: _labels) {   // code labels
+        if(kv.second.section == TEXT) {
+            ss << kv.first << ":" << kv.second.pos << "\n";
+        }
+    }
     return ss.str();
 }
 
@@ -0,0 +1,417 @@
+#include "checkpoint.hh"
+
+#include <cstring>
+#include <exception>
+#include <map>
+#include <stdexcept>
+using namespace std;
+
+#include "luisavm.hh"
+
+namespace luisavm {
+
+// {{{ file format
+
+// A checkpoint file has a header followed by the checkpoints, each one
+// prefixed by its size. A checkpoint holds the state of each device and the
+// pages changed since the previous checkpoint, as compressed XOR deltas. All
+// integers are little-endian.
+static const char     CHECKPOINT_MAGIC[8] = { 'L', 'V', 'M', 'C', 'K', 'P', 'T', '\0' };
+static const uint32_t CHECKPOINT_VERSION = 1;
+
+static void Put(vector<uint8_t>& data, uint64_t value, int sz)
+{
+    for(int i=0; i<sz; ++i) {
+        data.push_back(static_cast<uint8_t>(value >> (8 * i)));
+    }
+}
+
+
+// reads from a buffer that was checked to be complete
+class Reader {
+public:
+    Reader(uint8_t const* data, size_t size) : _p(data), _end(data + size) {}
+
+    uint64_t Take(int sz) {
+        if(Left() < static_cast<size_t>(sz)) {
+            throw runtime_error("Invalid checkpoint file.");
+        }
+        uint64_t value = 0;
+        for(int i=0; i<sz; ++i) {
+            value |= static_cast<uint64_t>(*_p++) << (8 * i);
+        }
+        return value;
+    }
+
+    uint8_t const* Bytes(size_t sz) {
+        if(Left() < sz) {
+            throw runtime_error("Invalid checkpoint file.");
+        }
+        uint8_t const* p = _p;
+        _p += sz;
+        return p;
+    }
+
+    size_t Left() const { return static_cast<size_t>(_end - _p); }
+
+private:
+    uint8_t const* _p;
+    uint8_t const* _end;
+};
+
+// }}}
+
+// {{{ page codec
+
+// The deltas are mostly zeros, so the codec is just a zero run length
+// encoding: a count of zeros and a count of literal bytes (both as LEB128),
+// then the literal bytes, repeated until the page is complete. Short zero
+// runs are kept in the literals.
+static const size_t MIN_ZERO_RUN = 4;
+
+static void PutVarint(vector<uint8_t>& out, size_t value)
+{
+    while(value >= 0x80) {
+        out.push_back(static_cast<uint8_t>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(value));
+}
+
+
+static size_t TakeVarint(Reader& r)
+{
+    size_t value = 0;
+    for(int shift=0; shift<32; shift+=7) {
+        uint64_t byte = r.Take(1);
+        value |= (byte & 0x7F) << shift;
+        if((byte & 0x80) == 0) {
+            return value;
+        }
+    }
+    throw runtime_error("Invalid checkpoint file.");
+}
+
+
+static void Encode(uint8_t const* delta, vector<uint8_t>& out)
+{
+    size_t i = 0;
+    while(i < PageTable::PAGE_SIZE) {
+        size_t literal = i;
+        while(literal < PageTable::PAGE_SIZE && delta[literal] == 0) {
+            ++literal;
+        }
+        size_t end = literal;
+        while(end < PageTable::PAGE_SIZE) {
+            if(delta[end] != 0) {
+                ++end;
+                continue;
+            }
+            size_t zeros = end;
+            while(zeros < PageTable::PAGE_SIZE && delta[zeros] == 0 && zeros - end < MIN_ZERO_RUN) {
+                ++zeros;
+            }
+            if(zeros - end == MIN_ZERO_RUN || zeros == PageTable::PAGE_SIZE) {
+                break;
+            }
+            end = zeros;
+        }
+        PutVarint(out, literal - i);
+        PutVarint(out, end - literal);
+        out.insert(out.end(), delta + literal, delta + end);
+        i = end;
+    }
+}
+
+
+// applies the encoded delta over the page
+static void Decode(Reader& r, uint8_t* page)
+{
+    size_t i = 0;
+    while(i < PageTable::PAGE_SIZE) {
+        size_t zeros = TakeVarint(r);
+        size_t literal = TakeVarint(r);
+        if(zeros + literal > PageTable::PAGE_SIZE - i) {
+            throw runtime_error("Invalid checkpoint file.");
+        }
+        i += zeros;
+        uint8_t const* bytes = r.Bytes(literal);
+        for(size_t j=0; j<literal; ++j) {
+            page[i++] ^= bytes[j];
+        }
+    }
+}
+
+// }}}
+
+// {{{ writing
+
+Checkpointer::Checkpointer(LuisaVM& vm, string const& filename)
+    : _vm(vm), _dirty_list(vm.TrackDirtyPages()), _filename(filename), _file(filename, ios::binary|ios::trunc)
+{
+    vector<uint8_t> header(begin(CHECKPOINT_MAGIC), end(CHECKPOINT_MAGIC));
+    Put(header, CHECKPOINT_VERSION, 4);
+    Put(header, PageTable::PAGE_SIZE, 4);
+    Put(header, vm._physical_memory.size(), 8);
+    _file.write(reinterpret_cast<char const*>(header.data()), static_cast<streamsize>(header.size()));
+    if(!_file.flush()) {
+        vm.UntrackDirtyPages(_dirty_list);
+        throw runtime_error("Error writing file " + filename);
+    }
+    _thread = thread(&Checkpointer::Worker, this);
+}
+
+
+Checkpointer::~Checkpointer()
+{
+    {
+        lock_guard<mutex> lock(_mutex);
+        _quit = true;
+    }
+    _cond.notify_all();
+    _thread.join();
+    _vm.UntrackDirtyPages(_dirty_list);
+}
+
+
+// This is the only part that holds the VM back: it copies the pages, and
+// leaves the rest to the worker.
+void Checkpointer::Checkpoint()
+{
+    {
+        lock_guard<mutex> lock(_mutex);
+        if(!_error.empty()) {
+            throw runtime_error(_error);
+        }
+    }
+
+    Capture capture;
+    for(auto const& dev: _vm._devices) {
+        capture.states.push_back(dev->SaveState());
+    }
+
+    uint8_t const* memory = _vm._physical_memory.data();
+    capture.pages = _vm.CollectDirtyPages(_dirty_list);
+    if(_first) {
+        // pages written before the checkpointer existed are not in the list
+        static const uint8_t zero[PageTable::PAGE_SIZE] = {};
+        uint32_t n_pages = static_cast<uint32_t>(_vm._physical_memory.size() / PageTable::PAGE_SIZE);
+        capture.pages.clear();
+        for(uint32_t page=0; page<n_pages; ++page) {
+            if(memcmp(memory + (static_cast<size_t>(page) << PageTable::PAGE_BITS), zero, PageTable::PAGE_SIZE) != 0) {
+                capture.pages.push_back(page);
+            }
+        }
+        _first = false;
+    }
+
+    capture.data.resize(capture.pages.size() * PageTable::PAGE_SIZE);
+    for(size_t i=0; i<capture.pages.size(); ++i) {
+        memcpy(&capture.data[i * PageTable::PAGE_SIZE], memory + (static_cast<size_t>(capture.pages[i]) << PageTable::PAGE_BITS), PageTable::PAGE_SIZE);
+    }
+
+    {
+        lock_guard<mutex> lock(_mutex);
+        _queue.push_back(move(capture));
+    }
+    _cond.notify_all();
+}
+
+
+void Checkpointer::Wait()
+{
+    unique_lock<mutex> lock(_mutex);
+    _cond.wait(lock, [this] { return _queue.empty() && !_writing; });
+    if(!_error.empty()) {
+        throw runtime_error(_error);
+    }
+}
+
+
+size_t Checkpointer::Pending() const
+{
+    lock_guard<mutex> lock(_mutex);
+    return _queue.size() + (_writing ? 1 : 0);
+}
+
+
+// The queue is emptied before quitting, so that no checkpoint is lost.
+void Checkpointer::Worker()
+{
+    unique_lock<mutex> lock(_mutex);
+    while(true) {
+        _cond.wait(lock, [this] { return _quit || !_queue.empty(); });
+        if(_queue.empty()) {
+            return;
+        }
+        Capture capture = move(_queue.front());
+        _queue.pop_front();
+        if(!_error.empty()) {
+            continue;   // the file is no good after a failed write
+        }
+        _writing = true;
+        lock.unlock();
+
+        string error;
+        try {
+            Write(capture);
+        } catch(exception& e) {
+            error = e.what();
+        }
+
+        lock.lock();
+        _writing = false;
+        _error = error;
+        _cond.notify_all();
+    }
+}
+
+
+void Checkpointer::Write(Capture const& capture)
+{
+    vector<uint8_t> record(4, 0);   // size, filled in at the end
+    Put(record, capture.states.size(), 4);
+    for(vector<uint8_t> const& state: capture.states) {
+        Put(record, state.size(), 4);
+        record.insert(end(record), begin(state), end(state));
+    }
+
+    size_t n_pages_pos = record.size();
+    uint32_t n_pages = 0;
+    Put(record, 0, 4);
+
+    uint8_t delta[PageTable::PAGE_SIZE];
+    vector<uint8_t> encoded;
+    for(size_t i=0; i<capture.pages.size(); ++i) {
+        uint8_t const* data = &capture.data[i * PageTable::PAGE_SIZE];
+        vector<uint8_t>& previous = _previous[capture.pages[i]];
+        if(previous.empty()) {
+            previous.assign(data, data + PageTable::PAGE_SIZE);
+            memcpy(delta, data, PageTable::PAGE_SIZE);
+        } else {
+            bool changed = false;
+            for(size_t j=0; j<PageTable::PAGE_SIZE; ++j) {
+                delta[j] = previous[j] ^ data[j];
+                changed |= (delta[j] != 0);
+            }
+            if(!changed) {
+                continue;   // written with the same contents
+            }
+            memcpy(previous.data(), data, PageTable::PAGE_SIZE);
+        }
+
+        encoded.clear();
+        Encode(delta, encoded);
+        Put(record, capture.pages[i], 4);
+        Put(record, encoded.size(), 4);
+        record.insert(end(record), begin(encoded), end(encoded));
+        ++n_pages;
+    }
+
+    for(int i=0; i<4; ++i) {
+        record[i] = static_cast<uint8_t>((record.size() - 4) >> (8 * i));
+        record[n_pages_pos + static_cast<size_t>(i)] = static_cast<uint8_t>(n_pages >> (8 * i));
+    }
+    _file.write(reinterpret_cast<char const*>(record.data()), static_cast<streamsize>(record.size()));
+    if(!_file.flush()) {
+        throw runtime_error("Error writing file " + _filename);
+    }
+}
+
+// }}}
+
+// {{{ restoring
+
+// The file is read twice: first to find the last complete checkpoint, then
+// to apply the deltas up to it.
+void Checkpointer::Restore(LuisaVM& vm, string const& filename)
+{
+    ifstream ifs(filename, ios::binary);
+    if(!ifs) {
+        throw runtime_error("Error reading file " + filename);
+    }
+    uint8_t header[sizeof CHECKPOINT_MAGIC + 16];
+    if(!ifs.read(reinterpret_cast<char*>(header), sizeof header) || memcmp(header, CHECKPOINT_MAGIC, sizeof CHECKPOINT_MAGIC) != 0) {
+        throw runtime_error(filename + " is not a checkpoint file.");
+    }
+    Reader h(header + sizeof CHECKPOINT_MAGIC, 16);
+    if(h.Take(4) != CHECKPOINT_VERSION) {
+        throw runtime_error("Unsupported checkpoint version.");
+    }
+    if(h.Take(4) != PageTable::PAGE_SIZE || h.Take(8) != vm._physical_memory.size()) {
+        throw runtime_error("The checkpoint is from a VM with a different memory size.");
+    }
+
+    ifs.seekg(0, ios::end);
+    uint64_t file_size = static_cast<uint64_t>(ifs.tellg());
+    uint64_t start = sizeof header, pos = start;
+    size_t n_records = 0;
+    while(pos + 4 <= file_size) {
+        uint8_t size[4];
+        ifs.seekg(static_cast<streamoff>(pos));
+        ifs.read(reinterpret_cast<char*>(size), 4);
+        uint64_t next = pos + 4 + Reader(size, 4).Take(4);
+        if(!ifs || next > file_size) {
+            break;
+        }
+        pos = next;
+        ++n_records;
+    }
+    if(n_records == 0) {
+        throw runtime_error(filename + " has no complete checkpoint.");
+    }
+
+    // everything is decoded before the VM is touched, so that a damaged file
+    // leaves it as it was
+    uint32_t n_pages = static_cast<uint32_t>(vm._physical_memory.size() / PageTable::PAGE_SIZE);
+    map<uint32_t, vector<uint8_t>> pages;
+    vector<uint8_t> record;
+    vector<vector<uint8_t>> states;
+    ifs.clear();
+    ifs.seekg(static_cast<streamoff>(start));
+    for(size_t n=0; n<n_records; ++n) {
+        uint8_t size[4];
+        ifs.read(reinterpret_cast<char*>(size), 4);
+        record.resize(Reader(size, 4).Take(4));
+        ifs.read(reinterpret_cast<char*>(record.data()), static_cast<streamsize>(record.size()));
+        if(!ifs) {
+            throw runtime_error("Error reading file " + filename);
+        }
+
+        Reader r(record.data(), record.size());
+        states.resize(r.Take(4));
+        for(vector<uint8_t>& state: states) {
+            size_t sz = r.Take(4);
+            uint8_t const* data = r.Bytes(sz);
+            state.assign(data, data + sz);
+        }
+        for(uint64_t n_changed = r.Take(4); n_changed > 0; --n_changed) {
+            uint64_t page = r.Take(4);
+            if(page >= n_pages) {
+                throw runtime_error("Invalid checkpoint file.");
+            }
+            vector<uint8_t>& contents = pages[static_cast<uint32_t>(page)];
+            contents.resize(PageTable::PAGE_SIZE);
+            size_t sz = r.Take(4);
+            Reader encoded(r.Bytes(sz), sz);
+            Decode(encoded, contents.data());
+            if(encoded.Left() != 0) {
+                throw runtime_error("Invalid checkpoint file.");
+            }
+        }
+    }
+
+    vm.WritingPages(0, n_pages - 1);
+    vm._physical_memory.Clear();
+    for(auto const& page: pages) {
+        memcpy(vm._physical_memory.data() + (static_cast<size_t>(page.first) << PageTable::PAGE_BITS), page.second.data(), PageTable::PAGE_SIZE);
+    }
+
+    for(size_t i=0; i<states.size() && i<vm._devices.size(); ++i) {
+        vm._devices[i]->LoadState(states[i]);
+    }
+}
+
+// }}}
+
+}  // namespace luisavm
@@ -0,0 +1,80 @@
+#ifndef CHECKPOINT_HH_
+#define CHECKPOINT_HH_
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+using namespace std;
+
+namespace luisavm {
+
+class LuisaVM;
+
+// Writes checkpoints of a running VM to a file. Taking a checkpoint only
+// copies the device states and the pages written since the previous one;
+// encoding and writing them is done on a background thread, so the VM is
+// never held back by the disk.
+//
+// The file is a log of checkpoints. Each page is stored as the XOR against
+// its previous version, which is mostly zeros, and compressed. The first
+// checkpoint holds all the non-zero pages.
+//
+// The checkpointer keeps its own list of the dirty pages of the VM, so it
+// doesn't get in the way of anyone else collecting them.
+class Checkpointer {
+public:
+    Checkpointer(LuisaVM& vm, string const& filename);
+    ~Checkpointer();
+
+    Checkpointer(Checkpointer const&) = delete;
+    Checkpointer& operator=(Checkpointer const&) = delete;
+
+    // Captures the state of the VM and queues it to be written. Throws if
+    // writing a previous checkpoint failed.
+    void Checkpoint();
+
+    // waits until all checkpoints taken are in the file
+    void Wait();
+
+    size_t Pending() const;
+
+    // Brings the VM to the last complete checkpoint of the file. A
+    // checkpoint cut short (because the emulator was killed while writing
+    // it) is ignored.
+    static void Restore(LuisaVM& vm, string const& filename);
+
+private:
+    struct Capture {
+        vector<vector<uint8_t>> states;
+        vector<uint32_t>        pages;
+        vector<uint8_t>         data;    // contents of `pages`, one after the other
+    };
+
+    void Worker();
+    void Write(Capture const& capture);
+
+    LuisaVM&                                   _vm;
+    uint32_t                                   _dirty_list;   // LuisaVM::DirtyList
+    string                                     _filename;
+    ofstream                                   _file;
+    bool                                       _first = true;
+    unordered_map<uint32_t, vector<uint8_t>>   _previous;   // used only by the worker
+
+    mutable mutex      _mutex;
+    condition_variable _cond;
+    deque<Capture>     _queue;
+    bool               _writing = false;
+    bool               _quit = false;
+    string             _error;
+    thread             _thread;
+};
+
+}  // namespace luisavm
+
+#endif
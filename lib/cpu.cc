@@ -1,286 +1,815 @@
 #include "cpu.hh"
 
+#include <algorithm>
+#include <cstdio>
+#include <stdexcept>
+
 #include "luisavm.hh"
 
 namespace luisavm {
 
+// in the same order as CPU::Fusion
+static const struct {
+    Instruction first, second;
+    char const* name;
+} fused_pairs[] = {
+    { CMP, BZ,  "cmp+bz" },
+    { CMP, BNZ, "cmp+bnz" },
+    { DEC, BNZ, "dec+bnz" },
+    { MOV, ADD, "mov+add" },
+};
+
+CPU::CPU(LuisaVM& comp) 
+    : comp(comp), _decoded(DECODE_CACHE_SIZE), 
+      _code_block((comp.PhysicalMemory().size() >> CODE_BLOCK_BITS) + 1, false)
+{
+}
+
+
 void CPU::Reset()
 {
     for(uint8_t i=0; i<16; ++i) {
         Register[i] = 0x0;
     }
+    Waiting = false;
+    _loop = NO_LOOP;
+}
+
+vector<uint8_t> CPU::SaveState() const
+{
+    vector<uint8_t> data;
+    for(uint32_t reg: Register) {
+        for(int i=0; i<4; ++i) {
+            data.push_back(static_cast<uint8_t>(reg >> (8 * i)));
+        }
+    }
+    return data;
+}
+
+
+void CPU::LoadState(vector<uint8_t> const& data)
+{
+    if(data.size() != Register.size() * 4) {
+        throw runtime_error("Invalid CPU state.");
+    }
+    for(size_t r=0; r<Register.size(); ++r) {
+        Register[r] = 0;
+        for(size_t i=0; i<4; ++i) {
+            Register[r] |= static_cast<uint32_t>(data[r * 4 + i]) << (8 * i);
+        }
+    }
+}
+
+// {{{ step/run
+
+string StopReason::Description() const
+{
+    char buf[80];
+    switch(kind) {
+        case NONE:
+            return "cycles ran out";
+        case INVALID_OPCODE:
+            snprintf(buf, sizeof buf, "invalid opcode at 0x%08X", pc);
+            break;
+        case INVALID_REGISTER:
+            snprintf(buf, sizeof buf, "invalid register at 0x%08X", pc);
+            break;
+        case UNMAPPED_MEMORY:
+            snprintf(buf, sizeof buf, "access to unmapped address 0x%08X at 0x%08X", address, pc);
+            break;
+        case DIVISION_BY_ZERO:
+            snprintf(buf, sizeof buf, "division by zero at 0x%08X", pc);
+            break;
+        case SEGMENT_FAULT:
+            snprintf(buf, sizeof buf, "access to 0x%08X, outside of the segment, at 0x%08X", address, pc);
+            break;
+    }
+    return buf;
 }
 
-// {{{ void CPU::Step()
 
 void CPU::Step()
 {
-    // find opcode
-    uint32_t op = comp.Get(PC);
-    if(op == 0 || op >= opcodes.size()) {
-        throw runtime_error("Invalid instruction " + to_string(op));
+    Run(1);
+}
+
+
+// the opcode at position `n` in the table, or an invalid one
+static constexpr Opcode OpcodeAt(size_t n)
+{
+    return (n < opcodes.size()) ? opcodes[n] : Opcode();
+}
+
+// whether the instruction can trap after it starts executing
+static constexpr bool MayTrap(Opcode const& op)
+{
+    return op.instruction == IDIV || op.instruction == MOD 
+        || (op.instruction >= JSR && op.instruction <= POP_A)     // stack
+        || (op.n_pars > 0 && (op.parameter[0] == INDREG || op.parameter[0] == INDV32))
+        || (op.n_pars > 1 && (op.parameter[1] == INDREG || op.parameter[1] == INDV32));
+}
+
+// X(n) for every opcode, from 0x00 to 0xFF
+#define ROW(X, h)   X(h##0) X(h##1) X(h##2) X(h##3) X(h##4) X(h##5) X(h##6) X(h##7) \
+                    X(h##8) X(h##9) X(h##A) X(h##B) X(h##C) X(h##D) X(h##E) X(h##F)
+#define OPCODES(X)  ROW(X, 0x0) ROW(X, 0x1) ROW(X, 0x2) ROW(X, 0x3) ROW(X, 0x4) ROW(X, 0x5) \
+                    ROW(X, 0x6) ROW(X, 0x7) ROW(X, 0x8) ROW(X, 0x9) ROW(X, 0xA) ROW(X, 0xB) \
+                    ROW(X, 0xC) ROW(X, 0xD) ROW(X, 0xE) ROW(X, 0xF)
+
+// Threaded interpreter: every instruction jumps directly to the handler of 
+// the next one. There is one handler per opcode, with the instruction and 
+// the kinds of its parameters resolved at compile time from the opcode table.
+//
+// PC, SP and FL are kept in local variables while running; instructions that
+// name one of these registers as a parameter go through the 'special' 
+// handler, which works on the register array itself.
+//
+// Instructions that were decoded as the first of a fused pair run the second
+// one in the same handler, as long as it is still the expected instruction.
+// A jump to the second instruction just runs it alone.
+//
+// Faults don't unwind: the instruction sets `_trap`, and only the handlers of
+// opcodes that can fault check it. The faulting instruction is not counted,
+// and PC is left pointing at it. Yield uses the same path to stop after the
+// instruction that called it.
+//
+// Instructions run while there are cycles left, so the last one can go over
+// `max_cycles` by a few cycles.
+StopReason CPU::Run(uint64_t max_cycles)
+{
+#define LABEL(n) &&op_##n,
+    static void* const handler[] = {
+        OPCODES(LABEL)
+        &&special,
+        &&cmp_bz, &&cmp_bnz, &&dec_bnz, &&mov_add,
+        &&invalid_register,
+        &&wait,
+    };
+#undef LABEL
+    static_assert(sizeof handler / sizeof handler[0] == HANDLER_WAIT + 1, "missing handlers");
+
+    Locals r(*this);
+    Decoded const* d;
+    uint64_t cycles = 0;
+    _trap = StopReason::NONE;
+    Waiting = false;
+
+#define NEXT()                          \
+    if(cycles >= max_cycles) {          \
+        return StopReason { StopReason::NONE, r.pc, 0, cycles }; \
+    }                                   \
+    d = &Decode(r.pc);                  \
+    cycles += d->opcode->cycles;        \
+    goto *handler[d->handler]
+
+#define HANDLER(n)                                                          \
+    op_##n:                                                                 \
+        if(!OpcodeAt(n).Valid()) {                                          \
+            goto invalid;                                                   \
+        }                                                                   \
+        if(MayTrap(OpcodeAt(n))) {                                          \
+            _elapsed = _elapsed_base + cycles - d->opcode->cycles;          \
+        }                                                                   \
+        Execute<OpcodeAt(n).instruction, OpcodeAt(n).n_pars,                \
+                OpcodeAt(n).parameter[0], OpcodeAt(n).parameter[1]>(r, *d); \
+        if(MayTrap(OpcodeAt(n)) && _trap != StopReason::NONE) {            \
+            goto trap;                                                      \
+        }                                                                   \
+        NEXT();
+
+#define FUSED(label, fusion, first, second)                                 \
+    label:                                                                  \
+        _elapsed = _elapsed_base + cycles - d->opcode->cycles;              \
+        Execute<first>(r, *d);                                              \
+        if(_trap != StopReason::NONE) {                                     \
+            goto trap;                                                      \
+        }                                                                   \
+        if(cycles >= max_cycles) {                                          \
+            return StopReason { StopReason::NONE, r.pc, 0, cycles };        \
+        }                                                                   \
+        d = &Decode(r.pc);                                                  \
+        cycles += d->opcode->cycles;                                        \
+        if(d->handler >= HANDLER_SPECIAL || d->opcode->instruction != second) {   \
+            goto *handler[d->handler];                                      \
+        }                                                                   \
+        ++_fusion_count[fusion];                                            \
+        Execute<second>(r, *d);                                             \
+        if(_trap != StopReason::NONE) {                                     \
+            goto trap;                                                      \
+        }                                                                   \
+        NEXT()
+
+    NEXT();
+
+    OPCODES(HANDLER)
+
+    FUSED(cmp_bz, FUSE_CMP_BZ, CMP, BZ);      FUSED(cmp_bnz, FUSE_CMP_BNZ, CMP, BNZ);
+    FUSED(dec_bnz, FUSE_DEC_BNZ, DEC, BNZ);   FUSED(mov_add, FUSE_MOV_ADD, MOV, ADD);
+
+invalid:
+    Trap(StopReason::INVALID_OPCODE, r.pc);   // unless fetching it faulted
+    goto trap;
+
+invalid_register:
+    Trap(StopReason::INVALID_REGISTER, r.pc);
+    goto trap;
+
+// A branch to itself stays where it is. A polling loop is only known to be
+// idle after it has run a whole turn from the branch back, and it resumes
+// from its start.
+wait:
+    Polling = false;
+    if(d->opcode->instruction == WAIT) {
+        r.pc += d->sz;
+    } else {
+        r.Spill();
+        {
+            InPlace ip(*this);
+            ExecuteAny(ip, *d);
+        }
+        r.Reload();
+        if(r.pc != d->par[0].value) {   // not taken
+            _loop = NO_LOOP;
+            NEXT();
+        } else if(r.pc != d->pc) {
+            if(_loop != d->pc || !IdleLoop(*d, true)) {
+                _loop = d->pc;
+                NEXT();
+            }
+            Polling = true;
+        }
+    }
+    Waiting = true;
+    return StopReason { StopReason::NONE, r.pc, 0, cycles };
+
+special: {
+        _elapsed = _elapsed_base + cycles - d->opcode->cycles;
+        r.Spill();
+        uint32_t fl = FL;
+        bool user = comp.Translating();
+        InPlace ip(*this);
+        ExecuteAny(ip, *d);
+        if(user) {   // FL written by a task
+            FL = (FL & ~SUPERVISOR_FLAGS) | (fl & SUPERVISOR_FLAGS);
+        }
+        r.Reload();
+    }
+    if(_trap != StopReason::NONE) {
+        goto trap;
+    }
+    NEXT();
+
+trap:
+    _loop = NO_LOOP;
+    if(_trap == YIELD) {   // not a fault: the instruction is done
+        return StopReason { StopReason::NONE, r.pc, 0, cycles };
     }
-    Opcode& opcode = opcodes[op];
+    r.pc = d->pc;
+    return StopReason { _trap, d->pc, _trap_address, cycles - d->opcode->cycles };
+
+#undef FUSED
+#undef HANDLER
+#undef NEXT
+}
+
+#undef OPCODES
+#undef ROW
+
 
-    // find values
-    uint8_t sz;
-    vector<Parameter> pars = ParseParameters(opcode, sz);
+// Nothing is pushed if the stack faults.
+StopReason CPU::Interrupt(uint32_t handler, bool from_user)
+{
+    _trap = StopReason::NONE;
+    uint32_t sp = SP, fl = FL;
+    InPlace r(*this);
+    if(from_user) {
+        SP = comp.mmu().Stack();
+        Push32(r, sp);
+    }
+    SetFlag(fl, UM, from_user);
+    Push32(r, PC);
+    Push32(r, fl);
+    if(_trap != StopReason::NONE && _trap != YIELD) {
+        SP = sp;
+        return StopReason { _trap, PC, _trap_address, 0 };
+    }
+    SetFlag(FL, IM, true);
+    SetFlag(FL, UM, false);
+    PC = handler;
+    Waiting = false;
+    _loop = NO_LOOP;
+    return StopReason {};
+}
+
+// }}}
+
+// {{{ instructions
+
+template<Instruction I, int N, int P0, int P1, typename R>
+inline void CPU::Execute(R& r, Decoded const& d)
+{
+    Parameter const* pars = d.par;
 
-    // execute
-    switch(opcode.instruction) {
+    switch(I) {
         case MOV:  
-            Apply(pars[0], Take(pars[1])); 
+            Apply<P0>(r, pars[0], Take<P1>(pars[1])); 
             break;
         case MOVB: 
-            Apply(pars[0], static_cast<uint8_t>(Take(pars[1])), 8); 
+            Apply<P0>(r, pars[0], static_cast<uint8_t>(Take<P1>(pars[1])), 8); 
             break;
         case MOVW: 
-            Apply(pars[0], static_cast<uint16_t>(Take(pars[1])), 16);
+            Apply<P0>(r, pars[0], static_cast<uint16_t>(Take<P1>(pars[1])), 16);
             break;
         case MOVD: 
-            Apply(pars[0], Take(pars[1]), 32);
+            Apply<P0>(r, pars[0], Take<P1>(pars[1]), 32);
             break;
         case SWAP: {
-                uint32_t tmp = Take(pars[1]);
-                Apply(pars[1], Take(pars[0]));
-                Apply(pars[0], tmp);
+                uint32_t tmp = Take<P1>(pars[1]);
+                Apply<P1>(r, pars[1], Take<P0>(pars[0]));
+                Apply<P0>(r, pars[0], tmp);
             }
             break;
         case OR:   
-            Apply(pars[0], Take(pars[0]) | Take(pars[1])); 
+            Apply<P0>(r, pars[0], Take<P0>(pars[0]) | Take<P1>(pars[1])); 
             break;
         case XOR:  
-            Apply(pars[0], Take(pars[0]) ^ Take(pars[1])); 
+            Apply<P0>(r, pars[0], Take<P0>(pars[0]) ^ Take<P1>(pars[1])); 
             break;
         case AND:
-            Apply(pars[0], Take(pars[0]) & Take(pars[1])); 
+            Apply<P0>(r, pars[0], Take<P0>(pars[0]) & Take<P1>(pars[1])); 
             break;
         case SHL:
-            Apply(pars[0], Take(pars[0]) << Take(pars[1])); 
+            Apply<P0>(r, pars[0], Take<P0>(pars[0]) << Take<P1>(pars[1])); 
             break;
         case SHR:
-            Apply(pars[0], Take(pars[0]) >> Take(pars[1])); 
+            Apply<P0>(r, pars[0], Take<P0>(pars[0]) >> Take<P1>(pars[1])); 
             break;
         case NOT:
-            Apply(pars[0], ~Take(pars[0])); 
+            Apply<P0>(r, pars[0], ~Take<P0>(pars[0])); 
             break;
         case ADD: {
-                uint64_t value = static_cast<uint64_t>(Take(pars[0])) + static_cast<uint64_t>(Take(pars[1])) + static_cast<uint64_t>(Flag(Flag::Y));
+                uint64_t value = static_cast<uint64_t>(Take<P0>(pars[0])) + static_cast<uint64_t>(Take<P1>(pars[1])) + static_cast<uint64_t>(r.Flag(Flag::Y));
                 bool y = value > 0xFFFFFFFF;
-                Apply(pars[0], static_cast<uint32_t>(value));
-                setFlag(Flag::Y, y);
+                Apply<P0>(r, pars[0], static_cast<uint32_t>(value));
+                r.Extra(Flag::Y, y);
             }
             break;
         case SUB: {
-                int64_t value = static_cast<int64_t>(Take(pars[0])) - static_cast<int64_t>(Take(pars[1])) - static_cast<int64_t>(Flag(Flag::Y));
+                int64_t value = static_cast<int64_t>(Take<P0>(pars[0])) - static_cast<int64_t>(Take<P1>(pars[1])) - static_cast<int64_t>(r.Flag(Flag::Y));
                 bool y = value < 0;
-                Apply(pars[0], static_cast<uint32_t>(value));
-                setFlag(Flag::Y, y);
+                Apply<P0>(r, pars[0], static_cast<uint32_t>(value));
+                r.Extra(Flag::Y, y);
             }
             break;
         case CMP: {
-                uint32_t p0 = Take(pars[0]), p1 = pars.size() == 1 ? p0 : Take(pars[1]);
-                uint32_t diff = p0 - p1 - static_cast<uint32_t>(Flag(Flag::Y));
-                setFlag(Flag::Z, diff == 0);
-                setFlag(Flag::S, ((diff >> 31) & 1) != 0);
-                setFlag(Flag::V, false);
-                setFlag(Flag::Y, (static_cast<int64_t>(p0) - static_cast<int64_t>(p1) - static_cast<int64_t>(Flag(Flag::Y))) < 0);
-                setFlag(Flag::GT, p0 > p1);
-                setFlag(Flag::LT, p1 > p0);
+                uint32_t p0 = Take<P0>(pars[0]), p1 = (N == ANY ? d.n_pars : N) == 1 ? p0 : Take<P1>(pars[1]);
+                r.Compare(p0, p1, r.Flag(Flag::Y));
             }
             break;
         case MUL: {
-                uint64_t value = static_cast<uint64_t>(Take(pars[0])) * static_cast<uint64_t>(Take(pars[1]));
+                uint64_t value = static_cast<uint64_t>(Take<P0>(pars[0])) * static_cast<uint64_t>(Take<P1>(pars[1]));
                 bool v = value > 0xFFFFFFFF;
-                Apply(pars[0], static_cast<uint32_t>(value));
-                setFlag(Flag::V, v);
+                Apply<P0>(r, pars[0], static_cast<uint32_t>(value));
+                r.Extra(Flag::V, v);
+            }
+            break;
+        case IDIV: case MOD: {
+                uint32_t divisor = Take<P1>(pars[1]);
+                if(divisor == 0) {
+                    _trap = StopReason::DIVISION_BY_ZERO;
+                    return;
+                }
+                uint32_t dividend = Take<P0>(pars[0]);
+                Apply<P0>(r, pars[0], (I == IDIV) ? (dividend / divisor) : (dividend % divisor));
             }
             break;
-        case IDIV: Apply(pars[0], Take(pars[0]) / Take(pars[1])); break;
-        case MOD:  Apply(pars[0], Take(pars[0]) % Take(pars[1])); break;
         case INC: {
-                bool y = (static_cast<uint64_t>(Take(pars[0])) + 1) > 0xFFFFFFFF;
-                Apply(pars[0], Take(pars[0])+1);
-                setFlag(Flag::Y, y);
+                bool y = (static_cast<uint64_t>(Take<P0>(pars[0])) + 1) > 0xFFFFFFFF;
+                Apply<P0>(r, pars[0], Take<P0>(pars[0])+1);
+                r.Extra(Flag::Y, y);
             }
             break;
         case DEC: {
-                bool y = (static_cast<int64_t>(Take(pars[0])) + 1) < 0;
-                Apply(pars[0], Take(pars[0])-1);
-                setFlag(Flag::Y, y);
+                bool y = (static_cast<int64_t>(Take<P0>(pars[0])) + 1) < 0;
+                Apply<P0>(r, pars[0], Take<P0>(pars[0])-1);
+                r.Extra(Flag::Y, y);
             }
             break;
         case BZ:
-            if(Flag(Flag::Z)) { 
-                PC = Take(pars[0]); 
+            if(r.Flag(Flag::Z)) { 
+                r.pc = Take<P0>(pars[0]); 
                 return; 
             }
             break;
         case BNZ:
-            if(!Flag(Flag::Z)) {
-                PC = Take(pars[0]);
+            if(!r.Flag(Flag::Z)) {
+                r.pc = Take<P0>(pars[0]);
                 return;
             } 
             break;
         case BNEG:
-            if(Flag(Flag::S)) {
-                PC = Take(pars[0]);
+            if(r.Flag(Flag::S)) {
+                r.pc = Take<P0>(pars[0]);
                 return;
             }
             break;
         case BPOS:
-            if(!Flag(Flag::S)) {
-                PC = Take(pars[0]);
+            if(!r.Flag(Flag::S)) {
+                r.pc = Take<P0>(pars[0]);
                 return;
             }
             break;
         case BGT:
-            if(Flag(Flag::GT) && !Flag(Flag::Z)) {
-                PC = Take(pars[0]);
+            if(r.Flag(Flag::GT) && !r.Flag(Flag::Z)) {
+                r.pc = Take<P0>(pars[0]);
                 return;
             }
             break;
         case BGTE:
-            if(Flag(Flag::GT) && Flag(Flag::Z)) {
-                PC = Take(pars[0]);
+            if(r.Flag(Flag::GT) && r.Flag(Flag::Z)) {
+                r.pc = Take<P0>(pars[0]);
                 return;
             }
             break;
         case BLT:
-            if(Flag(Flag::LT) && !Flag(Flag::Z)) {
-                PC = Take(pars[0]);
+            if(r.Flag(Flag::LT) && !r.Flag(Flag::Z)) {
+                r.pc = Take<P0>(pars[0]);
                 return;
             }
             break;
         case BLTE:
-            if(Flag(Flag::LT) && Flag(Flag::Z)) {
-                PC = Take(pars[0]);
+            if(r.Flag(Flag::LT) && r.Flag(Flag::Z)) {
+                r.pc = Take<P0>(pars[0]);
                 return;
             }
             break;
         case BV:
-            if(Flag(Flag::V)) {
-                PC = Take(pars[0]);
+            if(r.Flag(Flag::V)) {
+                r.pc = Take<P0>(pars[0]);
                 return;
             }
             break;
         case BNV:
-            if(!Flag(Flag::V)) {
-                PC = Take(pars[0]);
+            if(!r.Flag(Flag::V)) {
+                r.pc = Take<P0>(pars[0]);
                 return;
             }
             break;
         case JMP:
-            PC = Take(pars[0]);
+            r.pc = Take<P0>(pars[0]);
             return;
         case JSR:
-            Push32(PC + sz);
-            PC = Take(pars[0]);
+            Push32(r, r.pc + d.sz);
+            r.pc = Take<P0>(pars[0]);
+            return;
+        case IRET:
+            {
+                uint32_t fl = Pop32(r);
+                r.pc = Pop32(r);
+                if(comp.Translating()) {   // a task can't mask the interrupts, or leave user mode
+                    fl = (fl & ~SUPERVISOR_FLAGS) | (r.Flags() & SUPERVISOR_FLAGS);
+                } else if(GetFlag(fl, UM)) {
+                    r.sp = Pop32(r);
+                    SetFlag(fl, UM, false);
+                    comp.mmu().Enable(true);
+                }
+                r.SetFlags(fl);
+            }
             return;
         case RET:
-            PC = Pop32(); return;
+            r.pc = Pop32(r); 
+            return;
         case PUSHB:  
-            Push8(static_cast<uint8_t>(Take(pars[0]))); 
+            Push8(r, static_cast<uint8_t>(Take<P0>(pars[0]))); 
             break;
         case PUSHW:
-            Push16(static_cast<uint16_t>(Take(pars[0]))); 
+            Push16(r, static_cast<uint16_t>(Take<P0>(pars[0]))); 
             break;
         case PUSHD:
-            Push32(Take(pars[0])); 
+            Push32(r, Take<P0>(pars[0])); 
             break;
         case PUSH_A:
             for(int i=0; i<=11; ++i) { 
-                Push32(Register[i]);
+                Push32(r, Register[i]);
             }
             break;
         case POPB:
-            Apply(pars[0], Pop8());
+            Apply<P0>(r, pars[0], Pop8(r));
             break;
         case POPW:
-            Apply(pars[0], Pop16());
+            Apply<P0>(r, pars[0], Pop16(r));
             break;
         case POPD:
-            Apply(pars[0], Pop32());
+            Apply<P0>(r, pars[0], Pop32(r));
             break;
         case POP_A:
             for(int i=11; i>=0; --i) { 
-                Register[i] = Pop32();
+                Register[i] = Pop32(r);
             }
             break;
         case POPX:
-            for(size_t i=0; i<Take(pars[0]); ++i) {
-                Pop8();
-            }
+            r.sp += Take<P0>(pars[0]);
             break;
         case NOP:
             break;
+        case WAIT:
+            Waiting = true;
+            break;
         case INVALID:
         default:
-            throw logic_error("Invalid opcode " + to_string(op));
+            throw logic_error("Invalid opcode " + to_string(comp.Get(r.pc)));
+    }
+
+    r.pc += d.sz;
+}
+
+
+void CPU::ExecuteAny(InPlace& r, Decoded const& d)
+{
+    switch(d.opcode->instruction) {
+        case MOV:    Execute<MOV>(r, d);    break;
+        case MOVB:   Execute<MOVB>(r, d);   break;
+        case MOVW:   Execute<MOVW>(r, d);   break;
+        case MOVD:   Execute<MOVD>(r, d);   break;
+        case SWAP:   Execute<SWAP>(r, d);   break;
+        case OR:     Execute<OR>(r, d);     break;
+        case XOR:    Execute<XOR>(r, d);    break;
+        case AND:    Execute<AND>(r, d);    break;
+        case SHL:    Execute<SHL>(r, d);    break;
+        case SHR:    Execute<SHR>(r, d);    break;
+        case NOT:    Execute<NOT>(r, d);    break;
+        case ADD:    Execute<ADD>(r, d);    break;
+        case SUB:    Execute<SUB>(r, d);    break;
+        case CMP:    Execute<CMP>(r, d);    break;
+        case MUL:    Execute<MUL>(r, d);    break;
+        case IDIV:   Execute<IDIV>(r, d);   break;
+        case MOD:    Execute<MOD>(r, d);    break;
+        case INC:    Execute<INC>(r, d);    break;
+        case DEC:    Execute<DEC>(r, d);    break;
+        case BZ:     Execute<BZ>(r, d);     break;
+        case BNZ:    Execute<BNZ>(r, d);    break;
+        case BNEG:   Execute<BNEG>(r, d);   break;
+        case BPOS:   Execute<BPOS>(r, d);   break;
+        case BGT:    Execute<BGT>(r, d);    break;
+        case BGTE:   Execute<BGTE>(r, d);   break;
+        case BLT:    Execute<BLT>(r, d);    break;
+        case BLTE:   Execute<BLTE>(r, d);   break;
+        case BV:     Execute<BV>(r, d);     break;
+        case BNV:    Execute<BNV>(r, d);    break;
+        case JMP:    Execute<JMP>(r, d);    break;
+        case JSR:    Execute<JSR>(r, d);    break;
+        case IRET:   Execute<IRET>(r, d);   break;
+        case RET:    Execute<RET>(r, d);    break;
+        case PUSHB:  Execute<PUSHB>(r, d);  break;
+        case PUSHW:  Execute<PUSHW>(r, d);  break;
+        case PUSHD:  Execute<PUSHD>(r, d);  break;
+        case PUSH_A: Execute<PUSH_A>(r, d); break;
+        case POPB:   Execute<POPB>(r, d);   break;
+        case POPW:   Execute<POPW>(r, d);   break;
+        case POPD:   Execute<POPD>(r, d);   break;
+        case POP_A:  Execute<POP_A>(r, d);  break;
+        case POPX:   Execute<POPX>(r, d);   break;
+        case NOP:    Execute<NOP>(r, d);    break;
+        case WAIT:   Execute<WAIT>(r, d);   break;
+        case INVALID:
+        default:
+            throw logic_error("Invalid opcode " + to_string(comp.Get(r.pc)));
+    }
+}
+
+// }}}
+
+// {{{ decoding
+
+CPU::Decoded const& CPU::Decode(uint32_t pc)
+{
+    Decoded& d = _decoded[pc & (DECODE_CACHE_SIZE - 1)];
+    if(d.valid && d.pc == pc) {
+        return d;
     }
 
-    PC += sz;
+    // faults while fetching are told apart from one already pending
+    StopReason::Kind pending = _trap;
+    uint32_t pending_address = _trap_address;
+    _trap = StopReason::NONE;
+    Fetch(pc, d);
+    if(_trap != StopReason::NONE) {
+        // it couldn't be fetched whole, so it runs as an invalid instruction
+        d.valid = false;
+        d.handler = 0;
+    } else {
+        _trap = pending;
+        _trap_address = pending_address;
+    }
+    return d;
 }
 
 
-vector<CPU::Parameter> CPU::ParseParameters(Opcode const& opcode, uint8_t& sz) const
+void CPU::Fetch(uint32_t pc, Decoded& d)
 {
-    uint32_t pos = PC + 1;
-    sz = 1;
-    vector<Parameter> par;
-    int i = 0;
-    for(ParameterType pt: opcode.parameter) {
+    uint8_t op = comp.Get(pc);
+    if(op >= opcodes.size() || !opcodes[op].Valid()) {
+        // the handler of an invalid opcode traps; not cached
+        d.valid = false;
+        d.pc = pc;
+        d.opcode = &opcodes[0];
+        d.handler = op;
+        d.sz = 1;
+        d.n_pars = 0;
+        return;
+    }
+    Opcode const& opcode = opcodes[op];
+
+    d.pc = pc;
+    d.opcode = &opcode;
+    d.handler = op;
+    d.sz = opcode.sz;
+    ParseParameters(pc, opcode, d.par);
+    d.n_pars = opcode.n_pars;
+    for(uint8_t i=0; i<d.n_pars; ++i) {
+        if(d.par[i].type == REG || d.par[i].type == INDREG) {
+            if(d.par[i].value >= 16) {
+                d.handler = HANDLER_INVALID_REGISTER;
+                break;
+            } else if(d.par[i].value >= 13) {
+                // PC, SP and FL are not in the register array while running
+                d.handler = HANDLER_SPECIAL;
+            }
+        }
+    }
+    if(opcode.instruction == WAIT || (d.handler == op && IdleLoop(d, false))) {
+        d.handler = HANDLER_WAIT;
+    }
+    uint8_t sz = d.sz;
+    if(_trap != StopReason::NONE) {
+        return;
+    }
+
+    // fusion with the next instruction; looking at it must not fault
+    if(d.handler == op && pc + sz < comp.PhysicalMemory().size()) {
+        uint8_t next = comp.Get(pc + sz);
+        _trap = StopReason::NONE;
+        for(uint8_t f=0; f<FUSION_COUNT; ++f) {
+            if(_fusion_enabled[f] && fused_pairs[f].first == opcode.instruction && next < opcodes.size()
+                    && opcodes[next].Valid() && opcodes[next].instruction == fused_pairs[f].second) {
+                d.handler = static_cast<uint16_t>(HANDLER_FUSED + f);
+                break;
+            }
+        }
+    }
+
+    // instructions outside of the physical memory are decoded every time
+    uint32_t first = pc >> CODE_BLOCK_BITS,
+             last = (pc + sz - 1) >> CODE_BLOCK_BITS;
+    d.valid = (first <= last && last < _code_block.size());
+    if(d.valid) {
+        _code_block[first] = _code_block[last] = true;
+    }
+}
+
+
+void CPU::InvalidateDecoded(uint32_t pos, uint32_t sz)
+{
+    uint32_t first = pos >> CODE_BLOCK_BITS,
+             last = min<uint32_t>((pos + sz - 1) >> CODE_BLOCK_BITS, static_cast<uint32_t>(_code_block.size() - 1));
+    bool has_code = false;
+    for(uint32_t block=first; block<=last && !has_code; ++block) {
+        has_code = _code_block[block];
+    }
+    if(!has_code) {
+        return;
+    }
+
+    // any instruction starting up to MAX_INSTRUCTION_SZ-1 bytes before 
+    // the position might contain it
+    for(uint32_t i=0; i<MAX_INSTRUCTION_SZ+sz-1 && i<=pos+sz-1; ++i) {
+        uint32_t start = pos + sz - 1 - i;
+        Decoded& d = _decoded[start & (DECODE_CACHE_SIZE - 1)];
+        if(d.valid && d.pc == start && start + d.sz > pos) {
+            d.valid = false;
+        }
+    }
+}
+
+
+void CPU::FlushDecoded()
+{
+    for(Decoded& d: _decoded) {
+        d.valid = false;
+    }
+    fill(begin(_code_block), end(_code_block), false);
+}
+
+
+void CPU::EnableFusion(Fusion f, bool enabled)
+{
+    _fusion_enabled[f] = enabled;
+    FlushDecoded();
+}
+
+
+char const* CPU::FusionName(Fusion f)
+{
+    return fused_pairs[f].name;
+}
+
+
+void CPU::ParseParameters(uint32_t pc, Opcode const& opcode, Parameter* par) const
+{
+    uint32_t pos = pc + 1;
+    for(uint8_t i=0; i<opcode.n_pars; ++i) {
+        ParameterType pt = opcode.parameter[i];
         switch(pt) {
             case REG: case INDREG: case V8:
-                sz += 1;
-                par.push_back({ pt, comp.Get(pos) });
+                par[i] = { pt, comp.Get(pos) };
                 pos += 1;
                 break;
             case V16:
-                sz += 2;
-                par.push_back({ pt, comp.Get16(pos) });
+                par[i] = { pt, comp.Get16(pos) };
                 pos += 2;
                 break;
             case V32: case INDV32:
-                sz += 4;
-                par.push_back({ pt, comp.Get32(pos) });
+                par[i] = { pt, comp.Get32(pos) };
                 pos += 4;
                 break;
         }
-        ++i;
     }
 
-    if(opcode.parameter.size() == 2 && (opcode.parameter[0] == REG || opcode.parameter[0] == INDREG)
-                                    && (opcode.parameter[1] == REG || opcode.parameter[1] == INDREG)) {
+    if(opcode.Packed()) {
         par[1].value = par[0].value & 0xF;
         par[0].value >>= 4;
-        --sz;
     }
+}
+
 
-    return par;
+// A branch to a constant address, either to itself or back over a polling
+// loop (see PollingLoop). The loop is read again from the memory, since it
+// might have been rewritten after the branch was decoded. When running, the
+// memory it reads is checked too: some device registers, like the timer's
+// counter, change without waking the CPU.
+bool CPU::IdleLoop(Decoded const& branch, bool check_memory)
+{
+    Instruction ins = branch.opcode->instruction;
+    if((ins < BZ || ins > BNV) && ins != JMP) {
+        return false;
+    }
+    uint32_t start = branch.par[0].value;
+    if(branch.par[0].type != V32 || start > branch.pc || branch.pc - start > MAX_POLLING_LOOP * MAX_INSTRUCTION_SZ) {
+        return false;
+    }
+
+    // reading the loop must not fault
+    StopReason::Kind pending = _trap;
+    uint32_t pending_address = _trap_address;
+    _trap = StopReason::NONE;
+
+    Decoded body[MAX_POLLING_LOOP];
+    Decoded const* loop[MAX_POLLING_LOOP];
+    size_t n = 0;
+    uint32_t pc = start;
+    while(pc < branch.pc && n < MAX_POLLING_LOOP && _trap == StopReason::NONE) {
+        uint8_t op = comp.Get(pc);
+        if(op >= opcodes.size() || !opcodes[op].Valid()) {
+            break;
+        }
+        body[n].pc = pc;
+        body[n].opcode = &opcodes[op];
+        body[n].n_pars = opcodes[op].n_pars;
+        ParseParameters(pc, opcodes[op], body[n].par);
+        loop[n] = &body[n];
+        pc += opcodes[op].sz;
+        ++n;
+    }
+    bool idle = pc == branch.pc && _trap == StopReason::NONE && PollingLoop(loop, n);
+
+    for(size_t i=0; i<n && idle && check_memory; ++i) {
+        Parameter const& p = body[i].par[1];
+        Instruction load = body[i].opcode->instruction;
+        if((load == MOVB || load == MOVW || load == MOVD) && (p.type == INDREG || p.type == INDV32)) {
+            uint32_t pos = (p.type == INDREG) ? Register[p.value] : p.value;
+            idle = comp.Steady(pos, (load == MOVB) ? 1 : (load == MOVW) ? 2 : 4);
+        }
+    }
+
+    _trap = pending;
+    _trap_address = pending_address;
+    return idle;
 }
 
 
-void CPU::Apply(Parameter const& dest, uint32_t value, uint8_t sz)
+// When the parameter kind `P` is known at compile time, the switches are 
+// resolved by the compiler. Registers were already checked by Decode: 
+// instructions naming an invalid register never run.
+template<int P, typename R>
+inline void CPU::Apply(R& r, Parameter const& dest, uint32_t value, uint8_t sz)
 {
-    setFlag(Z, value == 0);
-    setFlag(S, ((value >> 31) & 1) != 0);
-    setFlag(V, false);
-    setFlag(Y, false);
-    setFlag(GT, false);
-    setFlag(LT, false);
-
-    switch(dest.type) {
+    r.Result(value);
+
+    switch((P == ANY) ? dest.type : static_cast<ParameterType>(P)) {
         case REG:
-            if(dest.value >= 16) {
-                throw logic_error("Invalid register");
-            }
             Register[dest.value] = value;
             break;
         case INDREG:
-            if(dest.value >= 16) {
-                throw logic_error("Invalid register");
-            }
             switch(sz) {
                 case 8: 
                     comp.Set(Register[dest.value], static_cast<uint8_t>(value)); 
@@ -316,9 +845,11 @@ void CPU::Apply(Parameter const& dest, uint32_t value, uint8_t sz)
 }
 
 
-uint32_t CPU::Take(Parameter const& orig)
+template<int P>
+inline uint32_t CPU::Take(Parameter const& orig)
 {
-    switch(orig.type) {
+    ParameterType type = (P == ANY) ? orig.type : static_cast<ParameterType>(P);
+    switch(type) {
         case REG:                    return Register[orig.value];
         case V8: case V16: case V32: return orig.value;
         case INDV32:                 return comp.Get32(orig.value);
@@ -335,57 +866,95 @@ uint32_t CPU::Take(Parameter const& orig)
 
 bool CPU::Flag(enum Flag f) const
 {
-    return static_cast<bool>((FL >> static_cast<int>(f)) & 1);
+    return GetFlag(FL, f);
 }
 
 
 void CPU::setFlag(enum Flag f, bool value)
 {
-    int64_t new_value = FL;
+    SetFlag(FL, f, value);
+}
+
+
+bool CPU::GetFlag(uint32_t fl, enum Flag f)
+{
+    return static_cast<bool>((fl >> static_cast<int>(f)) & 1);
+}
+
+
+void CPU::SetFlag(uint32_t& fl, enum Flag f, bool value)
+{
+    int64_t new_value = fl;
     new_value ^= (-static_cast<int>(value) ^ new_value) & (1 << static_cast<int>(f));
-    FL = static_cast<uint32_t>(new_value);
+    fl = static_cast<uint32_t>(new_value);
 }
 
+
+// sets Z and S, clears V, Y, GT and LT
+uint32_t CPU::ResultFlags(uint32_t value)
+{
+    return (static_cast<uint32_t>(value == 0) << Flag::Z) 
+         | (((value >> 31) & 1) << Flag::S);
+}
+
+
+uint32_t CPU::CompareFlags(uint32_t p0, uint32_t p1, bool y)
+{
+    uint32_t diff = p0 - p1 - static_cast<uint32_t>(y);
+    return (static_cast<uint32_t>((static_cast<int64_t>(p0) - static_cast<int64_t>(p1) - static_cast<int64_t>(y)) < 0) << Flag::Y)
+         | (static_cast<uint32_t>(diff == 0) << Flag::Z)
+         | (((diff >> 31) & 1) << Flag::S)
+         | (static_cast<uint32_t>(p0 > p1) << Flag::GT)
+         | (static_cast<uint32_t>(p1 > p0) << Flag::LT);
+}
+
+
 // }}}
 
 // {{{ stack operations
 
-void CPU::Push8(uint8_t value)
+template<typename R>
+inline void CPU::Push8(R& r, uint8_t value)
 {
-    comp.Set(SP, value);
-    SP -= 1;
+    comp.Set(r.sp, value);
+    r.sp -= 1;
 }
 
-void CPU::Push16(uint16_t value)
+template<typename R>
+inline void CPU::Push16(R& r, uint16_t value)
 {
-    SP -= 1;
-    comp.Set16(SP, value);
-    SP -= 1;
+    r.sp -= 1;
+    comp.Set16(r.sp, value);
+    r.sp -= 1;
 }
 
-void CPU::Push32(uint32_t value)
+template<typename R>
+inline void CPU::Push32(R& r, uint32_t value)
 {
-    SP -= 3;
-    comp.Set32(SP, value);
-    SP -= 1;
+    r.sp -= 3;
+    comp.Set32(r.sp, value);
+    r.sp -= 1;
 }
 
-uint8_t CPU::Pop8() {
-    SP += 1;
-    return comp.Get(SP);
+template<typename R>
+inline uint8_t CPU::Pop8(R& r) {
+    r.sp += 1;
+    return comp.Get(r.sp);
 }
 
-uint16_t CPU::Pop16() {
-    SP += 1;
-    uint16_t value = comp.Get16(SP);
-    SP += 1;
+template<typename R>
+inline uint16_t CPU::Pop16(R& r) {
+    r.sp += 1;
+    uint16_t value = comp.Get16(r.sp);
+    r.sp += 1;
     return value;
 }
 
-uint32_t CPU::Pop32() {
-    SP += 1;
-    uint32_t value = comp.Get32(SP);
-    SP += 3;
+template<typename R>
+inline uint32_t CPU::Pop32(R& r) {
+    r.sp += 1;
+    uint32_t value = comp.Get32(r.sp);
+    r.sp += 3;
     return value;
 }
 
@@ -3,6 +3,8 @@
 
 #include <array>
 #include <cstdint>
+#include <string>
+#include <vector>
 using namespace std;
 
 #include "device.hh"
@@ -10,17 +12,85 @@ using namespace std;
 
 namespace luisavm {
 
-enum Flag { Y, V, Z, S, GT, LT };
+enum Flag { Y, V, Z, S, GT, LT, IM, UM };   // IM: interrupts masked, UM: iret returns to user mode (see MMU)
+
+// Why the CPU stopped running. On a trap, PC points to the faulting 
+// instruction, which might have been partially executed.
+struct StopReason {
+    enum Kind : uint8_t { NONE, INVALID_OPCODE, INVALID_REGISTER, UNMAPPED_MEMORY, DIVISION_BY_ZERO, SEGMENT_FAULT };
+
+    Kind     kind = NONE;       // NONE: the cycles ran out
+    uint32_t pc = 0;
+    uint32_t address = 0;       // for UNMAPPED_MEMORY and SEGMENT_FAULT
+    uint64_t cycles = 0;        // of the instructions executed (Opcode::cycles), not counting the faulting one
+
+    bool   Trapped() const { return kind != NONE; }
+    string Description() const;
+};
 
 class CPU : public Device {
 public:
-    explicit CPU(class LuisaVM& comp) : comp(comp) {}
-    void Reset() override;
-    void Step() override;
+    explicit CPU(class LuisaVM& comp);
+    void       Reset() override;
+    void       Step() override;
+
+    vector<uint8_t> SaveState() const override;   // the registers, flags included
+    void            LoadState(vector<uint8_t> const& data) override;
+
+    StopReason Run(uint64_t max_cycles);
+
+    // Calls an interrupt handler: pushes PC and FL, sets the IM flag (so no
+    // other interrupt is taken until `iret`) and jumps to `handler`. Coming
+    // from user mode, the handler runs on the supervisor stack, with the task's
+    // SP pushed first and UM set in the FL pushed. Returns a trap if the stack
+    // can't be written.
+    StopReason Interrupt(uint32_t handler, bool from_user);
+
+    // records a fault to be reported by Run (called by the memory); only the
+    // first one of each instruction is kept
+    void Trap(StopReason::Kind kind, uint32_t address=0) {
+        if(_trap == StopReason::NONE || _trap == YIELD) {
+            _trap = kind;
+            _trap_address = address;
+        }
+    }
+
+    // Makes Run (and the JIT) return after the current instruction, so that
+    // LuisaVM::Run looks at the device events again. The native code only
+    // returns at the end of its budget.
+    void Yield() {
+        _yield = true;
+        if(_trap == StopReason::NONE) {
+            _trap = YIELD;
+        }
+    }
+
+    // Cycles run in the current slice of LuisaVM::Run, as of the start of 
+    // the last instruction that accessed memory (in the native code, as of
+    // the start of the slice). NewSlice starts counting again.
+    uint64_t Elapsed() const { return _elapsed; }
+    void     NewSlice()      { _elapsed = _elapsed_base = 0; _yield = false; }
+
+    void InvalidateDecoded(uint32_t pos, uint32_t sz=1);
+    void FlushDecoded();
+
+    // adjacent instructions run by a single handler
+    enum Fusion { FUSE_CMP_BZ, FUSE_CMP_BNZ, FUSE_DEC_BNZ, FUSE_MOV_ADD, FUSION_COUNT };
+
+    void               EnableFusion(Fusion f, bool enabled);
+    bool               FusionEnabled(Fusion f) const { return _fusion_enabled[f]; }
+    uint64_t           FusionCount(Fusion f) const   { return _fusion_count[f]; }   // times it was executed
+    static char const* FusionName(Fusion f);
 
     bool Flag(enum Flag f) const;
     void setFlag(enum Flag f, bool value);
 
+    // Set by `wait`, by a branch to itself, or by a branch back over a short
+    // loop polling the memory (see PollingLoop): the CPU does nothing until a
+    // device event wakes it up. Running the CPU directly also wakes it.
+    bool Waiting = false;
+    bool Polling = false;   // waiting in a polling loop, which a masked interrupt line also ends
+
     array<uint32_t, 16> Register = {{0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0}};
 
     uint32_t& A = Register[0];
@@ -48,18 +118,114 @@ public:
     };
 
 private:
-    vector<Parameter> ParseParameters(Opcode const& opcode, uint8_t& sz) const;
-    void     Apply(Parameter const& dest, uint32_t value, uint8_t sz=0);
-    uint32_t Take(Parameter const& orig);
+    friend class JIT;
+    friend class Native;
+
+    // decoded instruction, cached by PC
+    struct Decoded {
+        bool          valid = false;
+        uint32_t      pc = 0;
+        Opcode const* opcode = nullptr;
+        uint16_t      handler = 0;
+        uint8_t       sz = 0;
+        uint8_t       n_pars = 0;
+        Parameter     par[2] = {};
+    };
+
+    static constexpr uint32_t DECODE_CACHE_SIZE = 4096;   // power of 2
+    static constexpr uint8_t  CODE_BLOCK_BITS = 8;        // granularity of the code bitmap
+    static constexpr uint8_t  MAX_INSTRUCTION_SZ = MaxInstructionSize();
+    static constexpr uint16_t HANDLER_SPECIAL = 256;     // handlers below are one per opcode
+    static constexpr uint16_t HANDLER_FUSED = HANDLER_SPECIAL + 1;   // + Fusion
+    static constexpr uint16_t HANDLER_INVALID_REGISTER = HANDLER_FUSED + FUSION_COUNT;
+    static constexpr uint16_t HANDLER_WAIT = HANDLER_INVALID_REGISTER + 1;   // `wait`, or a branch back that might wait
+    static constexpr uint32_t NO_LOOP = 0xFFFFFFFF;
+    static constexpr int      ANY = -1;                  // parameter kind known only at runtime
+    static constexpr StopReason::Kind YIELD = static_cast<StopReason::Kind>(0xFF);   // in `_trap`, not a fault
+
+    // PC, SP and FL copied to local variables while running. The flags are
+    // evaluated lazily: only the last flag-producing operation is recorded,
+    // and Z, S, V, Y, GT and LT are computed when something reads them.
+    struct Locals {
+        explicit Locals(CPU& cpu) : cpu(cpu), pc(cpu.PC), sp(cpu.SP), fl(cpu.FL) {}
+        ~Locals() { Spill(); }
+        void Spill()  { cpu.PC = pc; cpu.SP = sp; cpu.FL = Flags(); }
+        void Reload() { pc = cpu.PC; sp = cpu.SP; fl = cpu.FL; pending = NONE; }
+
+        void Result(uint32_t value)                  { pending = RESULT; a = value; b = 0; }
+        void Extra(enum Flag f, bool value)          { b |= static_cast<uint32_t>(value) << f; }
+        void Compare(uint32_t p0, uint32_t p1, bool y) { pending = COMPARE; a = p0; b = p1; c = y; }
+        bool Flag(enum Flag f) const                 { return ((Flags() >> f) & 1) != 0; }
+        void SetFlags(uint32_t value)                { pending = NONE; fl = value; }
+        uint32_t Flags() const {
+            switch(pending) {
+                case RESULT:  return (fl & ~0x3Fu) | ResultFlags(a) | b;
+                case COMPARE: return (fl & ~0x3Fu) | CompareFlags(a, b, c);
+                case NONE: default: return fl;
+            }
+        }
+
+        CPU&     cpu;
+        uint32_t pc, sp, fl;
+        enum : uint8_t { NONE, RESULT, COMPARE } pending = NONE;
+        uint32_t a = 0, b = 0;      // RESULT: value, extra flags; COMPARE: operands
+        bool     c = false;         // COMPARE: carry in
+    };
+
+    // PC, SP and FL accessed directly in the register array, flags 
+    // evaluated eagerly
+    struct InPlace {
+        explicit InPlace(CPU& cpu) : pc(cpu.PC), sp(cpu.SP), fl(cpu.FL) {}
+
+        void Result(uint32_t value)                    { fl = (fl & ~0x3Fu) | ResultFlags(value); }
+        void Extra(enum Flag f, bool value)            { SetFlag(fl, f, value); }
+        void Compare(uint32_t p0, uint32_t p1, bool y) { fl = (fl & ~0x3Fu) | CompareFlags(p0, p1, y); }
+        bool Flag(enum Flag f) const                   { return GetFlag(fl, f); }
+        void SetFlags(uint32_t value)                  { fl = value; }
+        uint32_t Flags() const                         { return fl; }
+
+        uint32_t &pc, &sp, &fl;
+    };
+
+    // `N`, `P0` and `P1` are the number and kinds of the parameters, when
+    // known at compile time
+    template<Instruction I, int N=ANY, int P0=ANY, int P1=ANY, typename R> 
+    void Execute(R& r, Decoded const& d);
+    void ExecuteAny(InPlace& r, Decoded const& d);
+
+    Decoded const& Decode(uint32_t pc);
+    void           Fetch(uint32_t pc, Decoded& d);
+    void           ParseParameters(uint32_t pc, Opcode const& opcode, Parameter* par) const;
+    bool           IdleLoop(Decoded const& branch, bool check_memory);
+    template<int P=ANY, typename R> void Apply(R& r, Parameter const& dest, uint32_t value, uint8_t sz=0);
+    template<int P=ANY> uint32_t         Take(Parameter const& orig);
+
+    // flags that a task in user mode can't change
+    static const uint32_t SUPERVISOR_FLAGS = (1u << IM) | (1u << UM);
+
+    static bool     GetFlag(uint32_t fl, enum Flag f);
+    static void     SetFlag(uint32_t& fl, enum Flag f, bool value);
+    static uint32_t ResultFlags(uint32_t value);
+    static uint32_t CompareFlags(uint32_t p0, uint32_t p1, bool y);
 
-    void Push8(uint8_t value);
-    void Push16(uint16_t value);
-    void Push32(uint32_t value);
-    uint8_t Pop8();
-    uint16_t Pop16();
-    uint32_t Pop32();
+    template<typename R> void     Push8(R& r, uint8_t value);
+    template<typename R> void     Push16(R& r, uint16_t value);
+    template<typename R> void     Push32(R& r, uint32_t value);
+    template<typename R> uint8_t  Pop8(R& r);
+    template<typename R> uint16_t Pop16(R& r);
+    template<typename R> uint32_t Pop32(R& r);
 
     class LuisaVM& comp;
+    vector<Decoded> _decoded;
+    vector<bool>    _code_block;    // blocks of memory that contain decoded instructions
+    array<bool, FUSION_COUNT>     _fusion_enabled = {{ true, true, true, true }};
+    array<uint64_t, FUSION_COUNT> _fusion_count = {{ 0, 0, 0, 0 }};
+    StopReason::Kind              _trap = StopReason::NONE;
+    uint32_t                      _trap_address = 0;
+    bool                          _yield = false;
+    uint32_t                      _loop = NO_LOOP;     // branch of a polling loop that was just taken
+    uint64_t                      _elapsed = 0,
+                                  _elapsed_base = 0;   // cycles run in the slice before Run was called
 };
 
 }  // namespace luisavm
@@ -0,0 +1,336 @@
+#include "dedup.hh"
+
+#include <cstring>
+#include <stdexcept>
+using namespace std;
+
+#if defined(__linux__)
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <unistd.h>
+#endif
+
+#include "luisavm.hh"
+
+namespace luisavm {
+
+static const size_t PAGE_SIZE = PageTable::PAGE_SIZE;
+
+static uint64_t Hash(uint8_t const* data)
+{
+    uint64_t h = 0xCBF29CE484222325ull;
+    for(size_t i=0; i<PAGE_SIZE; i+=8) {
+        uint64_t w;
+        memcpy(&w, data + i, sizeof w);
+        h = (h ^ w) * 0x100000001B3ull;
+        h ^= h >> 32;
+    }
+    return h;
+}
+
+
+static bool Zero(uint8_t const* data)
+{
+    static const uint8_t zero[PageTable::PAGE_SIZE] = {};
+    return memcmp(data, zero, PAGE_SIZE) == 0;
+}
+
+
+// replaces the mapping of a page by private memory with the same contents
+static void Privatize(HostMemory& memory, size_t pos)
+{
+    uint8_t copy[PageTable::PAGE_SIZE];
+    memcpy(copy, memory.data() + pos, PAGE_SIZE);
+    memory.Clear(pos, PAGE_SIZE);
+    memcpy(memory.data() + pos, copy, PAGE_SIZE);
+}
+
+// {{{ service
+
+// The frames need to be mapped into the VMs page by page, so the host pages
+// must be the same size as the VM pages.
+bool PageDedup::Supported()
+{
+#if defined(__linux__)
+    return sysconf(_SC_PAGESIZE) == static_cast<long>(PAGE_SIZE);
+#else
+    return false;
+#endif
+}
+
+
+PageDedup::PageDedup()
+{
+#if defined(__linux__)
+    if(Supported()) {
+        _fd = memfd_create("luisavm-dedup", MFD_CLOEXEC);
+    }
+#endif
+    if(_fd < 0) {
+        throw runtime_error("Page deduplication is not supported in this platform.");
+    }
+}
+
+
+// The VMs keep the frames they have mapped: they are only freed when the
+// VMs are destroyed.
+PageDedup::~PageDedup()
+{
+    for(auto& v: _vms) {
+        v.first->_dedup = nullptr;
+        fill(begin(v.first->_shared), end(v.first->_shared), 0);
+    }
+#if defined(__linux__)
+    if(_view) {
+        munmap(_view, static_cast<size_t>(_capacity) * PAGE_SIZE);
+    }
+    close(_fd);
+#endif
+}
+
+
+void PageDedup::Add(LuisaVM& vm)
+{
+    if(vm._dedup == this) {
+        return;
+    } else if(vm._dedup) {
+        throw logic_error("The VM already belongs to another deduplication service.");
+    }
+    vm._dedup = this;
+    vm._shared.assign(vm._dirty.size(), 0);
+    _vms[&vm];
+}
+
+
+// The VM gets its own copy of every shared page back.
+void PageDedup::Remove(LuisaVM& vm)
+{
+    if(vm._dedup == this) {
+        Forget(vm, true);
+    }
+}
+
+
+void PageDedup::Forget(LuisaVM& vm, bool keep_memory)
+{
+    for(auto const& p: _vms[&vm]) {
+        vm._shared[p.first / 64] &= ~(1ull << (p.first % 64));
+        if(p.second == ZERO_FRAME) {
+            --_zero_pages;
+            continue;
+        }
+        if(keep_memory) {
+            Privatize(vm._physical_memory, static_cast<size_t>(p.first) * PAGE_SIZE);
+        }
+        --_pages_shared;
+        Release(p.second);
+    }
+    _vms.erase(&vm);
+    vm._dedup = nullptr;
+}
+
+
+DedupStats PageDedup::Stats() const
+{
+    DedupStats stats;
+    stats.vms = _vms.size();
+    stats.pages_shared = _pages_shared;
+    stats.frames = _frames.size() - _free_frames.size();
+    stats.zero_pages = _zero_pages;
+    return stats;
+}
+
+// }}}
+
+// {{{ scanning
+
+// A page is shared when it matches an existing frame, or another page seen
+// in this scan (a candidate). Candidates are not kept between scans, as
+// their pages could change in the meantime.
+size_t PageDedup::Scan()
+{
+    unordered_map<uint64_t, Candidate> candidates;
+    size_t n = 0;
+    for(auto& v: _vms) {
+        n += Scan(*v.first, candidates);
+    }
+    return n;
+}
+
+
+size_t PageDedup::Scan(LuisaVM& vm, unordered_map<uint64_t, Candidate>& candidates)
+{
+    uint8_t* memory = vm._physical_memory.data();
+    uint32_t n_pages = static_cast<uint32_t>(vm._physical_memory.size() / PAGE_SIZE);
+    auto& pages = _vms[&vm];
+    size_t n = 0;
+
+    // consecutive zero pages are given back at once
+    uint32_t zero_first = 0, zero_count = 0;
+    auto release_zeros = [&]() {
+        if(zero_count == 0) {
+            return;
+        }
+        vm._physical_memory.Clear(static_cast<size_t>(zero_first) * PAGE_SIZE, zero_count * PAGE_SIZE);
+        for(uint32_t page=zero_first; page<zero_first+zero_count; ++page) {
+            vm._shared[page / 64] |= 1ull << (page % 64);
+            vm._copy_on_write[page / 64] |= 1ull << (page % 64);
+            pages[page] = ZERO_FRAME;
+        }
+        _zero_pages += zero_count;
+        n += zero_count;
+        zero_count = 0;
+    };
+
+    for(uint32_t page=0; page<n_pages; ++page) {
+        uint8_t const* data = memory + static_cast<size_t>(page) * PAGE_SIZE;
+        if(vm._shared[page / 64] & (1ull << (page % 64))) {
+            release_zeros();
+            continue;
+        }
+        if(Zero(data)) {
+            if(zero_count++ == 0) {
+                zero_first = page;
+            }
+            continue;
+        }
+        release_zeros();
+
+        uint64_t hash = Hash(data);
+        bool found = false;
+        auto range = _index.equal_range(hash);
+        for(auto it = range.first; it != range.second; ++it) {
+            if(memcmp(FrameData(it->second), data, PAGE_SIZE) == 0) {
+                n += Share(vm, page, it->second) ? 1 : 0;
+                found = true;
+                break;
+            }
+        }
+        if(found) {
+            continue;
+        }
+
+        auto c = candidates.find(hash);
+        if(c != candidates.end() && memcmp(c->second.vm->_physical_memory.data() + static_cast<size_t>(c->second.page) * PAGE_SIZE, data, PAGE_SIZE) == 0) {
+            uint32_t frame = NewFrame(hash, data);
+            n += Share(*c->second.vm, c->second.page, frame) ? 1 : 0;
+            n += Share(vm, page, frame) ? 1 : 0;
+            Release(frame);   // the reference held while creating it
+            candidates.erase(c);
+        } else {
+            candidates[hash] = { &vm, page };
+        }
+    }
+    release_zeros();
+    return n;
+}
+
+// }}}
+
+// {{{ frames
+
+// Maps the frame in place of the page. The mapping is private, so even a
+// write that doesn't go through LuisaVM::Writing won't reach the frame.
+bool PageDedup::Share(LuisaVM& vm, uint32_t page, uint32_t frame)
+{
+    size_t pos = static_cast<size_t>(page) * PAGE_SIZE;
+    if(!vm._physical_memory.TryMapFile(_fd, static_cast<uint64_t>(frame) * PAGE_SIZE, pos, PAGE_SIZE)) {
+        // too many mappings: keep the page as it was
+        vm._physical_memory.Clear(pos, PAGE_SIZE);
+        memcpy(vm._physical_memory.data() + pos, FrameData(frame), PAGE_SIZE);
+        return false;
+    }
+    ++_frames[frame].refs;
+    ++_pages_shared;
+    _vms[&vm][page] = frame;
+    vm._shared[page / 64] |= 1ull << (page % 64);
+    vm._copy_on_write[page / 64] |= 1ull << (page % 64);   // so that LuisaVM::Preserve is called on write
+    return true;
+}
+
+
+// Called by the VM before it writes to a page it doesn't own.
+void PageDedup::Unshare(LuisaVM& vm, uint32_t page)
+{
+    auto& pages = _vms.at(&vm);
+    auto it = pages.find(page);
+    if(it == pages.end()) {
+        return;
+    }
+    uint32_t frame = it->second;
+    pages.erase(it);
+    if(frame == ZERO_FRAME) {
+        --_zero_pages;   // the host gives it a new page on write
+        return;
+    }
+
+    Privatize(vm._physical_memory, static_cast<size_t>(page) * PAGE_SIZE);
+    --_pages_shared;
+    Release(frame);
+}
+
+
+uint32_t PageDedup::NewFrame(uint64_t hash, uint8_t const* data)
+{
+    uint32_t frame;
+    if(!_free_frames.empty()) {
+        frame = _free_frames.back();
+        _free_frames.pop_back();
+    } else {
+        frame = static_cast<uint32_t>(_frames.size());
+        _frames.push_back({ 0, 0 });
+    }
+
+#if defined(__linux__)
+    if(frame >= _capacity) {
+        uint32_t capacity = max(_capacity * 2, 256u);
+        if(ftruncate(_fd, static_cast<off_t>(capacity) * static_cast<off_t>(PAGE_SIZE)) != 0) {
+            throw runtime_error("Could not allocate memory for the shared pages.");
+        }
+        if(_view) {
+            munmap(_view, static_cast<size_t>(_capacity) * PAGE_SIZE);
+        }
+        void* view = mmap(nullptr, static_cast<size_t>(capacity) * PAGE_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, _fd, 0);
+        if(view == MAP_FAILED) {
+            throw runtime_error("Could not allocate memory for the shared pages.");
+        }
+        _view = static_cast<uint8_t*>(view);
+        _capacity = capacity;
+    }
+#endif
+
+    memcpy(FrameData(frame), data, PAGE_SIZE);
+    _frames[frame] = { hash, 1 };
+    _index.emplace(hash, frame);
+    return frame;
+}
+
+
+// A frame no longer used is given back to the host.
+void PageDedup::Release(uint32_t frame)
+{
+    if(--_frames[frame].refs > 0) {
+        return;
+    }
+#if defined(__linux__)
+    fallocate(_fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, static_cast<off_t>(frame) * static_cast<off_t>(PAGE_SIZE), PAGE_SIZE);
+#endif
+    auto range = _index.equal_range(_frames[frame].hash);
+    for(auto it = range.first; it != range.second; ++it) {
+        if(it->second == frame) {
+            _index.erase(it);
+            break;
+        }
+    }
+    _free_frames.push_back(frame);
+}
+
+
+uint8_t* PageDedup::FrameData(uint32_t frame) const
+{
+    return _view + static_cast<size_t>(frame) * PAGE_SIZE;
+}
+
+// }}}
+
+}  // namespace luisavm
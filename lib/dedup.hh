@@ -0,0 +1,87 @@
+#ifndef DEDUP_HH_
+#define DEDUP_HH_
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+using namespace std;
+
+namespace luisavm {
+
+class LuisaVM;
+
+struct DedupStats {
+    size_t vms = 0;
+    size_t pages_shared = 0;   // pages of the VMs mapped to a shared frame
+    size_t frames = 0;         // frames holding these pages
+    size_t zero_pages = 0;     // pages found all zeros, and given back to the host
+
+    size_t PagesSaved() const { return pages_shared - frames + zero_pages; }
+};
+
+// Merges identical pages of the physical memory of many VMs in the same
+// process. A scan hashes the pages that are not shared yet; pages found in
+// more than one place are copied to a frame, which is then mapped into each
+// VM in their place. Writing to a shared page gives the VM its own copy
+// again. Pages that are all zeros are simply given back to the host.
+//
+// Only available on Linux. Scanning must not happen while any of the VMs
+// is running.
+class PageDedup {
+public:
+    PageDedup();
+    ~PageDedup();
+
+    PageDedup(PageDedup const&) = delete;
+    PageDedup& operator=(PageDedup const&) = delete;
+
+    static bool Supported();
+
+    void Add(LuisaVM& vm);
+    void Remove(LuisaVM& vm);
+
+    // returns the number of pages that were shared or given back
+    size_t Scan();
+
+    DedupStats Stats() const;
+
+private:
+    friend class LuisaVM;
+
+    static const uint32_t ZERO_FRAME = 0xFFFFFFFF;
+
+    struct Frame {
+        uint64_t hash;
+        uint32_t refs;
+    };
+
+    struct Candidate {
+        LuisaVM* vm;
+        uint32_t page;
+    };
+
+    size_t   Scan(LuisaVM& vm, unordered_map<uint64_t, Candidate>& candidates);
+    bool     Share(LuisaVM& vm, uint32_t page, uint32_t frame);
+    void     Unshare(LuisaVM& vm, uint32_t page);
+    void     Forget(LuisaVM& vm, bool keep_memory);
+    uint32_t NewFrame(uint64_t hash, uint8_t const* data);
+    void     Release(uint32_t frame);
+    uint8_t* FrameData(uint32_t frame) const;
+
+    int      _fd = -1;                  // the frames live in a memory file
+    uint8_t* _view = nullptr;
+    uint32_t _capacity = 0;
+
+    vector<Frame>                          _frames;
+    vector<uint32_t>                       _free_frames;
+    unordered_multimap<uint64_t, uint32_t> _index;     // hash -> frame
+
+    unordered_map<LuisaVM*, unordered_map<uint32_t, uint32_t>> _vms;   // page -> frame
+    size_t _pages_shared = 0,
+           _zero_pages = 0;
+};
+
+}  // namespace luisavm
+
+#endif
@@ -1,12 +1,55 @@
 #ifndef DEVICE_HH_
 #define DEVICE_HH_
 
+#include <cstdint>
+#include <vector>
+using namespace std;
+
 namespace luisavm {
 
 class Device {
 public:
+    virtual ~Device() {}
+
+    // Called when the time asked for with LuisaVM::Schedule arrives. Devices
+    // that never schedule themselves are not stepped.
     virtual void Step() {}
     virtual void Reset() {}
+
+    // state saved by LuisaVM::SaveState; devices without state that the 
+    // guest can see don't save anything
+    virtual vector<uint8_t> SaveState() const { return {}; }
+    virtual void            LoadState(vector<uint8_t> const&) {}
+
+    // Area of the logical memory handled by the device, registered when it
+    // is added to the computer (none if the size is zero). It must start on
+    // a page boundary. Positions passed to Get/Set are relative to its start.
+    virtual uint32_t MemoryPos() const  { return 0; }
+    virtual uint32_t MemorySize() const { return 0; }
+
+    virtual uint8_t  Get(uint32_t) { return 0; }
+    virtual void     Set(uint32_t, uint8_t) {}
+
+    // Whether the value at a position only changes when the guest writes it
+    // or in an event of the device, which wakes the CPU. A guest loop polling
+    // anything else keeps running rather than waiting (see CPU::Waiting).
+    virtual bool     Steady(uint32_t) const { return true; }
+
+    // called for accesses that don't cross a page boundary
+    virtual uint16_t Get16(uint32_t pos) { 
+        return static_cast<uint16_t>(Get(pos) | (Get(pos+1) << 8)); 
+    }
+    virtual void Set16(uint32_t pos, uint16_t data) { 
+        Set(pos, static_cast<uint8_t>(data)); 
+        Set(pos+1, static_cast<uint8_t>(data >> 8)); 
+    }
+    virtual uint32_t Get32(uint32_t pos) { 
+        return static_cast<uint32_t>(Get16(pos)) | (static_cast<uint32_t>(Get16(pos+2)) << 16); 
+    }
+    virtual void Set32(uint32_t pos, uint32_t data) { 
+        Set16(pos, static_cast<uint16_t>(data)); 
+        Set16(pos+2, static_cast<uint16_t>(data >> 16)); 
+    }
 };
 
 }  // namespace luisavm
@@ -0,0 +1,90 @@
+#include "interrupts.hh"
+
+#include <stdexcept>
+using namespace std;
+
+namespace luisavm {
+
+void InterruptController::Reset()
+{
+    _reg[0] = _reg[1] = _reg[2] = 0;
+}
+
+
+vector<uint8_t> InterruptController::SaveState() const
+{
+    vector<uint8_t> data;
+    for(uint32_t reg: _reg) {
+        for(int i=0; i<4; ++i) {
+            data.push_back(static_cast<uint8_t>(reg >> (8 * i)));
+        }
+    }
+    return data;
+}
+
+
+// save states from before the interrupt controller existed have no state for it
+void InterruptController::LoadState(vector<uint8_t> const& data)
+{
+    if(data.empty()) {
+        Reset();
+        return;
+    } else if(data.size() != sizeof _reg) {
+        throw runtime_error("Invalid interrupt controller state.");
+    }
+    for(size_t i=0; i<3; ++i) {
+        _reg[i] = static_cast<uint32_t>(data[i*4]) | (static_cast<uint32_t>(data[i*4+1]) << 8)
+                | (static_cast<uint32_t>(data[i*4+2]) << 16) | (static_cast<uint32_t>(data[i*4+3]) << 24);
+    }
+}
+
+
+int InterruptController::Next() const
+{
+    uint32_t active = _reg[0] & _reg[1];
+    return (active != 0) ? __builtin_ctz(active) : -1;
+}
+
+
+uint8_t InterruptController::Get(uint32_t pos)
+{
+    return (pos < sizeof _reg) ? static_cast<uint8_t>(_reg[pos / 4] >> (8 * (pos % 4))) : 0;
+}
+
+
+void InterruptController::Set(uint32_t pos, uint8_t data)
+{
+    if(pos < sizeof _reg) {
+        uint32_t shift = 8 * (pos % 4);
+        Write(pos & ~3u, static_cast<uint32_t>(data) << shift, 0xFFu << shift);
+    }
+}
+
+
+uint32_t InterruptController::Get32(uint32_t pos)
+{
+    return (pos % 4 == 0 && pos < sizeof _reg) ? _reg[pos / 4] : Device::Get32(pos);
+}
+
+
+void InterruptController::Set32(uint32_t pos, uint32_t data)
+{
+    if(pos % 4 == 0 && pos < sizeof _reg) {
+        Write(pos, data, 0xFFFFFFFF);
+    } else {
+        Device::Set32(pos, data);
+    }
+}
+
+
+// `bits` are the bits of the register being written
+void InterruptController::Write(uint32_t reg, uint32_t value, uint32_t bits)
+{
+    if(reg == PENDING) {
+        _reg[0] &= ~value;
+    } else {
+        _reg[reg / 4] = (_reg[reg / 4] & ~bits) | value;
+    }
+}
+
+}  // namespace luisavm
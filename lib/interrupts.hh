@@ -0,0 +1,57 @@
+#ifndef INTERRUPTS_HH_
+#define INTERRUPTS_HH_
+
+#include <cstdint>
+#include <vector>
+using namespace std;
+
+#include "device.hh"
+
+namespace luisavm {
+
+// Collects the interrupt requests of the devices. A line raised and enabled
+// in MASK is delivered to the CPU at the start of the next time slice (see
+// LuisaVM::Run): PC and FL are pushed, the IM flag is set, and the CPU jumps
+// to the address found in the vector table for the line. `iret` returns.
+// Lower lines are delivered first. A line is cleared when it is delivered.
+//
+// Registers (32 bits each, little-endian):
+//   0x0  PENDING   one bit per line; writing 1 to a bit clears it
+//   0x4  MASK      one bit per line; 1 enables it
+//   0x8  VECTORS   address of the vector table: one 32-bit address per line
+class InterruptController : public Device {
+public:
+    static const uint32_t POS = 0xF0010000;
+    enum Register : uint32_t { PENDING = 0x0, MASK = 0x4, VECTORS = 0x8 };
+    enum Line : uint8_t { KEYBOARD = 0, TIMER = 1, VBLANK = 2 };
+
+    void Reset() override;
+
+    vector<uint8_t> SaveState() const override;   // the three registers
+    void            LoadState(vector<uint8_t> const& data) override;
+
+    uint32_t MemoryPos() const override  { return POS; }
+    uint32_t MemorySize() const override { return 12; }
+
+    uint8_t  Get(uint32_t pos) override;
+    void     Set(uint32_t pos, uint8_t data) override;
+    uint32_t Get32(uint32_t pos) override;
+    void     Set32(uint32_t pos, uint32_t data) override;
+
+    void Raise(uint8_t line)         { _reg[0] |= 1u << line; }
+    void Clear(uint8_t line)         { _reg[0] &= ~(1u << line); }
+    bool Enabled(uint8_t line) const { return (_reg[1] & (1u << line)) != 0; }
+
+    // the pending and enabled line with the highest priority, or -1
+    int      Next() const;
+    uint32_t Vector(uint8_t line) const { return _reg[2] + 4u * line; }
+
+private:
+    void Write(uint32_t reg, uint32_t value, uint32_t bits);
+
+    uint32_t _reg[3] = { 0, 0, 0 };
+};
+
+}  // namespace luisavm
+
+#endif
@@ -0,0 +1,836 @@
+#include "jit.hh"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+#include <limits>
+#include <stdexcept>
+
+#if defined(__x86_64__)
+#  include <sys/mman.h>
+#endif
+
+#include "luisavm.hh"
+
+namespace luisavm {
+
+JIT::JIT(LuisaVM& comp)
+    : comp(comp), cpu(comp.cpu()), _state { comp.cpu().Register.data(), 0, this },
+      _translated((comp.PhysicalMemory().size() >> GRANULE_BITS) + 1, false)
+{
+    if(!Supported()) {
+        throw runtime_error("The JIT is not supported in this platform.");
+    }
+#if defined(__x86_64__)
+    void* cache = mmap(nullptr, CODE_CACHE_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(cache == MAP_FAILED) {
+        throw runtime_error("Could not allocate the JIT code cache.");
+    }
+    _cache = static_cast<uint8_t*>(cache);
+    EmitTrampoline();
+#endif
+}
+
+
+JIT::~JIT()
+{
+#if defined(__x86_64__)
+    munmap(_cache, CODE_CACHE_SIZE);
+#endif
+}
+
+
+bool JIT::Supported()
+{
+#if defined(__x86_64__)
+    return true;
+#else
+    return false;
+#endif
+}
+
+// {{{ run
+
+// Blocks are run by the interpreter until they get hot, and then translated.
+// Translated blocks jump directly into each other while there's budget left,
+// and return here when the next block is not translated, when the target is
+// only known at runtime, or when an instruction must be run by the
+// interpreter.
+StopReason JIT::Run(uint64_t max_cycles)
+{
+    _state.reg = cpu.Register.data();
+    _state.budget = static_cast<int64_t>(min<uint64_t>(max_cycles, numeric_limits<int64_t>::max()));
+    int64_t const start = _state.budget;
+    uint64_t const base = cpu._elapsed_base;
+    cpu.Waiting = false;
+
+    while(_state.budget > 0 && !comp.Translating() && !cpu.Waiting && !cpu._yield) {   // the guest might enable the MMU
+        uint32_t pc = cpu.PC;
+        auto it = _blocks.find(pc);
+        if(it == _blocks.end()) {
+            it = _blocks.emplace(pc, Scan(pc)).first;
+        }
+        Block& block = it->second;
+
+        uint8_t* code = block.code;
+        uint64_t cycles = block.cycles;
+        if(code == nullptr && block.n_translatable > 0 && ++block.count >= HOT_THRESHOLD) {
+            code = Translate(pc);
+        }
+        if(code == nullptr) {
+            uint64_t n = min<uint64_t>(cycles, static_cast<uint64_t>(_state.budget));
+            cpu._elapsed_base = base + static_cast<uint64_t>(start - _state.budget);
+            StopReason stop = cpu.Run(n);
+            _state.budget -= static_cast<int64_t>(stop.cycles);
+            if(stop.Trapped()) {
+                stop.cycles = static_cast<uint64_t>(start - _state.budget);
+                return stop;
+            }
+            continue;
+        }
+
+        // if the block was not run at all, there's not enough budget for it
+        int64_t budget = _state.budget;
+        if(Enter(code) == EXIT_NORMAL && _state.budget != budget) {
+            continue;
+        }
+        cpu._elapsed_base = base + static_cast<uint64_t>(start - _state.budget);
+        StopReason stop = cpu.Run(1);
+        _state.budget -= static_cast<int64_t>(stop.cycles);
+        if(stop.Trapped()) {
+            stop.cycles = static_cast<uint64_t>(start - _state.budget);
+            return stop;
+        }
+    }
+    cpu._elapsed_base = base;
+
+    return StopReason { StopReason::NONE, cpu.PC, 0, static_cast<uint64_t>(start - _state.budget) };
+}
+
+// }}}
+
+// {{{ invalidation
+
+void JIT::InvalidateCode(uint32_t pos, uint32_t sz)
+{
+    uint32_t first = pos >> GRANULE_BITS,
+             last = min<uint32_t>((pos + sz - 1) >> GRANULE_BITS, static_cast<uint32_t>(_translated.size() - 1));
+    bool translated = false;
+    for(uint32_t granule=first; granule<=last && !translated; ++granule) {
+        translated = _translated[granule];
+    }
+    if(translated) {
+        Flush();
+        _code_written = true;
+    }
+}
+
+
+// The code is not unmapped, so a block that writes over translated code can
+// safely return after the flush.
+void JIT::Flush()
+{
+    _blocks.clear();
+    _links.clear();
+    fill(begin(_translated), end(_translated), false);
+    _cache_used = _trampoline_size;
+}
+
+// }}}
+
+// {{{ block scanning
+
+// Finds the extent of the block starting at `pc`: it ends at a branch, or
+// just before the first instruction that can't be translated.
+JIT::Block JIT::Scan(uint32_t pc, vector<CPU::Decoded>* instructions)
+{
+    Block block;
+    size_t memory_size = comp.PhysicalMemory().size();
+
+    while(block.n_translatable < MAX_BLOCK_INSTRUCTIONS) {
+        if(static_cast<uint64_t>(pc) + CPU::MAX_INSTRUCTION_SZ > memory_size) {
+            ++block.cycles;
+            return block;
+        }
+
+        uint8_t op = comp.Get(pc);
+        if(op == 0 || op >= opcodes.size() || !opcodes[op].Valid()) {
+            ++block.cycles;   // let the interpreter complain
+            return block;
+        }
+
+        CPU::Decoded const& d = cpu.Decode(pc);
+        if(!Translatable(d)) {
+            ++block.cycles;
+            return block;
+        }
+
+        ++block.n_translatable;
+        block.cycles = static_cast<uint16_t>(block.cycles + d.opcode->cycles);
+        if(instructions != nullptr) {
+            instructions->push_back(d);
+        }
+        if(d.opcode->instruction >= BZ && d.opcode->instruction <= RET) {
+            break;
+        }
+        pc += d.sz;
+    }
+
+    return block;
+}
+
+
+bool JIT::Translatable(CPU::Decoded const& d) const
+{
+    Instruction ins = d.opcode->instruction;
+    if(ins == PUSH_A || ins == POP_A || ins == IRET || ins == INVALID || d.handler == CPU::HANDLER_WAIT) {
+        return false;
+    }
+
+    // PC and FL as parameters are left to the interpreter
+    for(uint8_t i=0; i<d.n_pars; ++i) {
+        if((d.par[i].type == REG || d.par[i].type == INDREG) && d.par[i].value > 13) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// }}}
+
+// {{{ memory access from the generated code
+
+// These are called from the generated code, so they must not throw. Anything
+// outside of the physical memory is left to the interpreter.
+
+bool JIT::InRAM(uint32_t addr, uint32_t sz) const
+{
+    return static_cast<uint64_t>(addr) + sz <= comp.PhysicalMemory().size();
+}
+
+
+// returns the value, or bit 32 set if it must be run by the interpreter
+uint64_t JIT::Load(State* state, uint32_t addr)
+{
+    JIT& jit = *state->jit;
+    if(!jit.InRAM(addr, 4)) {
+        return 1ull << 32;
+    }
+    return jit.comp.Get32(addr);
+}
+
+
+// returns 0 if ok, 1 if it must be run by the interpreter (nothing was
+// written) or 2 if translated code was overwritten
+uint32_t JIT::Store(State* state, uint32_t addr, uint32_t value, uint32_t sz)
+{
+    JIT& jit = *state->jit;
+    if(!jit.InRAM(addr, sz)) {
+        return 1;
+    }
+
+    jit._code_written = false;
+    switch(sz) {
+        case 1:  jit.comp.Set(addr, static_cast<uint8_t>(value)); break;
+        case 2:  jit.comp.Set16(addr, static_cast<uint16_t>(value)); break;
+        default: jit.comp.Set32(addr, value); break;
+    }
+    return jit._code_written ? 2 : 0;
+}
+
+
+uint32_t JIT::Push(State* state, uint32_t value, uint32_t sz)
+{
+    uint32_t& sp = state->reg[13];
+    uint32_t addr = sp - (sz - 1);
+    uint32_t result = Store(state, addr, value, sz);
+    if(result != 1) {
+        sp = addr - 1;
+    }
+    return result;
+}
+
+
+uint64_t JIT::Pop(State* state, uint32_t sz)
+{
+    JIT& jit = *state->jit;
+    uint32_t& sp = state->reg[13];
+    uint32_t addr = sp + 1;
+    if(!jit.InRAM(addr, sz)) {
+        return 1ull << 32;
+    }
+
+    uint32_t value;
+    switch(sz) {
+        case 1:  value = jit.comp.Get(addr); break;
+        case 2:  value = jit.comp.Get16(addr); break;
+        default: value = jit.comp.Get32(addr); break;
+    }
+    sp = addr + sz - 1;
+    return value;
+}
+
+// }}}
+
+#if defined(__x86_64__)
+
+// {{{ x86-64 emitter
+
+namespace {
+
+enum HostReg : uint8_t { EAX = 0, ECX = 1, EDX = 2, ESI = 6 };
+enum Condition : uint8_t { CC_B = 0x2, CC_E = 0x4, CC_NE = 0x5, CC_L = 0xC };
+
+const uint8_t PC_REG = 14, FL_REG = 15;
+
+// The code cache is never writable and executable at the same time: it is
+// made writable while code is emitted or patched, and executable again when
+// this goes out of scope.
+class WritableCode {
+public:
+    WritableCode(uint8_t* cache, size_t size) : _cache(cache), _size(size) {
+        if(mprotect(_cache, _size, PROT_READ|PROT_WRITE) != 0) {
+            throw runtime_error("Could not make the JIT code cache writable.");
+        }
+    }
+
+    ~WritableCode() {
+        if(mprotect(_cache, _size, PROT_READ|PROT_EXEC) != 0) {
+            abort();   // none of the translated code could be run
+        }
+    }
+
+    WritableCode(WritableCode const&) = delete;
+    WritableCode& operator=(WritableCode const&) = delete;
+
+private:
+    uint8_t* _cache;
+    size_t   _size;
+};
+
+// Writes x86-64 machine code. The guest registers are addressed from rbx,
+// and the JIT state from r12; eax, ecx, edx, esi and r8d-r10d are scratch
+// registers, and r13d/r14d keep values across helper calls.
+class Emitter {
+public:
+    explicit Emitter(uint8_t* p) : p(p) {}
+
+    uint8_t* Pos() const { return p; }
+
+    void Bytes(initializer_list<uint8_t> bytes) {
+        for(uint8_t b: bytes) {
+            *p++ = b;
+        }
+    }
+
+    void Imm32(uint32_t value) {
+        memcpy(p, &value, 4);
+        p += 4;
+    }
+
+    // mov reg, [rbx + 4*guest]
+    void LoadReg(HostReg reg, uint32_t guest) {
+        Bytes({ 0x8B, static_cast<uint8_t>(0x43 | (reg << 3)), static_cast<uint8_t>(guest * 4) });
+    }
+
+    // mov [rbx + 4*guest], reg
+    void StoreReg(uint32_t guest, HostReg reg) {
+        Bytes({ 0x89, static_cast<uint8_t>(0x43 | (reg << 3)), static_cast<uint8_t>(guest * 4) });
+    }
+
+    // mov dword [rbx + 4*guest], value
+    void StoreRegImm(uint32_t guest, uint32_t value) {
+        Bytes({ 0xC7, 0x43, static_cast<uint8_t>(guest * 4) });
+        Imm32(value);
+    }
+
+    // mov reg, value
+    void MovImm(HostReg reg, uint32_t value) {
+        Bytes({ static_cast<uint8_t>(0xB8 + reg) });
+        Imm32(value);
+    }
+
+    // <op> qword [r12 + offsetof(budget)], value  (0 = add, 5 = sub, 7 = cmp)
+    void Budget(uint8_t op, uint32_t value) {
+        Bytes({ 0x49, 0x81, static_cast<uint8_t>(0x44 | (op << 3)), 0x24, 8 });
+        Imm32(value);
+    }
+
+    // mov rdi, r12 / mov rax, f / call rax
+    void Call(uint64_t f) {
+        Bytes({ 0x4C, 0x89, 0xE7, 0x48, 0xB8 });
+        memcpy(p, &f, 8);
+        p += 8;
+        Bytes({ 0xFF, 0xD0 });
+    }
+
+    // bt rax, 32 / jc target
+    uint8_t* JumpIfBit32(uint8_t* target) {
+        Bytes({ 0x48, 0x0F, 0xBA, 0xE0, 0x20 });
+        return Jcc(CC_B, target);
+    }
+
+    // bt dword [rbx + FL], 0  (carry flag = Y)
+    void LoadCarry() {
+        Bytes({ 0x0F, 0xBA, 0x63, FL_REG * 4, 0x00 });
+    }
+
+    // Sets Z and S from eax, clears the other flags and adds the flags
+    // in r9d, if `extra` (the same as CPU::Apply).
+    void Flags(bool extra) {
+        Bytes({ 0x8B, 0x4B, FL_REG * 4,                 // mov ecx, [rbx + FL]
+                0x81, 0xE1, 0xC0, 0xFF, 0xFF, 0xFF,     // and ecx, ~0x3F
+                0x45, 0x31, 0xC0,                       // xor r8d, r8d
+                0x85, 0xC0,                             // test eax, eax
+                0x41, 0x0F, 0x94, 0xC0,                 // sete r8b
+                0x41, 0xC1, 0xE0, 0x02,                 // shl r8d, Z
+                0x44, 0x09, 0xC1,                       // or ecx, r8d
+                0x41, 0x89, 0xC0,                       // mov r8d, eax
+                0x41, 0xC1, 0xE8, 0x1F,                 // shr r8d, 31
+                0x41, 0xC1, 0xE0, 0x03,                 // shl r8d, S
+                0x44, 0x09, 0xC1 });                    // or ecx, r8d
+        if(extra) {
+            Bytes({ 0x44, 0x09, 0xC9 });                // or ecx, r9d
+        }
+        Bytes({ 0x89, 0x4B, FL_REG * 4 });              // mov [rbx + FL], ecx
+    }
+
+    uint8_t* Jmp(uint8_t* target) {
+        Bytes({ 0xE9 });
+        return Rel32(target);
+    }
+
+    uint8_t* Jcc(Condition cc, uint8_t* target) {
+        Bytes({ 0x0F, static_cast<uint8_t>(0x80 | cc) });
+        return Rel32(target);
+    }
+
+    static void Patch(uint8_t* rel32, uint8_t* target) {
+        int32_t rel = static_cast<int32_t>(target - (rel32 + 4));
+        memcpy(rel32, &rel, 4);
+    }
+
+private:
+    uint8_t* Rel32(uint8_t* target) {
+        uint8_t* field = p;
+        p += 4;
+        if(target != nullptr) {
+            Patch(field, target);
+        }
+        return field;
+    }
+
+    uint8_t* p;
+};
+
+}  // namespace
+
+// }}}
+
+// {{{ trampoline
+
+// int enter(uint8_t* code, State* state): saves the callee-saved registers,
+// loads rbx and r12 and jumps to the block. The blocks leave through
+// _exit_normal or _exit_interpret, which return the exit reason.
+void JIT::EmitTrampoline()
+{
+    WritableCode writable(_cache, CODE_CACHE_SIZE);
+    Emitter e(_cache);
+
+    _enter = e.Pos();
+    e.Bytes({ 0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57 });  // push rbx, rbp, r12-r15
+    e.Bytes({ 0x48, 0x83, 0xEC, 0x08 });   // sub rsp, 8 (align the stack for calls)
+    e.Bytes({ 0x49, 0x89, 0xF4 });         // mov r12, rsi
+    e.Bytes({ 0x49, 0x8B, 0x1C, 0x24 });   // mov rbx, [r12]
+    e.Bytes({ 0xFF, 0xE7 });               // jmp rdi
+
+    _exit_interpret = e.Pos();
+    e.MovImm(EAX, EXIT_INTERPRET);
+    uint8_t* epilogue = e.Jmp(nullptr);
+
+    _exit_normal = e.Pos();
+    e.MovImm(EAX, EXIT_NORMAL);
+    Emitter::Patch(epilogue, e.Pos());
+    e.Bytes({ 0x48, 0x83, 0xC4, 0x08 });   // add rsp, 8
+    e.Bytes({ 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5D, 0x5B, 0xC3 });  // pop ..., ret
+
+    _trampoline_size = _cache_used = static_cast<size_t>(e.Pos() - _cache);
+}
+
+
+int JIT::Enter(uint8_t* code)
+{
+    using EnterFunction = int (*)(uint8_t*, State*);
+    return reinterpret_cast<EnterFunction>(_enter)(code, &_state);
+}
+
+// }}}
+
+// {{{ translation
+
+uint8_t* JIT::Translate(uint32_t pc)
+{
+    if(_cache_used + MAX_BLOCK_CODE > CODE_CACHE_SIZE) {
+        Flush();
+    }
+    WritableCode writable(_cache, CODE_CACHE_SIZE);
+
+    vector<CPU::Decoded> ins;
+    Block block = Scan(pc, &ins);
+    uint32_t n = block.n_translatable;
+
+    // cycles of the instructions from each one to the end of the block
+    vector<uint32_t> remaining(n + 1, 0);
+    for(uint32_t i = n; i-- > 0; ) {
+        remaining[i] = remaining[i+1] + ins[i].opcode->cycles;
+    }
+
+    // Flags are only calculated if some instruction reads them before they
+    // are overwritten. They must be up to date when leaving the block.
+    vector<bool> flags_needed(n);
+    bool live = true;
+    for(uint32_t i = n; i-- > 0; ) {
+        Instruction in = ins[i].opcode->instruction;
+        bool memory = false;
+        for(uint8_t j=0; j<ins[i].n_pars; ++j) {
+            memory |= (ins[i].par[j].type == INDREG || ins[i].par[j].type == INDV32);
+        }
+        bool may_exit = memory || (in >= JSR && in <= POPX) || in == IDIV || in == MOD;
+        bool reads = in == ADD || in == SUB || in == CMP || (in >= BZ && in <= BNV);
+        bool writes = (in >= MOV && in <= DEC) || (in >= POPB && in <= POPD);
+
+        flags_needed[i] = writes && (live || may_exit);
+        if(reads || may_exit) {
+            live = true;
+        } else if(writes) {
+            live = false;
+        }
+    }
+
+    struct SideExit {
+        uint8_t* rel32;
+        uint32_t refund;
+        uint32_t pc;
+        uint8_t* exit;
+    };
+    vector<SideExit> side_exits;
+
+    Emitter e(_cache + _cache_used);
+    uint8_t* code = e.Pos();
+
+    // the block only runs if there's budget for all of it
+    e.Budget(7, remaining[0]);
+    e.Jcc(CC_L, _exit_normal);
+    e.Budget(5, remaining[0]);
+
+    auto chain = [&](uint32_t target) {
+        e.StoreRegImm(PC_REG, target);
+        auto it = _blocks.find(target);
+        if(it != _blocks.end() && it->second.code != nullptr) {
+            e.Jmp(it->second.code);
+        } else {
+            _links[target].push_back(e.Jmp(_exit_normal));
+        }
+    };
+
+    auto dynamic = [&]() {   // target in eax
+        e.StoreReg(PC_REG, EAX);
+        e.Jmp(_exit_normal);
+    };
+
+    bool terminated = false;
+    for(uint32_t i=0; i<n; ++i) {
+        CPU::Decoded const& d = ins[i];
+        CPU::Parameter const* par = d.par;
+        Instruction in = d.opcode->instruction;
+        uint32_t next = d.pc + d.sz;
+
+        // run this instruction in the interpreter
+        auto interpret = [&](uint8_t* rel32) {
+            side_exits.push_back({ rel32, remaining[i], d.pc, _exit_interpret });
+        };
+        // translated code was overwritten: leave after this instruction
+        auto written = [&](uint8_t* rel32, uint32_t resume) {
+            side_exits.push_back({ rel32, remaining[i+1], resume, _exit_normal });
+        };
+        auto operand = [&](HostReg reg, CPU::Parameter const& p) {
+            if(p.type == REG) {
+                e.LoadReg(reg, p.value);
+            } else {
+                e.MovImm(reg, p.value);
+            }
+        };
+        auto address = [&](CPU::Parameter const& p) {   // into esi
+            operand(ESI, { p.type == INDREG ? REG : V32, p.value });
+        };
+        auto flags = [&](bool extra) {
+            if(flags_needed[i]) {
+                e.Flags(extra);
+            }
+        };
+        auto result = [&](bool extra) {   // eax to the first parameter
+            e.StoreReg(par[0].value, EAX);
+            flags(extra);
+        };
+        auto binary = [&](initializer_list<uint8_t> op, bool extra) {
+            operand(EAX, par[0]);
+            operand(ECX, par[1]);
+            e.Bytes(op);
+            result(extra);
+        };
+
+        switch(in) {
+            case MOV:
+                operand(EAX, par[1]);
+                result(false);
+                break;
+
+            case MOVB: case MOVW: case MOVD: {
+                    uint32_t sz = (in == MOVB) ? 1 : (in == MOVW) ? 2 : 4;
+                    if(par[1].type == INDREG || par[1].type == INDV32) {
+                        address(par[1]);
+                        e.Call(reinterpret_cast<uint64_t>(&JIT::Load));
+                        interpret(e.JumpIfBit32(nullptr));
+                    } else {
+                        operand(EAX, par[1]);
+                    }
+                    if(sz == 1) {
+                        e.Bytes({ 0x0F, 0xB6, 0xC0 });   // movzx eax, al
+                    } else if(sz == 2) {
+                        e.Bytes({ 0x0F, 0xB7, 0xC0 });   // movzx eax, ax
+                    }
+
+                    if(par[0].type == REG) {
+                        result(false);
+                        break;
+                    }
+
+                    e.Bytes({ 0x41, 0x89, 0xC6 });       // mov r14d, eax
+                    e.Bytes({ 0x89, 0xC2 });             // mov edx, eax
+                    address(par[0]);
+                    e.MovImm(ECX, sz);
+                    e.Call(reinterpret_cast<uint64_t>(&JIT::Store));
+                    e.Bytes({ 0x83, 0xF8, 0x01 });       // cmp eax, 1
+                    interpret(e.Jcc(CC_E, nullptr));
+                    e.Bytes({ 0x41, 0x89, 0xC5 });       // mov r13d, eax
+                    e.Bytes({ 0x44, 0x89, 0xF0 });       // mov eax, r14d
+                    flags(false);
+                    e.Bytes({ 0x41, 0x83, 0xFD, 0x02 }); // cmp r13d, 2
+                    written(e.Jcc(CC_E, nullptr), next);
+                }
+                break;
+
+            case SWAP:
+                operand(EAX, par[0]);
+                operand(ECX, par[1]);
+                e.StoreReg(par[1].value, EAX);
+                e.StoreReg(par[0].value, ECX);
+                e.Bytes({ 0x89, 0xC8 });                 // mov eax, ecx
+                flags(false);
+                break;
+
+            case OR:  binary({ 0x09, 0xC8 }, false); break;     // or eax, ecx
+            case XOR: binary({ 0x31, 0xC8 }, false); break;     // xor eax, ecx
+            case AND: binary({ 0x21, 0xC8 }, false); break;     // and eax, ecx
+            case SHL: binary({ 0xD3, 0xE0 }, false); break;     // shl eax, cl
+            case SHR: binary({ 0xD3, 0xE8 }, false); break;     // shr eax, cl
+
+            case NOT:
+                operand(EAX, par[0]);
+                e.Bytes({ 0xF7, 0xD0 });                 // not eax
+                result(false);
+                break;
+
+            case ADD: case SUB:
+                binary({ 0x45, 0x31, 0xC9,               // xor r9d, r9d
+                         0x0F, 0xBA, 0x63, FL_REG * 4, 0x00,   // bt [FL], Y
+                         static_cast<uint8_t>(in == ADD ? 0x11 : 0x19), 0xC8,  // adc/sbb eax, ecx
+                         0x41, 0x0F, 0x92, 0xC1 }, true); // setc r9b
+                break;
+
+            case CMP:
+                if(!flags_needed[i]) {
+                    break;
+                }
+                operand(EAX, par[0]);
+                operand(ECX, par[d.n_pars == 1 ? 0 : 1]);
+                e.Bytes({ 0x45, 0x31, 0xC9,              // xor r9d, r9d
+                          0x45, 0x31, 0xD2,              // xor r10d, r10d
+                          0x39, 0xC8,                    // cmp eax, ecx
+                          0x41, 0x0F, 0x97, 0xC1,        // seta r9b
+                          0x41, 0x0F, 0x92, 0xC2,        // setb r10b
+                          0x41, 0xC1, 0xE1, 0x04,        // shl r9d, GT
+                          0x41, 0xC1, 0xE2, 0x05,        // shl r10d, LT
+                          0x45, 0x09, 0xD1,              // or r9d, r10d
+                          0x45, 0x31, 0xD2 });           // xor r10d, r10d
+                e.LoadCarry();
+                e.Bytes({ 0x19, 0xC8,                    // sbb eax, ecx
+                          0x41, 0x0F, 0x92, 0xC2,        // setc r10b
+                          0x45, 0x09, 0xD1 });           // or r9d, r10d
+                e.Flags(true);
+                break;
+
+            case MUL:
+                binary({ 0x45, 0x31, 0xC9,               // xor r9d, r9d
+                         0xF7, 0xE1,                     // mul ecx
+                         0x41, 0x0F, 0x90, 0xC1,         // seto r9b
+                         0x41, 0xD1, 0xE1 }, true);      // shl r9d, 1
+                break;
+
+            case IDIV: case MOD:
+                operand(EAX, par[0]);
+                operand(ECX, par[1]);
+                e.Bytes({ 0x85, 0xC9 });                 // test ecx, ecx
+                interpret(e.Jcc(CC_E, nullptr));
+                e.Bytes({ 0x31, 0xD2, 0xF7, 0xF1 });     // xor edx, edx / div ecx
+                if(in == MOD) {
+                    e.Bytes({ 0x89, 0xD0 });             // mov eax, edx
+                }
+                result(false);
+                break;
+
+            case INC:
+                operand(EAX, par[0]);
+                e.Bytes({ 0x45, 0x31, 0xC9,              // xor r9d, r9d
+                          0x83, 0xC0, 0x01,              // add eax, 1
+                          0x41, 0x0F, 0x92, 0xC1 });     // setc r9b
+                result(true);
+                break;
+
+            case DEC:
+                operand(EAX, par[0]);
+                e.Bytes({ 0x83, 0xE8, 0x01 });           // sub eax, 1
+                result(false);
+                break;
+
+            case BZ: case BNZ: case BNEG: case BPOS: case BGT: case BGTE:
+            case BLT: case BLTE: case BV: case BNV: case JMP: {
+                    uint8_t* not_taken = nullptr;
+                    if(in != JMP) {
+                        static const uint8_t mask[]  = { 0x04, 0x04, 0x08, 0x08, 0x14, 0x14, 0x24, 0x24, 0x02, 0x02 },
+                                             value[] = { 0x04, 0x00, 0x08, 0x00, 0x10, 0x14, 0x20, 0x24, 0x02, 0x00 };
+                        e.Bytes({ 0x8B, 0x4B, FL_REG * 4, 0x81, 0xE1 });  // mov ecx, [FL] / and ecx, mask
+                        e.Imm32(mask[in - BZ]);
+                        e.Bytes({ 0x81, 0xF9 });                          // cmp ecx, value
+                        e.Imm32(value[in - BZ]);
+                        not_taken = e.Jcc(CC_NE, nullptr);
+                    }
+                    if(par[0].type == REG) {
+                        e.LoadReg(EAX, par[0].value);
+                        dynamic();
+                    } else {
+                        chain(par[0].value);
+                    }
+                    if(not_taken != nullptr) {
+                        Emitter::Patch(not_taken, e.Pos());
+                        chain(next);
+                    }
+                    terminated = true;
+                }
+                break;
+
+            case JSR:
+                e.MovImm(ESI, next);
+                e.MovImm(EDX, 4);
+                e.Call(reinterpret_cast<uint64_t>(&JIT::Push));
+                e.Bytes({ 0x83, 0xF8, 0x01 });           // cmp eax, 1
+                interpret(e.Jcc(CC_E, nullptr));
+                if(par[0].type == REG) {
+                    e.LoadReg(EAX, par[0].value);
+                    dynamic();
+                } else {
+                    e.Bytes({ 0x83, 0xF8, 0x02 });       // cmp eax, 2
+                    written(e.Jcc(CC_E, nullptr), par[0].value);
+                    chain(par[0].value);
+                }
+                terminated = true;
+                break;
+
+            case RET:
+                e.MovImm(ESI, 4);
+                e.Call(reinterpret_cast<uint64_t>(&JIT::Pop));
+                interpret(e.JumpIfBit32(nullptr));
+                dynamic();
+                terminated = true;
+                break;
+
+            case PUSHB: case PUSHW: case PUSHD:
+                operand(ESI, par[0]);
+                e.MovImm(EDX, (in == PUSHB) ? 1 : (in == PUSHW) ? 2 : 4);
+                e.Call(reinterpret_cast<uint64_t>(&JIT::Push));
+                e.Bytes({ 0x83, 0xF8, 0x01 });           // cmp eax, 1
+                interpret(e.Jcc(CC_E, nullptr));
+                e.Bytes({ 0x83, 0xF8, 0x02 });           // cmp eax, 2
+                written(e.Jcc(CC_E, nullptr), next);
+                break;
+
+            case POPB: case POPW: case POPD:
+                e.MovImm(ESI, (in == POPB) ? 1 : (in == POPW) ? 2 : 4);
+                e.Call(reinterpret_cast<uint64_t>(&JIT::Pop));
+                interpret(e.JumpIfBit32(nullptr));
+                result(false);
+                break;
+
+            case POPX:
+                e.LoadReg(EAX, 13);
+                operand(ECX, par[0]);
+                e.Bytes({ 0x01, 0xC8 });                 // add eax, ecx
+                e.StoreReg(13, EAX);
+                break;
+
+            case NOP:
+                break;
+
+            case PUSH_A: case POP_A: case IRET: case WAIT: case INVALID:
+            default:
+                throw logic_error("Instruction can't be translated");
+        }
+    }
+
+    if(!terminated) {
+        chain(ins[n-1].pc + ins[n-1].sz);
+    }
+
+    for(SideExit const& se: side_exits) {
+        Emitter::Patch(se.rel32, e.Pos());
+        if(se.refund > 0) {
+            e.Budget(0, se.refund);
+        }
+        e.StoreRegImm(PC_REG, se.pc);
+        e.Jmp(se.exit);
+    }
+
+    _cache_used = static_cast<size_t>(e.Pos() - _cache);
+
+    // register the block and link the blocks waiting for it
+    for(CPU::Decoded const& d: ins) {
+        for(uint32_t g = d.pc >> GRANULE_BITS; g <= (d.pc + d.sz - 1u) >> GRANULE_BITS; ++g) {
+            _translated[g] = true;
+        }
+    }
+    block.code = code;
+    _blocks[pc] = block;
+    auto it = _links.find(pc);
+    if(it != _links.end()) {
+        for(uint8_t* rel32: it->second) {
+            Emitter::Patch(rel32, code);
+        }
+        _links.erase(it);
+    }
+    ++_translated_blocks;
+
+    return code;
+}
+
+// }}}
+
+#else
+
+void JIT::EmitTrampoline() {}
+int JIT::Enter(uint8_t*) { return EXIT_INTERPRET; }
+uint8_t* JIT::Translate(uint32_t) { return nullptr; }
+
+#endif
+
+}  // namespace luisavm
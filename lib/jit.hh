@@ -0,0 +1,87 @@
+#ifndef JIT_HH_
+#define JIT_HH_
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+using namespace std;
+
+#include "cpu.hh"
+
+namespace luisavm {
+
+// Translates hot guest basic blocks into x86-64 machine code. The guest
+// registers stay in CPU::Register, so the interpreter can take over at any
+// instruction: it runs the cold blocks, the instructions that can't be
+// translated, and any memory access outside of the physical memory (MMIO).
+class JIT {
+public:
+    explicit JIT(class LuisaVM& comp);
+    ~JIT();
+
+    JIT(JIT const&) = delete;
+    JIT& operator=(JIT const&) = delete;
+
+    static bool Supported();
+
+    StopReason Run(uint64_t max_cycles);
+
+    void InvalidateCode(uint32_t pos, uint32_t sz=1);
+    void Flush();
+
+    size_t TranslatedBlocks() const { return _translated_blocks; }
+
+private:
+    // accessed by the generated code: rbx = reg, r12 = this struct
+    struct State {
+        uint32_t* reg;
+        int64_t   budget;
+        JIT*      jit;
+    };
+
+    struct Block {
+        uint8_t* code = nullptr;
+        uint32_t count = 0;         // times it was run by the interpreter
+        uint8_t  n_translatable = 0;
+        uint16_t cycles = 0;        // of the block, counting one for an instruction that is not translatable at the end
+    };
+
+    enum ExitReason { EXIT_NORMAL = 0, EXIT_INTERPRET = 1 };
+
+    static const uint32_t HOT_THRESHOLD = 16;
+    static const uint8_t  MAX_BLOCK_INSTRUCTIONS = 64;
+    static const uint8_t  GRANULE_BITS = 4;             // granularity of the translated code bitmap
+    static const size_t   CODE_CACHE_SIZE = 8 * 1024 * 1024;
+    static const size_t   MAX_BLOCK_CODE = 32 * 1024;
+
+    Block             Scan(uint32_t pc, vector<CPU::Decoded>* instructions=nullptr);
+    bool              Translatable(CPU::Decoded const& d) const;
+    uint8_t*          Translate(uint32_t pc);
+    void              EmitTrampoline();
+    int               Enter(uint8_t* code);
+
+    static uint64_t Load(State* state, uint32_t addr);
+    static uint32_t Store(State* state, uint32_t addr, uint32_t value, uint32_t sz);
+    static uint32_t Push(State* state, uint32_t value, uint32_t sz);
+    static uint64_t Pop(State* state, uint32_t sz);
+    bool            InRAM(uint32_t addr, uint32_t sz) const;
+
+    class LuisaVM& comp;
+    CPU&           cpu;
+    State          _state;
+    uint8_t*       _cache = nullptr;
+    size_t         _cache_used = 0;
+    uint8_t        *_enter = nullptr, *_exit_normal = nullptr, *_exit_interpret = nullptr;
+    size_t         _trampoline_size = 0;
+    bool           _code_written = false;
+    size_t         _translated_blocks = 0;
+
+    unordered_map<uint32_t, Block>            _blocks;
+    unordered_map<uint32_t, vector<uint8_t*>> _links;       // jumps waiting for a block to be translated
+    vector<bool>                              _translated;  // granules of memory that contain translated code
+};
+
+}  // namespace luisavm
+
+#endif
@@ -3,6 +3,8 @@
 
 #include <cstdint>
 #include <deque>
+#include <stdexcept>
+#include <vector>
 using namespace std;
 
 #include "device.hh"
@@ -30,6 +32,29 @@ public:
     deque<KeyPress> Queue;
 
     void Reset() override { Queue = decltype(Queue)(); }
+
+    // six bytes per key: the key (little-endian), the modifiers and the state
+    vector<uint8_t> SaveState() const override {
+        vector<uint8_t> data;
+        for(KeyPress const& kp: Queue) {
+            data.insert(data.end(), { static_cast<uint8_t>(kp.key), static_cast<uint8_t>(kp.key >> 8), 
+                    static_cast<uint8_t>(kp.key >> 16), static_cast<uint8_t>(kp.key >> 24), 
+                    kp.mod, static_cast<uint8_t>(kp.state) });
+        }
+        return data;
+    }
+
+    void LoadState(vector<uint8_t> const& data) override {
+        if(data.size() % 6 != 0) {
+            throw runtime_error("Invalid keyboard state.");
+        }
+        Queue.clear();
+        for(size_t i=0; i<data.size(); i+=6) {
+            uint32_t key = static_cast<uint32_t>(data[i]) | (static_cast<uint32_t>(data[i+1]) << 8) 
+                         | (static_cast<uint32_t>(data[i+2]) << 16) | (static_cast<uint32_t>(data[i+3]) << 24);
+            Queue.push_back({ key, static_cast<KeyboardModifier>(data[i+4]), static_cast<KeyState>(data[i+5]) });
+        }
+    }
 };
 
 }  // namespace luisavm
@@ -1,44 +1,140 @@
 #include "luisavm.hh"
 
+#include <algorithm>
+#include <cstdio>
 #include <exception>
 #include <fstream>
 using namespace std;
 
+#include <fcntl.h>
+#if defined(_WIN32)
+#  include <io.h>
+#else
+#  include <unistd.h>
+#endif
+#ifndef O_BINARY
+#  define O_BINARY 0
+#endif
+
 #include "debugger.hh"
 
 namespace luisavm {
 
+// The physical memory is rounded up to whole pages, so that every mapped 
+// page is backed by host memory.
 LuisaVM::LuisaVM(uint32_t physical_memory_size)
+    : _physical_memory((static_cast<size_t>(physical_memory_size) + PageTable::PAGE_MASK) & ~static_cast<size_t>(PageTable::PAGE_MASK))
 {
-    _physical_memory.resize(physical_memory_size, 0);
-    AddDevice<CPU>(*this);
+    _pages.MapRAM(0, static_cast<uint32_t>(_physical_memory.size()), _physical_memory.data());
+    _dirty.resize((_physical_memory.size() / PageTable::PAGE_SIZE + 63) / 64, 0);
+    _dirty_lists[DEFAULT_DIRTY_LIST].resize(_dirty.size(), 0);
+    _copy_on_write.resize(_dirty.size(), 0);
+    _cpu = &AddDevice<CPU>(*this);
     AddDevice<Keyboard>();
+    _mmu = &AddDevice<MMU>(*this);
+    _interrupts = &AddDevice<InterruptController>();
+    _timer = &AddDevice<Timer>(*this);
+}
+
+
+LuisaVM::~LuisaVM()
+{
+    if(_dedup) {
+        _dedup->Forget(*this, false);
+    }
 }
 
 // {{{ step/reset
 
+// Pending events are dropped: the devices schedule themselves again when 
+// they are reset, if they need to.
 void LuisaVM::Reset()
 {
+    _events = decltype(_events)();
+    _scheduled.clear();
     for(auto& dev: _devices) {
         dev->Reset();
     }
 }
 
 
-void LuisaVM::Step() 
+StopReason LuisaVM::Step() 
 {
     if(_debugger != nullptr && _debugger->Active) {
         _debugger->Step();
-    } else {
-        StepDevices();
+        return StopReason {};
     }
+
+    StopReason stop = DeliverInterrupt();
+    if(!stop.Trapped()) {
+        _cpu->NewSlice();
+        stop = _cpu->Waiting ? StopReason { StopReason::NONE, _cpu->PC, 0, 1 } : _cpu->Run(1);
+        _cycles += stop.cycles;
+        _cpu->NewSlice();
+        RunEvents();
+    }
+    if(stop.Trapped() && _debugger != nullptr) {
+        _debugger->Active = true;
+    }
+    return stop;
 }
 
-void LuisaVM::StepDevices() 
+// Run for `max_cycles` cycles (in the native code or in the JIT, if enabled),
+// stopping on the way for the device events that are due. Interrupts are
+// delivered at these stops, so a device event that raises one has it taken
+// right away. While the CPU is waiting, the time skips ahead to the next
+// event. If the CPU traps, the debugger (if any) is activated.
+StopReason LuisaVM::Run(uint64_t max_cycles)
 {
-    for(auto& dev: _devices) {
-        dev->Step();
+    if(_debugger != nullptr && _debugger->Active) {
+        _debugger->Step();
+        return StopReason {};
     }
+
+    RunEvents();
+    StopReason stop;
+    uint64_t cycles = 0;
+    do {
+        stop = DeliverInterrupt();
+        if(stop.Trapped()) {
+            break;
+        }
+        uint64_t slice = max_cycles - cycles;
+        if(!_events.empty()) {
+            slice = min(slice, _events.top().time - _cycles);
+        }
+        _cpu->NewSlice();
+        stop = _cpu->Waiting ? StopReason { StopReason::NONE, _cpu->PC, 0, slice }
+             : _translating  ? _cpu->Run(slice)
+             : _native       ? _native->Run(slice)
+             : _jit          ? _jit->Run(slice) 
+             :                 _cpu->Run(slice);
+        cycles += stop.cycles;
+        _cycles += stop.cycles;
+        _cpu->NewSlice();
+        RunEvents();
+    } while(cycles < max_cycles && !stop.Trapped());
+    stop.cycles = cycles;
+
+    if(stop.Trapped() && _debugger != nullptr) {
+        _debugger->Active = true;
+    }
+    return stop;
+}
+
+void LuisaVM::EnableJIT(bool enable)
+{
+    if(!enable) {
+        _jit.reset();
+    } else if(!_jit) {
+        _jit = make_unique<JIT>(*this);
+    }
+}
+
+
+void LuisaVM::LoadNative(string const& filename)
+{
+    _native = make_unique<Native>(*this, filename);
 }
 
 // }}}
@@ -47,80 +143,623 @@ void LuisaVM::StepDevices()
 
 uint8_t LuisaVM::Get(uint32_t pos) const
 {
-    if(pos < _physical_memory.size()) {
-        return _physical_memory.at(pos);
-    } 
-    
-    if(pos < COMMAND_POS) {
-        return 0;
+    return _translating ? static_cast<uint8_t>(GetTranslated(pos, 1)) : GetPhysical(pos);
+}
+
+
+void LuisaVM::Set(uint32_t pos, uint8_t data)
+{
+    if(_translating) {
+        SetTranslated(pos, data, 1);
+    } else {
+        SetPhysical(pos, data);
     }
+}
+
 
-    throw logic_error("not implemented");
+bool LuisaVM::Steady(uint32_t pos, uint32_t sz) const
+{
+    for(uint32_t i=0; i<sz && !_translating; ++i) {
+        PageTable::Page const& page = _pages.Find(pos + i);
+        if(page.device && !page.device->Steady(pos + i - page.base)) {
+            return false;
+        }
+    }
+    return true;
 }
 
 
-void LuisaVM::Set(uint32_t pos, uint8_t data)
+uint8_t LuisaVM::GetPhysical(uint32_t pos) const
 {
-    if(pos < _physical_memory.size()) {
-        _physical_memory[pos] = data;
-    } else if(pos >= COMMAND_POS) {
-        throw logic_error("not implemented");
+    PageTable::Page const& page = _pages.Find(pos);
+    if(page.ram) {
+        return page.ram[pos & PageTable::PAGE_MASK];
+    } else if(page.device) {
+        return page.device->Get(pos - page.base);
     }
+    Unmapped(pos);
+    return 0;
 }
 
 
-uint16_t LuisaVM::Get16(uint32_t pos) const
+void LuisaVM::SetPhysical(uint32_t pos, uint8_t data)
 {
-    uint16_t b1 = Get(pos),
-             b2 = Get(pos+1);
-    return b1 | static_cast<uint16_t>(b2 << 8);
+    PageTable::Page const& page = _pages.Find(pos);
+    if(page.ram) {
+        Writing(pos, 1);
+        page.ram[pos & PageTable::PAGE_MASK] = data;
+    } else if(page.device) {
+        page.device->Set(pos - page.base, data);
+    } else {
+        Unmapped(pos);
+    }
 }
 
 
-void LuisaVM::Set16(uint32_t pos, uint16_t data)
+// Outside of the physical memory, reads return zero and writes are ignored;
+// in the device area, this is a fault.
+void LuisaVM::Unmapped(uint32_t pos) const
 {
-    Set(pos, static_cast<uint8_t>(data));
-    Set(pos+1, static_cast<uint8_t>(data >> 8));
+    if(pos >= DEVICE_AREA) {
+        _cpu->Trap(StopReason::UNMAPPED_MEMORY, pos);
+    }
 }
 
 
-uint32_t LuisaVM::Get32(uint32_t pos) const
+// Called before the physical memory is written: keeps a copy of the pages
+// for the snapshots that need it, marks them as dirty, and invalidates any 
+// code cached from them. The instructions decoded while the MMU is enabled
+// are kept by their translated address.
+void LuisaVM::Writing(uint32_t pos, uint32_t sz)
 {
-    uint32_t b1 = Get(pos),
-             b2 = Get(pos+1),
-             b3 = Get(pos+2),
-             b4 = Get(pos+3);
-    return b1 | (b2 << 8) | (b3 << 16) | (b4 << 24);
+    uint32_t first = pos >> PageTable::PAGE_BITS,
+             last = (pos + sz - 1) >> PageTable::PAGE_BITS;
+    for(uint32_t page=first; page<=last; ++page) {
+        uint64_t bit = 1ull << (page % 64);
+        if(_copy_on_write[page / 64] & bit) {
+            Preserve(page);
+        }
+        _dirty[page / 64] |= bit;
+    }
+
+    _cpu->InvalidateDecoded(_translating ? pos - _segment_base : pos, sz);
+    if(_jit) {
+        _jit->InvalidateCode(pos, sz);
+    }
+    if(_native) {
+        _native->InvalidateCode(pos);
+    }
+}
+
+
+// Like Writing, for whole pages that are about to be replaced at once by the
+// host (loading the ROM, a save state or a checkpoint). That's not the guest
+// changing its code, so the native code goes on being used.
+void LuisaVM::WritingPages(uint32_t first, uint32_t last)
+{
+    for(uint32_t page=first; page<=last; ++page) {
+        uint64_t bit = 1ull << (page % 64);
+        if(_copy_on_write[page / 64] & bit) {
+            Preserve(page);
+        }
+        _dirty[page / 64] |= bit;
+    }
+
+    _cpu->FlushDecoded();
+    if(_jit) {
+        _jit->Flush();
+    }
+    if(_native) {
+        _native->MemoryReloaded();
+    }
 }
 
 
-void LuisaVM::Set32(uint32_t pos, uint32_t data)
+LuisaVM::DirtyList LuisaVM::TrackDirtyPages()
 {
-    Set(pos, static_cast<uint8_t>(data));
-    Set(pos+1, static_cast<uint8_t>(data >> 8));
-    Set(pos+2, static_cast<uint8_t>(data >> 16));
-    Set(pos+3, static_cast<uint8_t>(data >> 24));
+    DistributeDirtyPages();   // what was written so far doesn't go to the new list
+    _dirty_lists[_next_dirty_list].resize(_dirty.size(), 0);
+    return _next_dirty_list++;
+}
+
+
+void LuisaVM::UntrackDirtyPages(DirtyList list)
+{
+    if(list != DEFAULT_DIRTY_LIST) {
+        _dirty_lists.erase(list);
+    }
+}
+
+
+// Writing only marks the pages in `_dirty`, which is handed out to all the
+// lists when one of them is collected.
+void LuisaVM::DistributeDirtyPages()
+{
+    for(size_t i=0; i<_dirty.size(); ++i) {
+        if(_dirty[i] != 0) {
+            for(auto& list: _dirty_lists) {
+                list.second[i] |= _dirty[i];
+            }
+            _dirty[i] = 0;
+        }
+    }
+}
+
+
+vector<uint32_t> LuisaVM::CollectDirtyPages(DirtyList list)
+{
+    auto it = _dirty_lists.find(list);
+    if(it == _dirty_lists.end()) {
+        throw logic_error("Unknown list of dirty pages.");
+    }
+    DistributeDirtyPages();
+    vector<uint32_t> pages;
+    for(size_t i=0; i<it->second.size(); ++i) {
+        uint64_t& dirty = it->second[i];
+        for(uint64_t bits = dirty; bits != 0; bits &= bits - 1) {
+            pages.push_back(static_cast<uint32_t>(i * 64 + static_cast<size_t>(__builtin_ctzll(bits))));
+        }
+        dirty = 0;
+    }
+    return pages;
+}
+
+
+// Accesses outside of the physical memory, or crossing its end. A device 
+// handles the whole access if it doesn't cross a page boundary.
+uint32_t LuisaVM::GetBytes(uint32_t pos, uint32_t sz) const
+{
+    PageTable::Page const& page = _pages.Find(pos);
+    if(page.device && (pos & PageTable::PAGE_MASK) + sz <= PageTable::PAGE_SIZE) {
+        return (sz == 2) ? page.device->Get16(pos - page.base) : page.device->Get32(pos - page.base);
+    }
+
+    uint32_t value = 0;
+    for(uint32_t i=0; i<sz; ++i) {
+        value |= static_cast<uint32_t>(GetPhysical(pos + i)) << (8 * i);
+    }
+    return value;
+}
+
+
+void LuisaVM::SetBytes(uint32_t pos, uint32_t data, uint32_t sz)
+{
+    PageTable::Page const& page = _pages.Find(pos);
+    if(page.device && (pos & PageTable::PAGE_MASK) + sz <= PageTable::PAGE_SIZE) {
+        if(sz == 2) {
+            page.device->Set16(pos - page.base, static_cast<uint16_t>(data));
+        } else {
+            page.device->Set32(pos - page.base, data);
+        }
+        return;
+    }
+
+    for(uint32_t i=0; i<sz; ++i) {
+        SetPhysical(pos + i, static_cast<uint8_t>(data >> (8 * i)));
+    }
 }
 
 // }}}
 
-// {{{ rom loading
+// {{{ device events
 
-void
-LuisaVM::LoadROM(string const& rom_filename, string const& map_filename)
+void LuisaVM::Schedule(Device& device, uint64_t cycles)
 {
-    ifstream ifs(rom_filename, ios::binary|ios::ate);
-    ifstream::pos_type pos = ifs.tellg();
-    if(pos < 0) {
-        throw runtime_error("Error reading file " + rom_filename);
+    uint64_t now = Cycles();
+    uint64_t time = (cycles >= NEVER - now) ? NEVER : now + cycles;
+    _scheduled[&device] = time;
+    if(time == NEVER) {
+        return;
+    }
+    if(_events.empty() || time < _events.top().time) {
+        _cpu->Yield();   // the current slice might go past it
+    }
+    _events.push({ time, &device });
+
+    // events replaced or cancelled stay in the queue until they are due, so
+    // it's rebuilt if they pile up
+    if(_events.size() > 2 * _scheduled.size() + 16) {
+        _events = decltype(_events)();
+        for(auto const& e: _scheduled) {
+            if(e.second != NEVER) {
+                _events.push({ e.second, e.first });
+            }
+        }
+    }
+}
+
+
+uint64_t LuisaVM::CyclesToNextEvent() const
+{
+    return _events.empty() ? NEVER : (_events.top().time > _cycles ? _events.top().time - _cycles : 0);
+}
+
+
+void LuisaVM::Unschedule(Device& device)
+{
+    auto it = _scheduled.find(&device);
+    if(it != _scheduled.end()) {
+        it->second = NEVER;
+    }
+}
+
+
+// An event is only valid if it's still the one the device is waiting for.
+// The devices are kept in `_scheduled` after their events run, so that 
+// scheduling them again doesn't allocate memory. Any event wakes the CPU.
+void LuisaVM::RunEvents()
+{
+    while(!_events.empty() && _events.top().time <= _cycles) {
+        Event e = _events.top();
+        _events.pop();
+        auto it = _scheduled.find(e.device);
+        if(it != _scheduled.end() && it->second == e.time) {
+            it->second = NEVER;
+            _cpu->Waiting = false;
+            e.device->Step();
+        }
+    }
+}
+
+
+// Takes the most urgent interrupt, unless the CPU is still handling one (or
+// has masked them with the IM flag). Handlers run in the supervisor, so the
+// vector table is in the physical memory.
+StopReason LuisaVM::DeliverInterrupt()
+{
+    int line = _interrupts->Next();
+    if(line < 0 || _cpu->Flag(IM)) {
+        return StopReason {};
+    }
+    uint8_t l = static_cast<uint8_t>(line);
+    _interrupts->Clear(l);
+    bool from_user = _translating;
+    _mmu->Enable(false);
+    StopReason stop = _cpu->Interrupt(Get32(_interrupts->Vector(l)), from_user);
+    if(stop.Trapped()) {
+        _mmu->Enable(from_user);
+    }
+    return stop;
+}
+
+// }}}
+
+// {{{ address translation
+
+// The cached decoded instructions and the TLB belong to the old segment.
+// The JIT and the native code don't know about the MMU, so they are not 
+// used while it is enabled.
+void LuisaVM::SegmentChanged()
+{
+    _translating = _mmu->Enabled();
+    _segment_base = _mmu->Base();
+    _segment_limit = _mmu->Limit();
+    _tlb.fill(TLBEntry());
+
+    _cpu->FlushDecoded();
+    if(_jit) {
+        _jit->Flush();
+    }
+}
+
+
+// Finds where an access that doesn't cross a page boundary lands in the 
+// physical memory, faulting if it is outside of the segment. The segment
+// never reaches the device area, so the tasks can't change the MMU. Pages
+// that lie entirely within the segment and the physical memory go to the TLB.
+bool LuisaVM::Translate(uint32_t pos, uint32_t sz, uint32_t& physical) const
+{
+    if(static_cast<uint64_t>(pos) + sz > _segment_limit 
+            || static_cast<uint64_t>(_segment_base) + pos + sz > DEVICE_AREA) {
+        _cpu->Trap(StopReason::SEGMENT_FAULT, pos);
+        return false;
+    }
+    physical = _segment_base + pos;
+
+    uint32_t page = pos >> PageTable::PAGE_BITS;
+    uint64_t page_end = static_cast<uint64_t>(page + 1) << PageTable::PAGE_BITS;
+    uint32_t page_pos = physical & ~PageTable::PAGE_MASK;
+    if(page_end <= _segment_limit && static_cast<uint64_t>(page_pos) + PageTable::PAGE_SIZE <= _physical_memory.size()) {
+        _tlb[page % TLB_SIZE] = { page, page_pos, _physical_memory.data() + page_pos };
+    }
+    return true;
+}
+
+
+// accesses crossing a page boundary are translated byte by byte
+uint32_t LuisaVM::GetTranslated(uint32_t pos, uint32_t sz) const
+{
+    uint32_t physical;
+    if((pos & PageTable::PAGE_MASK) + sz <= PageTable::PAGE_SIZE) {
+        if(!Translate(pos, sz, physical)) {
+            return 0;
+        }
+        if(sz == 1) {
+            return GetPhysical(physical);
+        }
+        return InRAM(physical, sz) ? (sz == 2 ? Load<uint16_t>(physical) : Load<uint32_t>(physical)) : GetBytes(physical, sz);
+    }
+
+    uint32_t value = 0;
+    for(uint32_t i=0; i<sz; ++i) {
+        if(Translate(pos + i, 1, physical)) {
+            value |= static_cast<uint32_t>(GetPhysical(physical)) << (8 * i);
+        }
+    }
+    return value;
+}
+
+
+void LuisaVM::SetTranslated(uint32_t pos, uint32_t data, uint32_t sz)
+{
+    uint32_t physical;
+    if((pos & PageTable::PAGE_MASK) + sz <= PageTable::PAGE_SIZE) {
+        if(!Translate(pos, sz, physical)) {
+            return;
+        }
+        if(sz == 1) {
+            SetPhysical(physical, static_cast<uint8_t>(data));
+        } else if(!InRAM(physical, sz)) {
+            SetBytes(physical, data, sz);
+        } else if(sz == 2) {
+            Store(physical, static_cast<uint16_t>(data));
+        } else {
+            Store(physical, data);
+        }
+        return;
     }
 
-    if(static_cast<size_t>(pos) >= PhysicalMemory().size()) {
-        throw runtime_error("Memory is too small to accomodate such a large ROM.");
+    for(uint32_t i=0; i<sz; ++i) {
+        if(Translate(pos + i, 1, physical)) {
+            SetPhysical(physical, static_cast<uint8_t>(data >> (8 * i)));
+        }
     }
+}
+
+// }}}
+
+// {{{ snapshots
 
-    ifs.seekg(0, ios::beg);
-    ifs.read(reinterpret_cast<char*>(&PhysicalMemory()[0]), pos);
+// Taking a snapshot only marks every page as copy-on-write: a page is 
+// copied into the snapshots that don't have it yet the first time it is 
+// written afterwards. The copy is shared by all of them.
+shared_ptr<VMSnapshot> LuisaVM::Snapshot()
+{
+    auto snapshot = make_shared<VMSnapshot>();
+    snapshot->_owner = this;
+    snapshot->_registers = _cpu->Register;
+    snapshot->_keyboard = keyboard().Queue;
+    snapshot->_mmu = _mmu->SaveState();
+    snapshot->_interrupts = _interrupts->SaveState();
+    snapshot->_timer = _timer->SaveState();
+
+    _snapshots.erase(remove_if(begin(_snapshots), end(_snapshots), 
+                [](weak_ptr<VMSnapshot> const& w) { return w.expired(); }), end(_snapshots));
+    _snapshots.push_back(snapshot);
+    fill(begin(_copy_on_write), end(_copy_on_write), ~0ull);
+    return snapshot;
+}
+
+
+// Only the pages written since the snapshot are copied back. The snapshot
+// stays valid, and can be restored again later.
+void LuisaVM::Restore(VMSnapshot const& snapshot)
+{
+    if(snapshot._owner != this) {
+        throw logic_error("The snapshot was taken from another VM.");
+    }
+
+    for(auto const& page: snapshot._pages) {
+        uint32_t pos = page.first << PageTable::PAGE_BITS;
+        Writing(pos, PageTable::PAGE_SIZE);
+        memcpy(_physical_memory.data() + pos, page.second->data(), PageTable::PAGE_SIZE);
+    }
+    _cpu->Register = snapshot._registers;
+    keyboard().Queue = snapshot._keyboard;
+    _mmu->LoadState(snapshot._mmu);
+    _interrupts->LoadState(snapshot._interrupts);
+    _timer->LoadState(snapshot._timer);
+
+    // the memory is now the same as in the snapshot again
+    fill(begin(_copy_on_write), end(_copy_on_write), ~0ull);
+    if(_native) {
+        _native->MemoryReloaded();
+    }
+}
+
+
+void LuisaVM::Preserve(uint32_t page)
+{
+    uint64_t bit = 1ull << (page % 64);
+    _copy_on_write[page / 64] &= ~bit;
+    if(_dedup && (_shared[page / 64] & bit)) {
+        _shared[page / 64] &= ~bit;
+        _dedup->Unshare(*this, page);
+    }
+
+    shared_ptr<vector<uint8_t>> copy;
+    for(weak_ptr<VMSnapshot> const& w: _snapshots) {
+        shared_ptr<VMSnapshot> snapshot = w.lock();
+        if(snapshot && snapshot->_pages.count(page) == 0) {
+            if(!copy) {
+                uint8_t const* data = _physical_memory.data() + (static_cast<size_t>(page) << PageTable::PAGE_BITS);
+                copy = make_shared<vector<uint8_t>>(data, data + PageTable::PAGE_SIZE);
+            }
+            snapshot->_pages.emplace(page, copy);
+        }
+    }
+}
+
+// }}}
+
+// {{{ save states
+
+// A save state file has a header, the state of each device and the list of
+// pages of the physical memory that are not all zeros. The contents of these
+// pages come next, aligned to the page size, so that they can be mapped 
+// straight into the memory. All integers are little-endian.
+static const char     SAVE_STATE_MAGIC[8] = { 'L', 'V', 'M', 'S', 'T', 'A', 'T', 'E' };
+static const uint32_t SAVE_STATE_VERSION = 1;
+
+static void Put(vector<uint8_t>& data, uint64_t value, int sz)
+{
+    for(int i=0; i<sz; ++i) {
+        data.push_back(static_cast<uint8_t>(value >> (8 * i)));
+    }
+}
+
+
+static uint64_t Take(istream& is, int sz)
+{
+    uint64_t value = 0;
+    for(int i=0; i<sz; ++i) {
+        int c = is.get();
+        if(c == EOF) {
+            throw runtime_error("Save state file is truncated.");
+        }
+        value |= static_cast<uint64_t>(c) << (8 * i);
+    }
+    return value;
+}
+
+
+void LuisaVM::SaveState(string const& filename) const
+{
+    static const uint8_t zero[PageTable::PAGE_SIZE] = {};
+    uint32_t n_pages = static_cast<uint32_t>(_physical_memory.size() / PageTable::PAGE_SIZE);
+    vector<uint32_t> pages;
+    for(uint32_t page=0; page<n_pages; ++page) {
+        if(memcmp(_physical_memory.data() + (static_cast<size_t>(page) << PageTable::PAGE_BITS), zero, PageTable::PAGE_SIZE) != 0) {
+            pages.push_back(page);
+        }
+    }
+
+    vector<uint8_t> header(begin(SAVE_STATE_MAGIC), end(SAVE_STATE_MAGIC));
+    Put(header, SAVE_STATE_VERSION, 4);
+    Put(header, PageTable::PAGE_SIZE, 4);
+    Put(header, _physical_memory.size(), 8);
+    Put(header, _devices.size(), 4);
+    Put(header, pages.size(), 4);
+    for(auto const& dev: _devices) {
+        vector<uint8_t> state = dev->SaveState();
+        Put(header, state.size(), 4);
+        header.insert(end(header), begin(state), end(state));
+    }
+    for(uint32_t page: pages) {
+        Put(header, page, 4);
+    }
+    header.resize((header.size() + PageTable::PAGE_MASK) & ~static_cast<size_t>(PageTable::PAGE_MASK), 0);
+
+    // The file might be the one the memory was loaded from, and still be
+    // mapped: it's written aside and then replaces the old one, which stays
+    // around for as long as it's mapped.
+    string temp = filename + ".tmp";
+    ofstream ofs(temp, ios::binary);
+    ofs.write(reinterpret_cast<char const*>(header.data()), static_cast<streamsize>(header.size()));
+    for(uint32_t page: pages) {
+        ofs.write(reinterpret_cast<char const*>(_physical_memory.data() + (static_cast<size_t>(page) << PageTable::PAGE_BITS)), PageTable::PAGE_SIZE);
+    }
+    ofs.close();
+#if defined(_WIN32)
+    if(ofs) {
+        remove(filename.c_str());   // the file is read, not mapped, on Windows
+    }
+#endif
+    if(!ofs || rename(temp.c_str(), filename.c_str()) != 0) {
+        remove(temp.c_str());
+        throw runtime_error("Error writing file " + filename);
+    }
+}
+
+
+// The file is checked before anything is changed. The pages are then 
+// mapped private from the file, so they are only read when used.
+void LuisaVM::LoadState(string const& filename)
+{
+    ifstream ifs(filename, ios::binary);
+    if(!ifs) {
+        throw runtime_error("Error reading file " + filename);
+    }
+    char magic[sizeof SAVE_STATE_MAGIC];
+    if(!ifs.read(magic, sizeof magic) || memcmp(magic, SAVE_STATE_MAGIC, sizeof magic) != 0) {
+        throw runtime_error(filename + " is not a save state file.");
+    }
+    if(Take(ifs, 4) != SAVE_STATE_VERSION) {
+        throw runtime_error("Unsupported save state version.");
+    }
+    if(Take(ifs, 4) != PageTable::PAGE_SIZE || Take(ifs, 8) != _physical_memory.size()) {
+        throw runtime_error("The save state is from a VM with a different memory size.");
+    }
+
+    vector<vector<uint8_t>> states(Take(ifs, 4));
+    uint32_t n_pages = static_cast<uint32_t>(_physical_memory.size() / PageTable::PAGE_SIZE);
+    vector<uint32_t> pages(Take(ifs, 4));
+    if(pages.size() > n_pages) {
+        throw runtime_error("Invalid save state file.");
+    }
+    for(vector<uint8_t>& state: states) {
+        state.resize(Take(ifs, 4));
+        if(!ifs.read(reinterpret_cast<char*>(state.data()), static_cast<streamsize>(state.size()))) {
+            throw runtime_error("Save state file is truncated.");
+        }
+    }
+    for(size_t i=0; i<pages.size(); ++i) {
+        pages[i] = static_cast<uint32_t>(Take(ifs, 4));
+        if(pages[i] >= n_pages || (i > 0 && pages[i] <= pages[i-1])) {
+            throw runtime_error("Invalid save state file.");
+        }
+    }
+    uint64_t offset = (static_cast<uint64_t>(ifs.tellg()) + PageTable::PAGE_MASK) & ~static_cast<uint64_t>(PageTable::PAGE_MASK);
+    ifs.seekg(0, ios::end);
+    if(static_cast<uint64_t>(ifs.tellg()) < offset + pages.size() * PageTable::PAGE_SIZE) {
+        throw runtime_error("Save state file is truncated.");
+    }
+    ifs.close();
+
+    int fd = open(filename.c_str(), O_RDONLY|O_BINARY);
+    if(fd < 0) {
+        throw runtime_error("Error reading file " + filename);
+    }
+    WritingPages(0, n_pages - 1);
+    _physical_memory.Clear();
+    try {
+        // consecutive pages are mapped at once
+        for(size_t i=0; i<pages.size(); ) {
+            size_t n = 1;
+            while(i + n < pages.size() && pages[i + n] == pages[i] + n) {
+                ++n;
+            }
+            _physical_memory.MapFile(fd, offset + i * PageTable::PAGE_SIZE, 
+                    static_cast<size_t>(pages[i]) << PageTable::PAGE_BITS, n * PageTable::PAGE_SIZE);
+            i += n;
+        }
+    } catch(...) {
+        close(fd);
+        throw;
+    }
+    close(fd);
+
+    for(size_t i=0; i<states.size() && i<_devices.size(); ++i) {
+        _devices[i]->LoadState(states[i]);
+    }
+}
+
+// }}}
+
+// {{{ rom loading
+
+// The ROM is mapped into the physical memory rather than copied, so loading
+// doesn't depend on its size, and VMs running the same ROM share the pages
+// that they don't write to.
+void
+LuisaVM::LoadROM(string const& rom_filename, string const& /* map_filename */)
+{
+    ifstream ifs(rom_filename, ios::binary|ios::ate);
+    streamoff size = ifs.tellg();
+    if(size > 0 && static_cast<uint64_t>(size) < _physical_memory.size()) {
+        WritingPages(0, static_cast<uint32_t>((size - 1) >> PageTable::PAGE_BITS));
+    }
+    _physical_memory.MapFile(rom_filename);
 
     // TODO - load map
 }
@@ -131,7 +770,7 @@ LuisaVM::LoadROM(string const& rom_filename, string const& map_filename)
 
 Video& LuisaVM::AddVideo(Video::Callbacks const& cb)
 {
-    Video& video = AddDevice<Video>(cb);
+    Video& video = AddDevice<Video>(*this, cb);
     _debugger = &AddDevice<Debugger>(*this, video);
     return video;
 }
@@ -149,6 +788,18 @@ LuisaVM::RegisterKeyEvent(Keyboard::KeyPress const& kp)
         }
     } else {
         keyboard().Queue.push_back(kp);
+        _interrupts->Raise(InterruptController::KEYBOARD);
+        _cpu->Waiting = false;
+    }
+}
+
+
+void
+LuisaVM::RaiseInterrupt(InterruptController::Line line)
+{
+    _interrupts->Raise(line);
+    if(_interrupts->Enabled(line) || _cpu->Polling) {   // a polling loop might be reading PENDING
+        _cpu->Waiting = false;
     }
 }
 
@@ -1,62 +1,290 @@
 #ifndef LUISAVM_HH_
 #define LUISAVM_HH_
 
+#include <array>
 #include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
 #include <memory>
+#include <queue>
 #include <string>
+#include <unordered_map>
 #include <vector>
 using namespace std;
 
 #include "assembler.hh"
+#include "checkpoint.hh"
 #include "cpu.hh"
+#include "dedup.hh"
 #include "device.hh"
+#include "interrupts.hh"
+#include "jit.hh"
 #include "keyboard.hh"
+#include "memory.hh"
+#include "mmu.hh"
+#include "native.hh"
+#include "pagetable.hh"
+#include "timer.hh"
 #include "video.hh"
 
 namespace luisavm {
 
+// The state of a VM at some point: the CPU registers, the keyboard queue,
+// the MMU, the interrupt controller, the timer and the physical memory. It
+// only holds the pages that the VM wrote to since then.
+class VMSnapshot {
+public:
+    size_t PagesCopied() const { return _pages.size(); }
+
+private:
+    friend class LuisaVM;
+
+    class LuisaVM const*                                  _owner = nullptr;
+    array<uint32_t, 16>                                   _registers;
+    deque<Keyboard::KeyPress>                             _keyboard;
+    vector<uint8_t>                                       _mmu;
+    vector<uint8_t>                                       _interrupts;
+    vector<uint8_t>                                       _timer;
+    unordered_map<uint32_t, shared_ptr<vector<uint8_t>>> _pages;
+};
+
 class LuisaVM {
 public:
-    explicit LuisaVM(uint32_t physical_memory_size = 16*1024);
+    explicit LuisaVM(uint32_t physical_memory_size = 16*1024);   // rounded up to whole pages
+    ~LuisaVM();
+
+    // The devices, the JIT and the debugger keep a reference to the VM, so
+    // it stays where it was created: hold it by pointer to pass it around.
+    LuisaVM(LuisaVM const&) = delete;
+    LuisaVM& operator=(LuisaVM const&) = delete;
+
+    void       Reset();
+    StopReason Step();
+    StopReason Run(uint64_t max_cycles);
+
+    // Time of the VM, in cycles run by the CPU since it was created. While
+    // running, it includes the current slice up to the instruction that is
+    // accessing a device (see CPU::Elapsed).
+    uint64_t Cycles() const { return _cycles + _cpu->Elapsed(); }
+
+    // Calls `device.Step()` once `cycles` more cycles have run. The CPU runs
+    // without stopping until the next event is due, so an event is never 
+    // early, but it can be late by the time of one instruction (or of one
+    // JIT block). An event scheduled while running, earlier than the others,
+    // makes the CPU yield. A device has at most one pending event: 
+    // scheduling it again replaces it. Scheduling with UINT64_MAX cycles
+    // cancels it.
+    void     Schedule(Device& device, uint64_t cycles);
+    void     Unschedule(Device& device);
+    uint64_t CyclesToNextEvent() const;   // UINT64_MAX if there's none
+
+    void EnableJIT(bool enable);
+    bool JITEnabled() const { return _jit != nullptr; }
 
-    void Reset();
-    void Step();  // TODO - time
-    void StepDevices();
+    // loads the code generated by `lac` for the ROM, and runs it instead of
+    // the interpreter or the JIT
+    void LoadNative(string const& filename);
+    void UnloadNative() { _native.reset(); }
 
+    // Logical memory, translated by the MMU when it is enabled. Multi-byte 
+    // accesses that lie entirely in the physical memory (or in a page found
+    // in the TLB) are done with a single load or store; the others go 
+    // through the page table.
     uint8_t  Get(uint32_t pos) const;
     void     Set(uint32_t pos, uint8_t data);
-    uint16_t Get16(uint32_t pos) const;
-    void     Set16(uint32_t pos, uint16_t data);
-    uint32_t Get32(uint32_t pos) const;
-    void     Set32(uint32_t pos, uint32_t data);
+    uint16_t Get16(uint32_t pos) const {
+        if(_translating) { return LoadTranslated<uint16_t>(pos); }
+        return InRAM(pos, 2) ? Load<uint16_t>(pos) : static_cast<uint16_t>(GetBytes(pos, 2));
+    }
+    void Set16(uint32_t pos, uint16_t data) {
+        if(_translating) { StoreTranslated(pos, data); return; }
+        if(InRAM(pos, 2)) { Store(pos, data); } else { SetBytes(pos, data, 2); }
+    }
+    uint32_t Get32(uint32_t pos) const {
+        if(_translating) { return LoadTranslated<uint32_t>(pos); }
+        return InRAM(pos, 4) ? Load<uint32_t>(pos) : GetBytes(pos, 4);
+    }
+    void Set32(uint32_t pos, uint32_t data) {
+        if(_translating) { StoreTranslated(pos, data); return; }
+        if(InRAM(pos, 4)) { Store(pos, data); } else { SetBytes(pos, data, 4); }
+    }
+
+    // While the MMU is enabled, the JIT and the native code are not used.
+    bool Translating() const { return _translating; }
+
+    // Whether the guest reading the logical memory gets the same value until
+    // the CPU is woken up (see Device::Steady). Tasks only see the RAM.
+    bool Steady(uint32_t pos, uint32_t sz) const;
 
-    vector<uint8_t>& PhysicalMemory() { return _physical_memory; }
+    // writing directly to the physical memory bypasses the decoded instruction 
+    // cache and the JIT: call cpu().FlushDecoded() and jit()->Flush() afterwards
+    Span<uint8_t> PhysicalMemory() const { return Span<uint8_t>(_physical_memory.data(), _physical_memory.size()); }
 
+    // Pages of the physical memory (numbered from 0, PageTable::PAGE_SIZE 
+    // bytes each) written since the last call, which clears the list. Writes
+    // made directly on PhysicalMemory() are not tracked. Each consumer (the
+    // checkpointer, a debugger view...) registers its own list, so they don't
+    // take the pages from each other; the default one is always there.
+    typedef uint32_t DirtyList;
+    enum : DirtyList { DEFAULT_DIRTY_LIST = 0 };
+
+    DirtyList        TrackDirtyPages();   // empty at first
+    void             UntrackDirtyPages(DirtyList list);
+    vector<uint32_t> CollectDirtyPages(DirtyList list=DEFAULT_DIRTY_LIST);
+
+    // Snapshots share the memory with the VM, copying a page only when it is
+    // written to. Restoring doesn't consume the snapshot.
+    shared_ptr<VMSnapshot> Snapshot();
+    void                   Restore(VMSnapshot const& snapshot);
+
+    // The ROM is mapped, not read: it must not be rewritten in place (truncated
+    // and written again) while a VM uses it, or the guest memory changes under
+    // it, or the host gets SIGBUS. Write a new file and rename it over the old
+    // one instead.
     void LoadROM(string const& rom_filename, string const& map_filename);
 
+    // Saves the registers, the state of the devices and the non-zero pages of
+    // the physical memory. Loading maps the pages from the file rather than
+    // reading them; the VM must have the same memory size.
+    void SaveState(string const& filename) const;
+    void LoadState(string const& filename);
+
     Video& AddVideo(Video::Callbacks const& cb);
 
     void RegisterKeyEvent(Keyboard::KeyPress const& kp);
 
-    static const uint32_t COMMAND_POS = 0xFFFF0000;
+    // raises an interrupt line, waking up the CPU if the line is enabled
+    void RaiseInterrupt(InterruptController::Line line);
+
+    static const uint32_t DEVICE_AREA = 0xF0000000,
+                          COMMAND_POS = 0xFFFF0000;
 
-    CPU&      cpu() const      { return *dynamic_cast<CPU*>(_devices[0].get()); }
+    // Adds a device to the computer, mapping its memory area (if any) into
+    // the logical memory.
+    template<typename D, typename ...Args>
+    D& AddDevice(Args&&... args) {
+        _devices.push_back(make_unique<D>(args...));
+        Device& device = *_devices.back();
+        if(device.MemorySize() > 0) {
+            _pages.MapDevice(device);
+        }
+        return static_cast<D&>(device);
+    }
+
+    CPU&      cpu() const      { return *_cpu; }
     Keyboard& keyboard() const { return *dynamic_cast<Keyboard*>(_devices[1].get()); }
+    MMU&      mmu() const      { return *_mmu; }
+    InterruptController& interrupts() const { return *_interrupts; }
+    Timer&    timer() const    { return *_timer; }
+    JIT*      jit() const      { return _jit.get(); }
+    Native*   native() const   { return _native.get(); }
 
 private:
+    friend class Checkpointer;
+    friend class MMU;
+    friend class PageDedup;
+
+    // a page of the segment, and where it is in the physical memory
+    struct TLBEntry {
+        uint32_t page = 0xFFFFFFFF;   // virtual page number
+        uint32_t pos = 0;             // physical address of the page
+        uint8_t* ram = nullptr;
+    };
+    static const uint32_t TLB_SIZE = 64;
+
+    static const uint64_t NEVER = UINT64_MAX;
+
+    struct Event {
+        uint64_t time;
+        Device*  device;
+        bool operator>(Event const& other) const { return time > other.time; }
+    };
+
     vector<unique_ptr<Device>> _devices;
-    vector<uint8_t> _physical_memory;
+    HostMemory         _physical_memory;
+    PageTable          _pages;
+    vector<uint64_t>   _dirty;            // one bit per page of the physical memory, not given to the lists yet
+    unordered_map<DirtyList, vector<uint64_t>> _dirty_lists;
+    DirtyList          _next_dirty_list = DEFAULT_DIRTY_LIST + 1;
+    vector<uint64_t>   _copy_on_write;    // pages that some snapshot might still need, or shared
+    vector<weak_ptr<VMSnapshot>> _snapshots;
+    PageDedup*         _dedup = nullptr;
+    vector<uint64_t>   _shared;           // pages mapped from the deduplication service
+    CPU*               _cpu = nullptr;
+    MMU*               _mmu = nullptr;
+    InterruptController* _interrupts = nullptr;
+    Timer*             _timer = nullptr;
+    bool               _translating = false;
+    uint32_t           _segment_base = 0,
+                       _segment_limit = 0;
+    mutable array<TLBEntry, TLB_SIZE> _tlb;
+    uint64_t           _cycles = 0;
+    priority_queue<Event, vector<Event>, greater<Event>> _events;
+    unordered_map<Device*, uint64_t> _scheduled;   // time of the pending event of each device, or NEVER
+    unique_ptr<JIT>    _jit;
+    unique_ptr<Native> _native;
 
     class Debugger* _debugger = nullptr;
-    
-    template<typename D, typename ...Args>
-    D& AddDevice(Args&&... args) {
-        _devices.push_back(make_unique<D>(args...));
-        return *static_cast<D*>(_devices.back().get());
+
+    // the direct loads and stores assume a little-endian host
+    bool InRAM(uint32_t pos, uint32_t sz) const {
+        return __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ 
+            && static_cast<uint64_t>(pos) + sz <= _physical_memory.size();
+    }
+
+    template<typename T> T Load(uint32_t pos) const {
+        T value;
+        memcpy(&value, _physical_memory.data() + pos, sizeof value);
+        return value;
+    }
+
+    template<typename T> void Store(uint32_t pos, T value) {
+        Writing(pos, sizeof value);
+        memcpy(_physical_memory.data() + pos, &value, sizeof value);
     }
+
+    template<typename T> T LoadTranslated(uint32_t pos) const {
+        TLBEntry const& e = _tlb[(pos >> PageTable::PAGE_BITS) % TLB_SIZE];
+        if(e.page == (pos >> PageTable::PAGE_BITS) && (pos & PageTable::PAGE_MASK) <= PageTable::PAGE_SIZE - sizeof(T)
+                && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) {
+            T value;
+            memcpy(&value, e.ram + (pos & PageTable::PAGE_MASK), sizeof value);
+            return value;
+        }
+        return static_cast<T>(GetTranslated(pos, sizeof(T)));
+    }
+
+    template<typename T> void StoreTranslated(uint32_t pos, T value) {
+        TLBEntry const& e = _tlb[(pos >> PageTable::PAGE_BITS) % TLB_SIZE];
+        if(e.page == (pos >> PageTable::PAGE_BITS) && (pos & PageTable::PAGE_MASK) <= PageTable::PAGE_SIZE - sizeof(T)
+                && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) {
+            Writing(e.pos + (pos & PageTable::PAGE_MASK), sizeof value);
+            memcpy(e.ram + (pos & PageTable::PAGE_MASK), &value, sizeof value);
+            return;
+        }
+        SetTranslated(pos, value, sizeof(T));
+    }
+
+    void       RunEvents();
+    StopReason DeliverInterrupt();
+    void     SegmentChanged();
+    bool     Translate(uint32_t pos, uint32_t sz, uint32_t& physical) const;
+    uint32_t GetTranslated(uint32_t pos, uint32_t sz) const;
+    void     SetTranslated(uint32_t pos, uint32_t data, uint32_t sz);
+    uint8_t  GetPhysical(uint32_t pos) const;
+    void     SetPhysical(uint32_t pos, uint8_t data);
+    void     Writing(uint32_t pos, uint32_t sz);
+    void     WritingPages(uint32_t first, uint32_t last);
+    void     DistributeDirtyPages();
+    void     Preserve(uint32_t page);
+    void     Unmapped(uint32_t pos) const;
+    uint32_t GetBytes(uint32_t pos, uint32_t sz) const;
+    void     SetBytes(uint32_t pos, uint32_t data, uint32_t sz);
 };
 
-void run_tests();
+// `allocations`, if given, returns the number of heap allocations done so far
+void run_tests(size_t (*allocations)() = nullptr);
 
 }  // namespace luisavm
 
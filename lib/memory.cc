@@ -0,0 +1,124 @@
+#include "memory.hh"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#if defined(_WIN32)
+#  include <io.h>
+#  include <windows.h>
+#else
+#  include <sys/mman.h>
+#  include <unistd.h>
+#endif
+
+#ifndef O_BINARY
+#  define O_BINARY 0
+#endif
+
+namespace luisavm {
+
+HostMemory::HostMemory(size_t size)
+    : _size(size)
+{
+    if(size == 0) {
+        return;
+    }
+#if defined(_WIN32)
+    void* mem = VirtualAlloc(nullptr, size, MEM_RESERVE|MEM_COMMIT, PAGE_READWRITE);
+    if(mem == nullptr) {
+#else
+    void* mem = mmap(nullptr, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if(mem == MAP_FAILED) {
+#endif
+        throw runtime_error("Could not allocate the physical memory.");
+    }
+    _data = static_cast<uint8_t*>(mem);
+}
+
+
+HostMemory::~HostMemory()
+{
+    if(_data == nullptr) {
+        return;
+    }
+#if defined(_WIN32)
+    VirtualFree(_data, 0, MEM_RELEASE);
+#else
+    munmap(_data, _size);
+#endif
+}
+
+
+void HostMemory::Clear(size_t pos, size_t size)
+{
+#if !defined(_WIN32)
+    if(size > 0 && mmap(_data + pos, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE|MAP_FIXED, -1, 0) != MAP_FAILED) {
+        return;
+    }
+#endif
+    memset(_data + pos, 0, size);
+}
+
+
+size_t HostMemory::MapFile(string const& filename)
+{
+    int fd = open(filename.c_str(), O_RDONLY|O_BINARY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) != 0) {
+        if(fd >= 0) {
+            close(fd);
+        }
+        throw runtime_error("Error reading file " + filename);
+    }
+
+    size_t size = static_cast<size_t>(st.st_size);
+    if(size >= _size) {
+        close(fd);
+        throw runtime_error("Memory is too small to accomodate such a large ROM.");
+    }
+    try {
+        MapFile(fd, 0, 0, size);
+    } catch(...) {
+        close(fd);
+        throw;
+    }
+    close(fd);
+    return size;
+}
+
+
+// When the file can't be mapped (on Windows, or if the offset is not
+// aligned to the host pages) it is read instead.
+void HostMemory::MapFile(int fd, uint64_t offset, size_t pos, size_t size)
+{
+    if(size == 0 || TryMapFile(fd, offset, pos, size)) {
+        return;
+    }
+
+    if(lseek(fd, static_cast<off_t>(offset), SEEK_SET) < 0) {
+        throw runtime_error("Error reading file.");
+    }
+    for(size_t done = 0; done < size; ) {
+        auto n = read(fd, _data + pos + done, static_cast<unsigned>(min<size_t>(size - done, 1 << 30)));
+        if(n <= 0) {
+            throw runtime_error("Error reading file.");
+        }
+        done += static_cast<size_t>(n);
+    }
+}
+
+
+bool HostMemory::TryMapFile(int fd, uint64_t offset, size_t pos, size_t size)
+{
+#if !defined(_WIN32)
+    return mmap(_data + pos, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_FIXED, fd, static_cast<off_t>(offset)) != MAP_FAILED;
+#else
+    (void) fd; (void) offset; (void) pos; (void) size;
+    return false;
+#endif
+}
+
+}  // namespace luisavm
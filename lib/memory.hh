@@ -0,0 +1,79 @@
+#ifndef MEMORY_HH_
+#define MEMORY_HH_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+using namespace std;
+
+namespace luisavm {
+
+// A view over contiguous memory owned by someone else (like C++20's span).
+template<typename T>
+class Span {
+public:
+    Span(T* data, size_t size) : _data(data), _size(size) {}
+
+    T*     data() const  { return _data; }
+    size_t size() const  { return _size; }
+    bool   empty() const { return _size == 0; }
+    T*     begin() const { return _data; }
+    T*     end() const   { return _data + _size; }
+
+    T& operator[](size_t i) const { return _data[i]; }
+
+private:
+    T*     _data;
+    size_t _size;
+};
+
+// Zero-filled memory reserved from the operating system. The host only 
+// commits a page when it is first touched, so a large guest memory costs
+// nothing until it is used.
+class HostMemory {
+public:
+    explicit HostMemory(size_t size);
+    ~HostMemory();
+
+    HostMemory(HostMemory&& other) : _data(other._data), _size(other._size) { 
+        other._data = nullptr; 
+        other._size = 0; 
+    }
+    HostMemory& operator=(HostMemory&& other) {
+        swap(_data, other._data);
+        swap(_size, other._size);
+        return *this;
+    }
+    HostMemory(HostMemory const&) = delete;
+    HostMemory& operator=(HostMemory const&) = delete;
+
+    uint8_t* data() const { return _data; }
+    size_t   size() const { return _size; }
+
+    // Maps the file at the start of the memory, and returns its size. The 
+    // mapping is private: the pages are read on demand, and shared with 
+    // everyone else mapping the same file until they are written. The rest
+    // of the last page is zeroed.
+    size_t MapFile(string const& filename);
+
+    // Maps `size` bytes of the open file, starting at `offset` (a multiple
+    // of the page size), at position `pos` of the memory.
+    void MapFile(int fd, uint64_t offset, size_t pos, size_t size);
+
+    // The same, but returns false instead of reading the file when it can't
+    // be mapped.
+    bool TryMapFile(int fd, uint64_t offset, size_t pos, size_t size);
+
+    // zeroes the memory (or part of it), giving the pages back to the host
+    void Clear() { Clear(0, _size); }
+    void Clear(size_t pos, size_t size);
+
+private:
+    uint8_t* _data = nullptr;
+    size_t   _size;
+};
+
+}  // namespace luisavm
+
+#endif
@@ -0,0 +1,96 @@
+#include "mmu.hh"
+
+#include <stdexcept>
+using namespace std;
+
+#include "luisavm.hh"
+
+namespace luisavm {
+
+void MMU::Reset()
+{
+    _reg[0] = _reg[1] = _reg[2] = _reg[3] = 0;
+    comp.SegmentChanged();
+}
+
+
+vector<uint8_t> MMU::SaveState() const
+{
+    vector<uint8_t> data;
+    for(uint32_t reg: _reg) {
+        for(int i=0; i<4; ++i) {
+            data.push_back(static_cast<uint8_t>(reg >> (8 * i)));
+        }
+    }
+    return data;
+}
+
+
+// save states from before the MMU existed have no state for it, and the
+// ones from before the supervisor stack have three registers
+void MMU::LoadState(vector<uint8_t> const& data)
+{
+    if(data.empty()) {
+        Reset();
+        return;
+    } else if(data.size() != sizeof _reg && data.size() != 12) {
+        throw runtime_error("Invalid MMU state.");
+    }
+    _reg[3] = 0;
+    for(size_t i=0; i<data.size()/4; ++i) {
+        _reg[i] = static_cast<uint32_t>(data[i*4]) | (static_cast<uint32_t>(data[i*4+1]) << 8)
+                | (static_cast<uint32_t>(data[i*4+2]) << 16) | (static_cast<uint32_t>(data[i*4+3]) << 24);
+    }
+    comp.SegmentChanged();
+}
+
+
+void MMU::Enable(bool enable)
+{
+    if(Enabled() != enable) {
+        _reg[0] ^= 1;
+        comp.SegmentChanged();
+    }
+}
+
+
+uint32_t MMU::Base() const
+{
+    return _reg[1] & ~PageTable::PAGE_MASK;
+}
+
+
+uint8_t MMU::Get(uint32_t pos)
+{
+    return (pos < sizeof _reg) ? static_cast<uint8_t>(_reg[pos / 4] >> (8 * (pos % 4))) : 0;
+}
+
+
+void MMU::Set(uint32_t pos, uint8_t data)
+{
+    if(pos < sizeof _reg) {
+        uint32_t shift = 8 * (pos % 4);
+        _reg[pos / 4] = (_reg[pos / 4] & ~(0xFFu << shift)) | (static_cast<uint32_t>(data) << shift);
+        comp.SegmentChanged();
+    }
+}
+
+
+uint32_t MMU::Get32(uint32_t pos)
+{
+    return (pos % 4 == 0 && pos < sizeof _reg) ? _reg[pos / 4] : Device::Get32(pos);
+}
+
+
+// a register is usually written whole, so the segment changes only once
+void MMU::Set32(uint32_t pos, uint32_t data)
+{
+    if(pos % 4 == 0 && pos < sizeof _reg) {
+        _reg[pos / 4] = data;
+        comp.SegmentChanged();
+    } else {
+        Device::Set32(pos, data);
+    }
+}
+
+}  // namespace luisavm
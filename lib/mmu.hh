@@ -0,0 +1,65 @@
+#ifndef MMU_HH_
+#define MMU_HH_
+
+#include <cstdint>
+#include <vector>
+using namespace std;
+
+#include "device.hh"
+
+namespace luisavm {
+
+// Relocates the guest addresses with a single segment: when enabled, an
+// address A below LIMIT is translated to BASE+A, and anything else is a
+// fault, including the device area. So the guest runs in two modes: the
+// supervisor, with the translation disabled, sees the physical memory and
+// the devices; a task in user mode only sees its segment.
+//
+// Taking an interrupt in user mode switches to the supervisor: the
+// translation is disabled, SP is loaded from STACK and the task's SP is
+// pushed before PC and FL, with the UM flag set in the copy of FL. `iret`
+// with UM set pops SP back and enables the translation again, which is
+// also how the supervisor starts a task. A task can't change IM or UM, so it
+// can't keep the interrupts away.
+//
+// Registers (32 bits each, little-endian):
+//   0x0  CONTROL   bit 0 enables the translation (user mode)
+//   0x4  BASE      physical start of the segment (low 12 bits ignored)
+//   0x8  LIMIT     size of the segment, in bytes
+//   0xC  STACK     SP of the supervisor, when an interrupt leaves user mode
+class MMU : public Device {
+public:
+    explicit MMU(class LuisaVM& comp) : comp(comp) {}
+
+    static const uint32_t POS = 0xF0000000;
+    enum Register : uint32_t { CONTROL = 0x0, BASE = 0x4, LIMIT = 0x8, STACK = 0xC };
+
+    void Reset() override;
+
+    vector<uint8_t> SaveState() const override;   // the registers
+    void            LoadState(vector<uint8_t> const& data) override;
+
+    uint32_t MemoryPos() const override  { return POS; }
+    uint32_t MemorySize() const override { return sizeof _reg; }
+
+    uint8_t  Get(uint32_t pos) override;
+    void     Set(uint32_t pos, uint8_t data) override;
+    uint32_t Get32(uint32_t pos) override;
+    void     Set32(uint32_t pos, uint32_t data) override;
+
+    bool     Enabled() const { return (_reg[0] & 1) != 0; }
+    uint32_t Base() const;
+    uint32_t Limit() const   { return _reg[2]; }
+    uint32_t Stack() const   { return _reg[3]; }
+
+    // switches between user mode and the supervisor
+    void Enable(bool enable);
+
+private:
+    LuisaVM& comp;
+    uint32_t _reg[4] = { 0, 0, 0, 0 };
+};
+
+}  // namespace luisavm
+
+#endif
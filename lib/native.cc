@@ -0,0 +1,112 @@
+#include "native.hh"
+
+#include <dlfcn.h>
+
+#include <stdexcept>
+
+#include "luisavm.hh"
+
+namespace luisavm {
+
+Native::Native(LuisaVM& comp, string const& filename)
+    : comp(comp), _context()
+{
+    _handle = dlopen(filename.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if(_handle == nullptr) {
+        throw runtime_error("Could not load native code: " + string(dlerror()));
+    }
+
+    auto version = static_cast<uint32_t const*>(dlsym(_handle, "luisavm_aot_version"));
+    auto code_end = static_cast<uint32_t const*>(dlsym(_handle, "luisavm_aot_code_end"));
+    void* run = dlsym(_handle, "luisavm_aot_run");
+    if(version == nullptr || code_end == nullptr || run == nullptr || *version != aot::ABI_VERSION) {
+        dlclose(_handle);
+        throw runtime_error("File " + filename + " was not generated by this version of lac.");
+    }
+    _run = reinterpret_cast<luisavm_aot_run_t>(run);
+    _code_end = *code_end;
+
+    _context.vm = this;
+    _context.load = Load;
+    _context.store = Store;
+}
+
+
+Native::~Native()
+{
+    dlclose(_handle);
+}
+
+
+// A memory fault in the native code is only noticed when it leaves the 
+// block, so PC points to the end of the block rather than to the faulting
+// instruction.
+StopReason Native::Run(uint64_t max_cycles)
+{
+    CPU& cpu = comp.cpu();
+
+    _context.reg = cpu.Register.data();
+    _context.ram = comp.PhysicalMemory().data();
+    _context.ram_size = comp.PhysicalMemory().size();
+
+    uint64_t cycles = 0;
+    uint64_t const base = cpu._elapsed_base;
+    cpu.Waiting = false;
+    while(cycles < max_cycles && !cpu.Waiting && !cpu._yield && !comp.Translating()) {   // `iret` might enable the MMU
+        cpu._elapsed = cpu._elapsed_base = base + cycles;
+        if(_context.code_written) {
+            StopReason stop = cpu.Run(max_cycles - cycles);
+            stop.cycles += cycles;
+            return stop;
+        }
+        cpu._trap = StopReason::NONE;
+        cycles += _run(&_context, max_cycles - cycles);
+        if(cpu._trap != StopReason::NONE && cpu._trap != CPU::YIELD) {
+            return StopReason { cpu._trap, cpu.PC, cpu._trap_address, cycles };
+        }
+        if(cycles < max_cycles && !cpu._yield) {
+            cpu._elapsed_base = base + cycles;
+            StopReason stop = cpu.Run(1);
+            cycles += stop.cycles;
+            if(stop.Trapped()) {
+                stop.cycles = cycles;
+                return stop;
+            }
+        }
+    }
+    return StopReason { StopReason::NONE, cpu.PC, 0, cycles };
+}
+
+void Native::InvalidateCode(uint32_t pos)
+{
+    if(pos < _code_end) {
+        _context.code_written = true;
+    }
+}
+
+// {{{ memory access from the native code
+
+uint32_t Native::Load(void* vm, uint32_t addr, uint32_t sz)
+{
+    LuisaVM& comp = static_cast<Native*>(vm)->comp;
+    switch(sz) {
+        case 1:  return comp.Get(addr);
+        case 2:  return comp.Get16(addr);
+        default: return comp.Get32(addr);
+    }
+}
+
+
+void Native::Store(void* vm, uint32_t addr, uint32_t value, uint32_t sz)
+{
+    Native& native = *static_cast<Native*>(vm);
+    switch(sz) {
+        case 1:  native.comp.Set(addr, static_cast<uint8_t>(value)); break;
+        case 2:  native.comp.Set16(addr, static_cast<uint16_t>(value)); break;
+        default: native.comp.Set32(addr, value); break;
+    }
+}
+
+// }}}
+
+}  // namespace luisavm
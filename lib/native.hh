@@ -0,0 +1,49 @@
+#ifndef NATIVE_HH_
+#define NATIVE_HH_
+
+#include <cstdint>
+#include <string>
+using namespace std;
+
+#include "aot.hh"
+#include "cpu.hh"
+
+namespace luisavm {
+
+// Runs the native code generated by `lac` for the ROM. Code outside of the
+// translated blocks (such as computed jumps into unknown addresses) is run
+// by the interpreter. If the guest writes over the translated code, the
+// native code is abandoned and the interpreter takes over.
+class Native {
+public:
+    Native(class LuisaVM& comp, string const& filename);
+    ~Native();
+
+    Native(Native const&) = delete;
+    Native& operator=(Native const&) = delete;
+
+    StopReason Run(uint64_t max_cycles);
+
+    // The guest wrote at `pos`: the native code is abandoned if it was
+    // translated from there.
+    void     InvalidateCode(uint32_t pos);
+
+    // The host loaded the memory again (the ROM, a save state, a snapshot or
+    // a checkpoint), so the native code can be used again.
+    void     MemoryReloaded() { _context.code_written = false; }
+    bool     Abandoned() const { return _context.code_written; }
+
+private:
+    static uint32_t Load(void* vm, uint32_t addr, uint32_t sz);
+    static void     Store(void* vm, uint32_t addr, uint32_t value, uint32_t sz);
+
+    class LuisaVM&    comp;
+    void*             _handle = nullptr;
+    luisavm_aot_run_t _run = nullptr;
+    uint32_t          _code_end = 0;
+    aot::Context      _context;
+};
+
+}  // namespace luisavm
+
+#endif
@@ -0,0 +1,21 @@
+#include "opcodes.hh"
+
+#include <type_traits>
+
+namespace luisavm {
+
+constexpr array<Opcode, 255> OpcodeTable::opcodes;
+
+static_assert(is_trivially_copyable<Opcode>::value, "Opcode must be trivially copyable");
+static_assert(sizeof(Opcode) <= 16, "Opcode must fit four to a cache line");
+
+// spot checks of the table, evaluated at compile time
+static_assert(opcodes[0x01].sz == 2 && opcodes[0x04].sz == 6 && opcodes[0x0E].sz == 9, "instruction sizes");
+static_assert(!opcodes[0x00].Valid() && opcodes[0x79].Valid() && !opcodes[0x7A].Valid(), "valid opcodes");
+
+constexpr ParameterType REG_V8[] = { REG, V8 };
+static_assert(FindOpcode("mov", REG_V8, 2) == 0x02, "opcode lookup");
+static_assert(FindOpcode("nop", nullptr, 0) == 0x77, "opcode lookup");
+static_assert(FindOpcode("movx", REG_V8, 2) == -1, "opcode lookup");
+
+}  // namespace luisavm
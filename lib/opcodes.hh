@@ -2,171 +2,336 @@
 #define OPCODES_HH_
 
 #include <array>
-#include <string>
-#include <vector>
+#include <cstdint>
+#include <initializer_list>
 using namespace std;
 
 namespace luisavm {
 
-enum ParameterType { REG, V8, V16, V32, INDREG, INDV32 };
+enum ParameterType : uint8_t { REG, V8, V16, V32, INDREG, INDV32 };
 
-enum Instruction {
+enum Instruction : uint8_t {
     MOV, MOVB, MOVW, MOVD, SWAP,
     OR, XOR, AND, SHL, SHR, NOT,
     ADD, SUB, CMP, MUL, IDIV, MOD, INC, DEC,
     BZ, BNZ, BNEG, BPOS, BGT, BGTE, BLT, BLTE, BV, BNV,
-    JMP, JSR, RET,
+    JMP, JSR, IRET, RET,
     PUSHB, PUSHW, PUSHD, PUSH_A, POPB, POPW, POPD, POP_A, POPX,
-    NOP,
+    NOP, WAIT,
     INVALID 
 };
 
+// size of a parameter in the encoded instruction
+constexpr uint8_t ParameterSize(ParameterType pt)
+{
+    return (pt == V16) ? 2 : (pt == V32 || pt == INDV32) ? 4 : 1;
+}
+
+// Rough cost of an instruction, in cycles: one to execute, plus one for each 
+// memory access and more for the slow operations.
+constexpr uint8_t InstructionCycles(Instruction instruction)
+{
+    switch(instruction) {
+        case MUL:                       return 4;
+        case IDIV: case MOD:            return 8;
+        case JSR: case RET:             return 2;
+        case IRET:                      return 3;
+        case PUSHB: case PUSHW: case PUSHD: 
+        case POPB: case POPW: case POPD: return 2;
+        case PUSH_A: case POP_A:        return 13;
+        case MOV: case MOVB: case MOVW: case MOVD: case SWAP:
+        case OR: case XOR: case AND: case SHL: case SHR: case NOT:
+        case ADD: case SUB: case CMP: case INC: case DEC:
+        case BZ: case BNZ: case BNEG: case BPOS: case BGT: case BGTE: 
+        case BLT: case BLTE: case BV: case BNV: case JMP:
+        case POPX: case NOP: case WAIT: case INVALID: default:
+            return 1;
+    }
+}
+
+// Compact, trivially copyable opcode descriptor: 16 bytes, so four of them 
+// fit in a cache line.
 struct Opcode {
-    string                description;
-    Instruction           instruction;
-    vector<ParameterType> parameter;
+    constexpr Opcode() : Opcode("", INVALID, {}) {}
+    constexpr Opcode(char const* mnemonic, Instruction instruction, initializer_list<ParameterType> parameter)
+        : mnemonic(mnemonic), instruction(instruction), 
+          n_pars(static_cast<uint8_t>(parameter.size())), parameter{REG, REG}, sz(1), 
+          cycles(InstructionCycles(instruction))
+    {
+        for(uint8_t i=0; i<n_pars; ++i) {
+            this->parameter[i] = parameter.begin()[i];
+            sz = static_cast<uint8_t>(sz + ParameterSize(this->parameter[i]));
+            if(this->parameter[i] == INDREG || this->parameter[i] == INDV32) {
+                ++cycles;
+            }
+        }
+        if(Packed()) {
+            --sz;
+        }
+    }
+
+    constexpr bool Valid() const { return mnemonic[0] != '\0'; }
+
+    // two register parameters are encoded in a single byte
+    constexpr bool Packed() const {
+        return n_pars == 2 && (parameter[0] == REG || parameter[0] == INDREG)
+                           && (parameter[1] == REG || parameter[1] == INDREG);
+    }
+
+    char const*   mnemonic;
+    Instruction   instruction;
+    uint8_t       n_pars;
+    ParameterType parameter[2];
+    uint8_t       sz;          // encoded size, in bytes
+    uint8_t       cycles;
+};
+
+// The table is a static member so that there is a single definition (in 
+// opcodes.cc) that is still usable in constant expressions.
+struct OpcodeTable {
+    static constexpr array<Opcode, 255> opcodes = {{
+        // invalid
+        { "", INVALID, {} },                      // 0x00
+
+        // movement
+        { "mov", MOV, { REG, REG } },             // 0x01
+        { "mov", MOV, { REG, V8 } },              // 0x02
+        { "mov", MOV, { REG, V16 } },             // 0x03
+        { "mov", MOV, { REG, V32 } },             // 0x04
+
+        { "movb", MOVB, { REG, INDREG } },        // 0x05
+        { "movb", MOVB, { REG, INDV32 } },        // 0x06
+        { "movb", MOVB, { INDREG, REG } },        // 0x07
+        { "movb", MOVB, { INDREG, V8 } },         // 0x08
+        { "movb", MOVB, { INDREG, INDREG } },     // 0x09
+        { "movb", MOVB, { INDREG, INDV32 } },     // 0x0A
+        { "movb", MOVB, { INDV32, REG } },        // 0x0B
+        { "movb", MOVB, { INDV32, V8 } },         // 0x0C
+        { "movb", MOVB, { INDV32, INDREG } },     // 0x0D
+        { "movb", MOVB, { INDV32, INDV32 } },     // 0x0E
+
+        { "movw", MOVW, { REG, INDREG } },        // 0x0F
+        { "movw", MOVW, { REG, INDV32 } },        // 0x10
+        { "movw", MOVW, { INDREG, REG } },        // 0x11
+        { "movw", MOVW, { INDREG, V16 } },        // 0x12
+        { "movw", MOVW, { INDREG, INDREG } },     // 0x13
+        { "movw", MOVW, { INDREG, INDV32 } },     // 0x14
+        { "movw", MOVW, { INDV32, REG } },        // 0x15
+        { "movw", MOVW, { INDV32, V16 } },        // 0x16
+        { "movw", MOVW, { INDV32, INDREG } },     // 0x17
+        { "movw", MOVW, { INDV32, INDV32 } },     // 0x18
+
+        { "movd", MOVD, { REG, INDREG } },        // 0x19
+        { "movd", MOVD, { REG, INDV32 } },        // 0x1A
+        { "movd", MOVD, { INDREG, REG } },        // 0x1B
+        { "movd", MOVD, { INDREG, V32 } },        // 0x1C
+        { "movd", MOVD, { INDREG, INDREG } },     // 0x1D
+        { "movd", MOVD, { INDREG, INDV32 } },     // 0x1E
+        { "movd", MOVD, { INDV32, REG } },        // 0x1F
+        { "movd", MOVD, { INDV32, V32 } },        // 0x20
+        { "movd", MOVD, { INDV32, INDREG } },     // 0x21
+        { "movd", MOVD, { INDV32, INDV32 } },     // 0x22
+
+        { "swap", SWAP, { REG, REG } },           // 0x23
+
+        // logic
+        { "or",  OR,  { REG, REG } },             // 0x24
+        { "or",  OR,  { REG, V8 } },              // 0x25
+        { "or",  OR,  { REG, V16 } },             // 0x26
+        { "or",  OR,  { REG, V32 } },             // 0x27
+        { "xor", XOR, { REG, REG } },             // 0x28
+        { "xor", XOR, { REG, V8 } },              // 0x29
+        { "xor", XOR, { REG, V16 } },             // 0x2A
+        { "xor", XOR, { REG, V32 } },             // 0x2B
+        { "and", AND, { REG, REG } },             // 0x2C
+        { "and", AND, { REG, V8 } },              // 0x2D
+        { "and", AND, { REG, V16 } },             // 0x2E
+        { "and", AND, { REG, V32 } },             // 0x2F
+        { "shl", SHL, { REG, REG } },             // 0x30
+        { "shl", SHL, { REG, V8 } },              // 0x31
+        { "shr", SHR, { REG, REG } },             // 0x32
+        { "shr", SHR, { REG, V8 } },              // 0x33
+        { "not", NOT, { REG, } },                 // 0x34
+
+        // arithmetic
+        { "add",  ADD,  { REG, REG } },           // 0x35
+        { "add",  ADD,  { REG, V8 } },            // 0x36
+        { "add",  ADD,  { REG, V16 } },           // 0x37
+        { "add",  ADD,  { REG, V32 } },           // 0x38
+        { "sub",  SUB,  { REG, REG } },           // 0x39
+        { "sub",  SUB,  { REG, V8 } },            // 0x3A
+        { "sub",  SUB,  { REG, V16 } },           // 0x3B
+        { "sub",  SUB,  { REG, V32 } },           // 0x3C
+        { "cmp",  CMP,  { REG, REG } },           // 0x3D
+        { "cmp",  CMP,  { REG, V8 } },            // 0x3E
+        { "cmp",  CMP,  { REG, V16 } },           // 0x3F
+        { "cmp",  CMP,  { REG, V32 } },           // 0x40
+        { "cmp",  CMP,  { REG, } },               // 0x41
+        { "mul",  MUL,  { REG, REG } },           // 0x42
+        { "mul",  MUL,  { REG, V8 } },            // 0x43
+        { "mul",  MUL,  { REG, V16 } },           // 0x44
+        { "mul",  MUL,  { REG, V32 } },           // 0x45
+        { "idiv", IDIV, { REG, REG } },           // 0x46
+        { "idiv", IDIV, { REG, V8 } },            // 0x47
+        { "idiv", IDIV, { REG, V16 } },           // 0x48
+        { "idiv", IDIV, { REG, V32 } },           // 0x49
+        { "mod",  MOD,  { REG, REG } },           // 0x4A
+        { "mod",  MOD,  { REG, V8 } },            // 0x4B
+        { "mod",  MOD,  { REG, V16 } },           // 0x4C
+        { "mod",  MOD,  { REG, V32 } },           // 0x4D
+        { "inc",  INC,  { REG, } },               // 0x4E
+        { "dec",  DEC,  { REG, } },               // 0x4F
+
+        // jumps
+        { "bz",   BZ,   { REG, } },               // 0x50
+        { "bz",   BZ,   { V32, } },               // 0x51
+        { "bnz",  BNZ,  { REG, } },               // 0x52
+        { "bnz",  BNZ,  { V32, } },               // 0x53
+        { "bneg", BNEG, { REG, } },               // 0x54
+        { "bneg", BNEG, { V32, } },               // 0x55
+        { "bpos", BPOS, { REG, } },               // 0x56
+        { "bpos", BPOS, { V32, } },               // 0x57
+        { "bgt",  BGT,  { REG, } },               // 0x58
+        { "bgt",  BGT,  { V32, } },               // 0x59
+        { "bgte", BGTE, { REG, } },               // 0x5A
+        { "bgte", BGTE, { V32, } },               // 0x5B
+        { "blt",  BLT,  { REG, } },               // 0x5C
+        { "blt",  BLT,  { V32, } },               // 0x5D
+        { "blte", BLTE, { REG, } },               // 0x5E
+        { "blte", BLTE, { V32, } },               // 0x5F
+        { "bv",   BV,   { REG, } },               // 0x60
+        { "bv",   BV,   { V32, } },               // 0x61
+        { "bnv",  BNV,  { REG, } },               // 0x62
+        { "bnv",  BNV,  { V32, } },               // 0x63
+
+        { "jmp",  JMP,  { REG, } },               // 0x64
+        { "jmp",  JMP,  { V32, } },               // 0x65
+        { "jsr",  JSR,  { REG, } },               // 0x66
+        { "jsr",  JSR,  { V32, } },               // 0x67
+        { "ret",  RET,  {} },                     // 0x68
+
+        // stack
+        { "pushb",  PUSHB,  { REG, } },             // 0x69
+        { "pushb",  PUSHB,  { V8, } },              // 0x6A
+        { "pushw",  PUSHW,  { REG, } },             // 0x6B
+        { "pushw",  PUSHW,  { V16, } },             // 0x6C
+        { "pushd",  PUSHD,  { REG, } },             // 0x6D
+        { "pushd",  PUSHD,  { V32, } },             // 0x6E
+        { "push.a", PUSH_A, {} },                   // 0x6F
+        { "popb",   POPB,   { REG, } },             // 0x70
+        { "popw",   POPW,   { REG, } },             // 0x71
+        { "popd",   POPD,   { REG, } },             // 0x72
+        { "pop.a",  POP_A,  {} },                   // 0x73
+        { "popx",   POPX,   { REG, } },             // 0x74
+        { "popx",   POPX,   { V8, } },              // 0x75
+        { "popx",   POPX,   { V16, } },             // 0x76
+
+        // other
+        { "nop", NOP,  {} },                        // 0x77
+        { "wait", WAIT, {} },                       // 0x78
+        { "iret", IRET, {} },                       // 0x79
+    }};
 };
 
-static array<Opcode, 255> opcodes = {{
-    // invalid
-    { "", INVALID, {} },                      // 0x00
-
-    // movement
-    { "mov", MOV, { REG, REG } },             // 0x01
-    { "mov", MOV, { REG, V8 } },              // 0x02
-    { "mov", MOV, { REG, V16 } },             // 0x03
-    { "mov", MOV, { REG, V32 } },             // 0x04
-
-    { "movb", MOVB, { REG, INDREG } },        // 0x05
-    { "movb", MOVB, { REG, INDV32 } },        // 0x06
-    { "movb", MOVB, { INDREG, REG } },        // 0x07
-    { "movb", MOVB, { INDREG, V8 } },         // 0x08
-    { "movb", MOVB, { INDREG, INDREG } },     // 0x09
-    { "movb", MOVB, { INDREG, INDV32 } },     // 0x0A
-    { "movb", MOVB, { INDV32, REG } },        // 0x0B
-    { "movb", MOVB, { INDV32, V8 } },         // 0x0C
-    { "movb", MOVB, { INDV32, INDREG } },     // 0x0D
-    { "movb", MOVB, { INDV32, INDV32 } },     // 0x0E
-
-    { "movw", MOVW, { REG, INDREG } },        // 0x0F
-    { "movw", MOVW, { REG, INDV32 } },        // 0x10
-    { "movw", MOVW, { INDREG, REG } },        // 0x11
-    { "movw", MOVW, { INDREG, V16 } },        // 0x12
-    { "movw", MOVW, { INDREG, INDREG } },     // 0x13
-    { "movw", MOVW, { INDREG, INDV32 } },     // 0x14
-    { "movw", MOVW, { INDV32, REG } },        // 0x15
-    { "movw", MOVW, { INDV32, V16 } },        // 0x16
-    { "movw", MOVW, { INDV32, INDREG } },     // 0x17
-    { "movw", MOVW, { INDV32, INDV32 } },     // 0x18
-
-    { "movd", MOVD, { REG, INDREG } },        // 0x19
-    { "movd", MOVD, { REG, INDV32 } },        // 0x1A
-    { "movd", MOVD, { INDREG, REG } },        // 0x1B
-    { "movd", MOVD, { INDREG, V32 } },        // 0x1C
-    { "movd", MOVD, { INDREG, INDREG } },     // 0x1D
-    { "movd", MOVD, { INDREG, INDV32 } },     // 0x1E
-    { "movd", MOVD, { INDV32, REG } },        // 0x1F
-    { "movd", MOVD, { INDV32, V32 } },        // 0x20
-    { "movd", MOVD, { INDV32, INDREG } },     // 0x21
-    { "movd", MOVD, { INDV32, INDV32 } },     // 0x22
-
-    { "swap", SWAP, { REG, REG } },           // 0x23
-
-    // logic
-    { "or",  OR,  { REG, REG } },             // 0x24
-    { "or",  OR,  { REG, V8 } },              // 0x25
-    { "or",  OR,  { REG, V16 } },             // 0x26
-    { "or",  OR,  { REG, V32 } },             // 0x27
-    { "xor", XOR, { REG, REG } },             // 0x28
-    { "xor", XOR, { REG, V8 } },              // 0x29
-    { "xor", XOR, { REG, V16 } },             // 0x2A
-    { "xor", XOR, { REG, V32 } },             // 0x2B
-    { "and", AND, { REG, REG } },             // 0x2C
-    { "and", AND, { REG, V8 } },              // 0x2D
-    { "and", AND, { REG, V16 } },             // 0x2E
-    { "and", AND, { REG, V32 } },             // 0x2F
-    { "shl", SHL, { REG, REG } },             // 0x30
-    { "shl", SHL, { REG, V8 } },              // 0x31
-    { "shr", SHR, { REG, REG } },             // 0x32
-    { "shr", SHR, { REG, V8 } },              // 0x33
-    { "not", NOT, { REG, } },                 // 0x34
-
-    // arithmetic
-    { "add",  ADD,  { REG, REG } },           // 0x35
-    { "add",  ADD,  { REG, V8 } },            // 0x36
-    { "add",  ADD,  { REG, V16 } },           // 0x37
-    { "add",  ADD,  { REG, V32 } },           // 0x38
-    { "sub",  SUB,  { REG, REG } },           // 0x39
-    { "sub",  SUB,  { REG, V8 } },            // 0x3A
-    { "sub",  SUB,  { REG, V16 } },           // 0x3B
-    { "sub",  SUB,  { REG, V32 } },           // 0x3C
-    { "cmp",  CMP,  { REG, REG } },           // 0x3D
-    { "cmp",  CMP,  { REG, V8 } },            // 0x3E
-    { "cmp",  CMP,  { REG, V16 } },           // 0x3F
-    { "cmp",  CMP,  { REG, V32 } },           // 0x40
-    { "cmp",  CMP,  { REG, } },               // 0x41
-    { "mul",  MUL,  { REG, REG } },           // 0x42
-    { "mul",  MUL,  { REG, V8 } },            // 0x43
-    { "mul",  MUL,  { REG, V16 } },           // 0x44
-    { "mul",  MUL,  { REG, V32 } },           // 0x45
-    { "idiv", IDIV, { REG, REG } },           // 0x46
-    { "idiv", IDIV, { REG, V8 } },            // 0x47
-    { "idiv", IDIV, { REG, V16 } },           // 0x48
-    { "idiv", IDIV, { REG, V32 } },           // 0x49
-    { "mod",  MOD,  { REG, REG } },           // 0x4A
-    { "mod",  MOD,  { REG, V8 } },            // 0x4B
-    { "mod",  MOD,  { REG, V16 } },           // 0x4C
-    { "mod",  MOD,  { REG, V32 } },           // 0x4D
-    { "inc",  INC,  { REG, } },               // 0x4E
-    { "dec",  DEC,  { REG, } },               // 0x4F
-
-    // jumps
-    { "bz",   BZ,   { REG, } },               // 0x50
-    { "bz",   BZ,   { V32, } },               // 0x51
-    { "bnz",  BNZ,  { REG, } },               // 0x52
-    { "bnz",  BNZ,  { V32, } },               // 0x53
-    { "bneg", BNEG, { REG, } },               // 0x54
-    { "bneg", BNEG, { V32, } },               // 0x55
-    { "bpos", BPOS, { REG, } },               // 0x56
-    { "bpos", BPOS, { V32, } },               // 0x57
-    { "bgt",  BGT,  { REG, } },               // 0x58
-    { "bgt",  BGT,  { V32, } },               // 0x59
-    { "bgte", BGTE, { REG, } },               // 0x5A
-    { "bgte", BGTE, { V32, } },               // 0x5B
-    { "blt",  BLT,  { REG, } },               // 0x5C
-    { "blt",  BLT,  { V32, } },               // 0x5D
-    { "blte", BLTE, { REG, } },               // 0x5E
-    { "blte", BLTE, { V32, } },               // 0x5F
-    { "bv",   BV,   { REG, } },               // 0x60
-    { "bv",   BV,   { V32, } },               // 0x61
-    { "bnv",  BNV,  { REG, } },               // 0x62
-    { "bnv",  BNV,  { V32, } },               // 0x63
-
-    { "jmp",  JMP,  { REG, } },               // 0x64
-    { "jmp",  JMP,  { V32, } },               // 0x65
-    { "jsr",  JSR,  { REG, } },               // 0x66
-    { "jsr",  JSR,  { V32, } },               // 0x67
-    { "ret",  RET,  {} },                     // 0x68
-
-    // stack
-    { "pushb",  PUSHB,  { REG, } },             // 0x69
-    { "pushb",  PUSHB,  { V8, } },              // 0x6A
-    { "pushw",  PUSHW,  { REG, } },             // 0x6B
-    { "pushw",  PUSHW,  { V16, } },             // 0x6C
-    { "pushd",  PUSHD,  { REG, } },             // 0x6D
-    { "pushd",  PUSHD,  { V32, } },             // 0x6E
-    { "push.a", PUSH_A, {} },                   // 0x6F
-    { "popb",   POPB,   { REG, } },             // 0x60
-    { "popw",   POPW,   { REG, } },             // 0x61
-    { "popd",   POPD,   { REG, } },             // 0x62
-    { "pop.a",  POP_A,  {} },                   // 0x63
-    { "popx",   POPX,   { REG, } },             // 0x64
-    { "popx",   POPX,   { V8, } },              // 0x65
-    { "popx",   POPX,   { V16, } },             // 0x66
-
-    // other
-    { "nop", NOP,  {} },                        // 0x67
-}};
+static constexpr array<Opcode, 255> const& opcodes = OpcodeTable::opcodes;
+
+constexpr uint8_t MaxInstructionSize()
+{
+    uint8_t sz = 0;
+    for(size_t i=0; i<opcodes.size(); ++i) {
+        sz = (opcodes[i].sz > sz) ? opcodes[i].sz : sz;
+    }
+    return sz;
+}
+
+// Finds the opcode for a mnemonic and its parameter types. Returns -1 if 
+// there is none.
+constexpr int FindOpcode(char const* mnemonic, ParameterType const* par, size_t n_pars)
+{
+    for(size_t i=1; i<opcodes.size(); ++i) {
+        Opcode const& op = opcodes[i];
+        if(op.n_pars != n_pars) {
+            continue;
+        }
+        size_t j = 0;
+        while(op.mnemonic[j] != '\0' && op.mnemonic[j] == mnemonic[j]) {
+            ++j;
+        }
+        if(op.mnemonic[j] != mnemonic[j]) {
+            continue;
+        }
+        bool match = true;
+        for(size_t k=0; k<n_pars; ++k) {
+            match = match && op.parameter[k] == par[k];
+        }
+        if(match) {
+            return static_cast<int>(i);
+        }
+    }
+    return -1;
+}
+
+// A short loop that only loads registers from the memory, tests and compares
+// them, and carries nothing from one turn to the next (whatever register or
+// flag it reads was written earlier in the same turn, or not at all) does
+// the same on every turn until the memory it reads changes, so the CPU can
+// wait instead of running it. `body` are the instructions before the branch
+// back; an empty one is a branch to itself. `D` is any decoded instruction
+// with `opcode` and `par`.
+constexpr size_t MAX_POLLING_LOOP = 4;   // instructions in the body
+
+template<typename D> bool PollingLoop(D const* const* body, size_t n)
+{
+    constexpr uint32_t FLAGS = 1u << 15;
+    if(n > MAX_POLLING_LOOP) {
+        return false;
+    }
+    uint32_t written = 0, carried = 0;
+    for(size_t i=0; i<n; ++i) {
+        D const& d = *body[i];
+        uint8_t n_pars = d.opcode->n_pars;
+        uint32_t regs[2] = { 0, 0 };
+        for(uint8_t j=0; j<n_pars; ++j) {
+            if(d.par[j].type == REG || d.par[j].type == INDREG) {
+                if(d.par[j].value >= 13) {   // SP, PC and FL
+                    return false;
+                }
+                regs[j] = 1u << d.par[j].value;
+            }
+        }
+        uint32_t reads, writes;
+        switch(d.opcode->instruction) {
+            case MOV: case MOVB: case MOVW: case MOVD:
+                if(d.par[0].type != REG) {   // a store
+                    return false;
+                }
+                reads = regs[1];
+                writes = regs[0] | FLAGS;
+                break;
+            case OR: case XOR: case AND: case SHL: case SHR: case NOT:
+                reads = regs[0] | regs[1];
+                writes = regs[0] | FLAGS;
+                break;
+            case CMP:   // with the carry
+                reads = regs[0] | regs[1] | FLAGS;
+                writes = FLAGS;
+                break;
+            case NOP:
+                reads = writes = 0;
+                break;
+            case SWAP: case ADD: case SUB: case MUL: case IDIV: case MOD: case INC: case DEC:
+            case BZ: case BNZ: case BNEG: case BPOS: case BGT: case BGTE:
+            case BLT: case BLTE: case BV: case BNV: case JMP: case JSR: case IRET: case RET:
+            case PUSHB: case PUSHW: case PUSHD: case PUSH_A:
+            case POPB: case POPW: case POPD: case POP_A: case POPX:
+            case WAIT: case INVALID: default:
+                return false;
+        }
+        carried |= reads & ~written;
+        written |= writes;
+    }
+    return (carried & written) == 0;
+}
 
 }  // namespace luisavm
 
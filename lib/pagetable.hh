@@ -0,0 +1,80 @@
+#ifndef PAGETABLE_HH_
+#define PAGETABLE_HH_
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+using namespace std;
+
+#include "device.hh"
+
+namespace luisavm {
+
+// Maps the 32-bit logical memory in 4 kB pages. Each page is backed either 
+// by host memory or by a device; pages with neither are unmapped. The table
+// has two levels, so only the areas in use take memory, and a lookup costs
+// the same no matter how many devices are attached.
+class PageTable {
+public:
+    static constexpr uint32_t PAGE_BITS = 12,
+                              PAGE_SIZE = 1u << PAGE_BITS,
+                              PAGE_MASK = PAGE_SIZE - 1;
+
+    struct Page {
+        uint8_t* ram = nullptr;     // host memory of the page
+        Device*  device = nullptr;
+        uint32_t base = 0;          // logical position where the device area starts
+    };
+
+    Page const& Find(uint32_t pos) const {
+        Directory const* dir = _directory[pos >> (PAGE_BITS + DIR_BITS)].get();
+        return dir ? (*dir)[(pos >> PAGE_BITS) & (DIR_SIZE - 1)] : _unmapped;
+    }
+
+    // `ram` must hold `sz` bytes, rounded up to a whole page
+    void MapRAM(uint32_t pos, uint32_t sz, uint8_t* ram) {
+        for(uint32_t i=0; i<Pages(sz); ++i) {
+            At(pos + i * PAGE_SIZE).ram = ram + i * PAGE_SIZE;
+        }
+    }
+
+    void MapDevice(Device& device) {
+        uint32_t pos = device.MemoryPos();
+        if((pos & PAGE_MASK) != 0) {
+            throw logic_error("Device memory must start on a page boundary.");
+        }
+        for(uint32_t i=0; i<Pages(device.MemorySize()); ++i) {
+            Page& page = At(pos + i * PAGE_SIZE);
+            if(page.ram || page.device) {
+                throw logic_error("Device memory overlaps an area already mapped.");
+            }
+            page.device = &device;
+            page.base = pos;
+        }
+    }
+
+private:
+    static constexpr uint32_t DIR_BITS = 10,
+                              DIR_SIZE = 1u << DIR_BITS;
+    using Directory = array<Page, DIR_SIZE>;
+
+    static uint32_t Pages(uint32_t sz) { 
+        return static_cast<uint32_t>((static_cast<uint64_t>(sz) + PAGE_MASK) >> PAGE_BITS); 
+    }
+
+    Page& At(uint32_t pos) {
+        unique_ptr<Directory>& dir = _directory[pos >> (PAGE_BITS + DIR_BITS)];
+        if(!dir) {
+            dir = make_unique<Directory>();
+        }
+        return (*dir)[(pos >> PAGE_BITS) & (DIR_SIZE - 1)];
+    }
+
+    array<unique_ptr<Directory>, (1u << (32 - PAGE_BITS - DIR_BITS))> _directory;
+    Page _unmapped;
+};
+
+}  // namespace luisavm
+
+#endif
@@ -1,8 +1,13 @@
 #include "luisavm.hh"
 #include "assembler.hh"
+#include "translator.hh"
 
 #include <exception>
+#include <fstream>
 #include <iostream>
+#include <type_traits>
+
+#include <unistd.h>
 using namespace std;
 
 namespace luisavm {
@@ -67,9 +72,10 @@ void test_assembler_map(string const& name, string const& code, string const& ex
 }
 
 template<typename F, typename U>
-LuisaVM _code(function<void(LuisaVM& c, CPU&)> pre, string const& code, F&& test, U&& expected)
+unique_ptr<LuisaVM> _code(function<void(LuisaVM& c, CPU&)> pre, string const& code, F&& test, U&& expected)
 {
-    LuisaVM comp(1024*1024);
+    auto vm = make_unique<LuisaVM>(1024*1024);
+    LuisaVM& comp = *vm;
     pre(comp, comp.cpu());
 
     vector<uint8_t> data = Assembler().AssembleString("test", "section .text\n" + code);
@@ -81,7 +87,7 @@ LuisaVM _code(function<void(LuisaVM& c, CPU&)> pre, string const& code, F&& test
     auto tested = test(comp, cpu);
     equals(tested, expected, code);
 
-    return comp;
+    return vm;
 }
 
 #define code(pre, code, tested, expected) \
@@ -90,12 +96,40 @@ LuisaVM _code(function<void(LuisaVM& c, CPU&)> pre, string const& code, F&& test
 // }}}
 
 static void luisavm_tests();
+static void rom();
+static void dirty_pages();
+static void snapshots();
+static void save_state();
+static void checkpoints();
+static void dedup();
+static void devices();
+static void scheduler();
+static void idle();
+static void interrupts();
+static void timer();
+static void mmu();
 static void assembler_tests();
 static void cpu_tests();
 
-void run_tests()
+static size_t (*allocations)() = nullptr;
+
+void run_tests(size_t (*allocations_)())
 {
+    allocations = allocations_;
+
     luisavm_tests();
+    rom();
+    dirty_pages();
+    snapshots();
+    save_state();
+    checkpoints();
+    dedup();
+    devices();
+    scheduler();
+    idle();
+    interrupts();
+    timer();
+    mmu();
     assembler_tests();
     cpu_tests();
 }
@@ -120,9 +154,713 @@ static void luisavm_tests()
 
     equals(c.PhysicalMemory()[0x3], 0x12);
 
+    uint32_t end = static_cast<uint32_t>(c.PhysicalMemory().size());
+    c.Set32(end - 2, 0xAABBCCDD);
+    equals(c.Get16(end - 2), 0xCCDD, "set32 across the end of memory");
+    equals(c.Get32(end - 2), 0xCCDD, "get32 across the end of memory");
+    equals(c.Get32(0x0), 0x12345678, "get32");
+
+    LuisaVM big(512 * 1024 * 1024);   // only the pages touched are committed
+    big.Set32(0x1FFFFFFC, 0xCAFEBABE);
+    equals(big.Get32(0x1FFFFFFC), 0xCAFEBABE, "large memory");
+    equals(big.Get32(0x10000000), 0, "large memory is zero-filled");
+
     // TODO - offset tests
 }
 
+
+static void dirty_pages()
+{
+    cout << "# dirty pages\n";
+
+    LuisaVM c;
+    equals(c.CollectDirtyPages().size(), 0, "no pages dirty");
+
+    c.Set(0x10, 0x1);
+    c.Set32(0x2FFE, 0x12345678);   // pages 2 and 3
+    equals(c.CollectDirtyPages() == vector<uint32_t>({ 0, 2, 3 }), true, "dirty pages");
+    equals(c.CollectDirtyPages().size(), 0, "collecting clears the pages");
+
+    vector<uint8_t> data = Assembler().AssembleString("test", "section .text\nmov A, 0x1000\nmovd [A], 0x42");
+    for(uint32_t i=0; i<data.size(); ++i) {
+        c.PhysicalMemory()[i] = data[i];
+    }
+    c.Run(2);
+    equals(c.CollectDirtyPages() == vector<uint32_t>({ 1 }), true, "page written by the CPU");
+
+    LuisaVM::DirtyList list = c.TrackDirtyPages();
+    c.Set(0x1000, 0x1);
+    equals(c.CollectDirtyPages(list) == vector<uint32_t>({ 1 }), true, "own list of dirty pages");
+    c.Set(0x2000, 0x1);
+    equals(c.CollectDirtyPages() == vector<uint32_t>({ 1, 2 }), true, "lists don't take the pages from each other");
+    equals(c.CollectDirtyPages(list) == vector<uint32_t>({ 2 }), true, "lists don't take the pages from each other (2)");
+    c.UntrackDirtyPages(list);
+
+    string filename = "/tmp/luisavm-dirty-" + to_string(getpid());
+    {
+        Checkpointer ck(c, filename);
+        c.Set(0x3000, 0x1);
+        ck.Checkpoint();
+        ck.Wait();
+    }
+    unlink(filename.c_str());
+    equals(c.CollectDirtyPages() == vector<uint32_t>({ 3 }), true, "pages not taken by the checkpointer");
+}
+
+
+static void snapshots()
+{
+    cout << "# snapshots\n";
+
+    LuisaVM c(64 * 1024 * 1024);
+    vector<uint8_t> data = Assembler().AssembleString("test", R"(section .text
+            mov     B, 0x10000
+    next:   inc     A
+            movd    [B], A
+            jmp     next)");
+    for(uint32_t i=0; i<data.size(); ++i) {
+        c.Set(i, data[i]);
+    }
+    c.Run(41);   // A = 10 (four cycles per loop)
+    c.keyboard().Queue.push_back({ 'a', NONE, PRESSED });
+
+    auto s1 = c.Snapshot();
+    c.Run(40);   // A = 20
+    c.keyboard().Queue.clear();
+    auto s2 = c.Snapshot();
+    c.Run(40);   // A = 30
+    equals(s1->PagesCopied(), 1, "only the page written is copied");
+
+    c.Restore(*s1);
+    equals(c.cpu().A, 10, "registers restored");
+    equals(c.Get32(0x10000), 10, "memory restored");
+    equals(c.keyboard().Queue.size(), 1, "keyboard restored");
+
+    c.Run(40);
+    equals(c.Get32(0x10000), 20, "running after restoring");
+
+    c.Restore(*s2);
+    equals(c.Get32(0x10000), 20, "newer snapshot restored");
+    equals(c.keyboard().Queue.size(), 0, "newer snapshot: keyboard");
+
+    c.Set32(0x10000, 0);
+    c.Restore(*s1);
+    equals(c.Get32(0x10000), 10, "snapshot restored twice");
+}
+
+
+static void save_state()
+{
+    cout << "# save state\n";
+
+    LuisaVM c(1024 * 1024);
+    vector<uint8_t> data = Assembler().AssembleString("test", R"(section .text
+            mov     B, 0x80000
+    next:   inc     A
+            movd    [B], A
+            jmp     next)");
+    for(uint32_t i=0; i<data.size(); ++i) {
+        c.Set(i, data[i]);
+    }
+    c.Run(41);   // A = 10
+    c.keyboard().Queue.push_back({ F1, SHIFT, RELEASED });
+
+    string filename = "/tmp/luisavm-state-" + to_string(getpid());
+    c.SaveState(filename);
+    equals(ifstream(filename, ios::binary|ios::ate).tellg(), 3 * 4096, "only non-zero pages saved");
+
+    LuisaVM d(1024 * 1024);
+    d.Set(0x40000, 0xFF);
+    d.LoadState(filename);
+    equals(d.cpu().A, 10, "registers loaded");
+    equals(d.cpu().PC, c.cpu().PC, "PC loaded");
+    equals(d.Get32(0x80000), 10, "memory loaded");
+    equals(d.Get(0x40000), 0, "pages not in the file are zeroed");
+    equals(d.keyboard().Queue.size() == 1 && d.keyboard().Queue[0].key == F1 && d.keyboard().Queue[0].mod == SHIFT, true, "keyboard loaded");
+
+    c.Run(30);
+    d.Run(30);
+    equals(d.Get32(0x80000), c.Get32(0x80000), "runs the same after loading");
+
+    d.SaveState(filename);   // over the file its memory is mapped from
+    equals(d.Get32(0x80000), c.Get32(0x80000), "memory intact after saving over the loaded file");
+    LuisaVM f(1024 * 1024);
+    f.LoadState(filename);
+    equals(f.Get32(0x80000), d.Get32(0x80000), "saved over the loaded file");
+
+    LuisaVM e(2 * 1024 * 1024);
+    bool thrown = false;
+    try { e.LoadState(filename); } catch(runtime_error&) { thrown = true; }
+    equals(thrown, true, "different memory size");
+    unlink(filename.c_str());
+}
+
+
+static void checkpoints()
+{
+    cout << "# checkpoints\n";
+
+    string filename = "/tmp/luisavm-checkpoint-" + to_string(getpid());
+    LuisaVM c(1024 * 1024);
+    c.Set32(0x10000, 0x12345678);
+    c.Set32(0x20000, 0xCAFEBABE);
+    c.cpu().A = 0x42;
+    {
+        Checkpointer ck(c, filename);
+        ck.Checkpoint();
+        c.Set32(0x10000, 0x12345679);   // only a byte of a page changes
+        c.Set32(0x20000, 0xCAFEBABE);   // same contents
+        c.cpu().A = 0x43;
+        ck.Checkpoint();
+        ck.Wait();
+        equals(ck.Pending(), 0, "checkpoints written");
+    }
+    equals(ifstream(filename, ios::binary|ios::ate).tellg() < 512, true, "deltas are compressed");
+
+    LuisaVM d(1024 * 1024);
+    d.Set(0x30000, 0xFF);
+    Checkpointer::Restore(d, filename);
+    equals(d.Get32(0x10000), 0x12345679, "memory restored");
+    equals(d.Get32(0x20000), 0xCAFEBABE, "unchanged page restored");
+    equals(d.Get(0x30000), 0, "pages not in the checkpoints are zeroed");
+    equals(d.cpu().A, 0x43, "registers restored");
+
+    string damaged = filename + "-damaged";
+    {
+        ifstream ifs(filename, ios::binary);
+        ofstream ofs(damaged, ios::binary);
+        ofs << ifs.rdbuf();
+        ofs.write("\x0C\x00\x00\x00" "\x00\x00\x00\x00" "\x01\x00\x00\x00" "\xFF\xFF\x00\x00", 16);  // a page out of memory
+    }
+    d.Set32(0x10000, 0x1);
+    bool thrown = false;
+    try { Checkpointer::Restore(d, damaged); } catch(runtime_error&) { thrown = true; }
+    equals(thrown, true, "damaged checkpoint rejected");
+    equals(d.Get32(0x10000), 0x1, "damaged checkpoint leaves the memory alone");
+    unlink(damaged.c_str());
+
+    {
+        ofstream ofs(filename, ios::binary|ios::app);
+        ofs.write("\xFF\x00\x00\x00\x01", 5);   // cut short
+    }
+    LuisaVM e(1024 * 1024);
+    Checkpointer::Restore(e, filename);
+    equals(e.Get32(0x10000), 0x12345679, "incomplete checkpoint ignored");
+    unlink(filename.c_str());
+}
+
+
+static void dedup()
+{
+    cout << "# page deduplication\n";
+    if(!PageDedup::Supported()) {
+        return;
+    }
+
+    PageDedup dd;
+    vector<unique_ptr<LuisaVM>> vms;
+    for(uint32_t i=0; i<3; ++i) {
+        vms.push_back(make_unique<LuisaVM>(64 * 1024));
+    }
+    for(uint32_t i=0; i<3; ++i) {
+        for(uint32_t pos=0x1000; pos<0x3000; pos+=4) {
+            vms[i]->Set32(pos, pos);      // the same in every VM
+        }
+        vms[i]->Set32(0x5000, i + 1);    // different in every VM
+        dd.Add(*vms[i]);
+    }
+
+    dd.Scan();
+    DedupStats st = dd.Stats();
+    equals(st.pages_shared, 6, "pages shared");
+    equals(st.frames, 2, "frames");
+    equals(st.zero_pages, 3 * 13, "zero pages");
+    equals(st.PagesSaved(), 4 + 3 * 13, "pages saved");
+    equals(dd.Scan(), 0, "nothing new to share");
+
+    vms[1]->Set32(0x1000, 0x42);
+    equals(vms[1]->Get32(0x1000), 0x42, "written to a shared page");
+    equals(vms[0]->Get32(0x1000), 0x1000, "other VMs not affected");
+    equals(vms[2]->Get32(0x1004), 0x1004, "other VMs not affected");
+    equals(dd.Stats().pages_shared, 5, "sharing broken on write");
+
+    vms[0]->Set(0x8000, 0x1);
+    equals(dd.Stats().zero_pages, 3 * 13 - 1, "zero page written");
+    equals(vms[0]->Get(0x8000), 1);
+
+    dd.Remove(*vms[0]);
+    equals(vms[0]->Get32(0x2000), 0x2000, "memory kept after leaving");
+    equals(dd.Stats().pages_shared, 3, "pages of the VM that left");
+
+    // the VMs can't be moved, only the pointers to them
+    static_assert(!is_move_constructible<LuisaVM>::value, "LuisaVM must stay in place");
+    unique_ptr<LuisaVM> moved = move(vms[2]);
+    vms.erase(vms.begin() + 2);
+    moved->Set(0x0, 0x02); moved->Set(0x1, 0x00); moved->Set(0x2, 0x42);   // mov A, 0x42
+    moved->Step();
+    equals(moved->cpu().A, 0x42, "VM held by another pointer still runs");
+    moved.reset();
+    vms.clear();
+    equals(dd.Stats().frames, 0, "frames released with the VMs");
+}
+
+
+// a device with a few registers in the device area
+class TestDevice : public Device {
+public:
+    uint32_t MemoryPos() const override  { return 0xF0001000; }
+    uint32_t MemorySize() const override { return 0x10; }
+    uint8_t  Get(uint32_t pos) override  { return reg[pos & 0xF]; }
+    void     Set(uint32_t pos, uint8_t data) override { reg[pos & 0xF] = data; }
+    uint32_t Get32(uint32_t pos) override { ++dword_accesses; return Device::Get32(pos); }
+
+    uint8_t reg[16] = {};
+    int     dword_accesses = 0;
+};
+
+static void rom()
+{
+    cout << "# rom\n";
+
+    string filename = "/tmp/luisavm-rom-" + to_string(getpid()) + ".bin";
+    vector<uint8_t> data = Assembler().AssembleString("test", "section .text\nmov A, 0x1234\njmp 0");
+    ofstream(filename, ios::binary).write(reinterpret_cast<char const*>(data.data()), static_cast<streamsize>(data.size()));
+
+    LuisaVM c1, c2;
+    c1.LoadROM(filename, "");
+    c2.LoadROM(filename, "");
+    unlink(filename.c_str());
+
+    c1.Run(2);
+    equals(c1.cpu().A, 0x1234, "ROM runs");
+    c1.Set(0x2, 0x78);
+    equals(c1.Get(0x2), 0x78, "ROM can be written");
+    equals(c2.Get(0x2), 0x34, "ROM written in another VM");
+}
+
+
+static void devices()
+{
+    cout << "# devices\n";
+
+    LuisaVM c;
+    TestDevice& dev = c.AddDevice<TestDevice>();
+    c.Set(0xF0001002, 0x42);
+    equals(dev.reg[2], 0x42, "device register set");
+    equals(c.Get(0xF0001002), 0x42, "device register get");
+
+    c.Set32(0xF0001004, 0x12345678);
+    equals(c.Get32(0xF0001004), 0x12345678, "device register get32");
+    equals(dev.dword_accesses, 1, "dword access done by the device");
+
+    vector<uint8_t> data = Assembler().AssembleString("test", "section .text\nmovb A, [0xF0001002]\nmovb B, [0xF0002000]");
+    for(uint32_t i=0; i<data.size(); ++i) {
+        c.Set(i, data[i]);
+    }
+    StopReason stop = c.Run(10);
+    equals(c.cpu().A, 0x42, "device register read by the CPU");
+    equals(stop.kind, StopReason::UNMAPPED_MEMORY, "unmapped device area");
+    equals(stop.address, 0xF0002000, "unmapped device area: address");
+}
+
+// a device that wakes up every `period` cycles
+class TickingDevice : public Device {
+public:
+    TickingDevice(LuisaVM& comp, uint64_t period) : comp(comp), period(period) {}
+
+    void Step() override {
+        times.push_back(comp.Cycles());
+        comp.Schedule(*this, period);
+    }
+
+    LuisaVM&         comp;
+    uint64_t         period;
+    vector<uint64_t> times = {};
+};
+
+static void scheduler()
+{
+    cout << "# scheduler\n";
+
+    auto load = [](LuisaVM& comp) {
+        vector<uint8_t> data = Assembler().AssembleString("test", "section .text\nnext: add A, 1\njmp next");
+        for(uint32_t i=0; i<data.size(); ++i) {
+            comp.Set(i, data[i]);
+        }
+    };
+
+    LuisaVM c;
+    load(c);
+    TickingDevice& t1 = c.AddDevice<TickingDevice>(c, 100);
+    TickingDevice& t2 = c.AddDevice<TickingDevice>(c, 1000);
+    TickingDevice& t3 = c.AddDevice<TickingDevice>(c, 10);
+    c.Schedule(t1, 100);
+    c.Schedule(t2, 250);
+    c.Schedule(t2, 50);
+    c.Schedule(t3, 10);
+    c.Unschedule(t3);
+
+    equals(c.Run(1000).cycles, 1000, "cycles executed");
+    equals(c.Cycles(), 1000, "VM time");
+    equals(t1.times.size(), 10, "periodic events");
+    equals(t1.times.front(), 100, "first event on time");
+    equals(t1.times.back(), 1000, "last event on time");
+    equals(t2.times.size(), 1, "rescheduled event runs once");
+    equals(t2.times.front(), 50, "rescheduled event on time");
+    equals(t3.times.size(), 0, "cancelled event");
+    equals(c.cpu().A, 500, "CPU not disturbed by the events");
+
+    for(int i=0; i<100; ++i) {
+        c.Step();
+    }
+    equals(t1.times.back(), 1100, "event while stepping");
+
+    if(JIT::Supported()) {
+        LuisaVM cj;
+        load(cj);
+        cj.EnableJIT(true);
+        TickingDevice& tj = cj.AddDevice<TickingDevice>(cj, 7);
+        cj.Schedule(tj, 7);
+        cj.Run(1000);
+        bool late = false;
+        for(size_t i=0; i<tj.times.size(); ++i) {
+            late |= (tj.times[i] != 7 * (i+1));
+        }
+        equals(tj.times.size(), 142, "events with the JIT");
+        equals(late, false, "events with the JIT on time");
+    }
+}
+
+static void idle()
+{
+    cout << "# idle\n";
+
+    LuisaVM c;
+    vector<uint8_t> data = Assembler().AssembleString("test", R"(section .text
+            mov     A, 1
+            wait
+            mov     A, 2
+    halt:   jmp     halt)");
+    for(uint32_t i=0; i<data.size(); ++i) {
+        c.Set(i, data[i]);
+    }
+    TickingDevice& t = c.AddDevice<TickingDevice>(c, 1000000);
+
+    StopReason stop = c.Run(100);
+    equals(c.cpu().Waiting, true, "waiting");
+    equals(c.cpu().A, 1, "waiting: instructions after it not run");
+    equals(stop.cycles, 100, "time passes while waiting");
+
+    c.Schedule(t, 1000);
+    c.Run(2000);
+    equals(t.times.size() == 1 && t.times[0] == 1100, true, "device event while waiting");
+    equals(c.cpu().A, 2, "woken up by the device event");
+    equals(c.cpu().Waiting, true, "jump to itself waits");
+    equals(c.cpu().PC, data.size() - 5, "jump to itself: PC");
+    equals(c.Cycles(), 2100, "time skipped while waiting");
+
+    c.RegisterKeyEvent({ 'a', NONE, PRESSED });
+    equals(c.cpu().Waiting, false, "woken up by a key");
+
+    // a conditional branch to itself, and short loops polling the memory
+    auto run = [](LuisaVM& comp, string const& code, uint64_t cycles) {
+        vector<uint8_t> bytes = Assembler().AssembleString("test", "section .text\n" + code);
+        for(uint32_t i=0; i<bytes.size(); ++i) {
+            comp.Set(i, bytes[i]);
+        }
+        comp.Run(cycles);
+    };
+    LuisaVM b1, b2;
+    run(b1, "cmp A, 0\n self: bz self\n mov B, 1\n halt: jmp halt", 100);
+    equals(b1.cpu().Waiting && b1.cpu().PC == 3, true, "branch to itself waits");
+    b2.cpu().A = 1;
+    run(b2, "cmp A, 0\n self: bz self\n mov B, 1\n halt: jmp halt", 100);
+    equals(b2.cpu().B, 1, "branch to itself not taken");
+
+    string poll = R"(
+    loop:   movb    B, [0x800]
+            cmp     B, 0
+            bz      loop
+            mov     C, 1
+    halt:   jmp     halt)";
+    LuisaVM p1;
+    TickingDevice& pt = p1.AddDevice<TickingDevice>(p1, 1000000);
+    run(p1, poll, 1000);
+    equals(p1.cpu().Waiting && p1.cpu().Polling, true, "polling loop waits");
+    equals(p1.cpu().PC, 0, "polling loop: waits at its start");
+    p1.Set(0x800, 1);
+    p1.Schedule(pt, 10);
+    p1.Run(100);
+    equals(p1.cpu().C, 1, "polling loop woken up by a device event");
+
+    LuisaVM p2;
+    run(p2, "loop: movb B, [0x800]\n movb [0x801], B\n cmp B, 0\n bz loop", 1000);
+    equals(p2.cpu().Waiting, false, "loop that stores doesn't wait");
+    LuisaVM p3;
+    run(p3, "loop: movb B, [0x800]\n or C, B\n cmp C, 0\n bz loop", 1000);
+    equals(p3.cpu().Waiting, false, "loop carrying a register doesn't wait");
+
+    LuisaVM p4;
+    run(p4, "loop: movd B, [0xF0011000]\n cmp B, 0x2000\n blt loop\n mov C, 1\n halt: jmp halt", 0x3000);
+    equals(p4.cpu().C, 1, "polling the timer's counter runs");
+
+    LuisaVM p5;
+    run(p5, "loop: movd B, [0xF0010000]\n and B, 0x2\n bz loop\n mov C, 1\n halt: jmp halt", 100);
+    equals(p5.cpu().Polling, true, "polling a masked interrupt line waits");
+    p5.RaiseInterrupt(InterruptController::TIMER);
+    equals(p5.cpu().Waiting, false, "polling loop woken up by a masked line");
+    p5.Run(100);
+    equals(p5.cpu().C, 1, "polling loop sees the masked line");
+
+    if(JIT::Supported()) {
+        LuisaVM pj;
+        pj.EnableJIT(true);
+        run(pj, poll, 100000);
+        equals(pj.cpu().Waiting && pj.cpu().Polling, true, "polling loop waits with the JIT");
+    }
+}
+
+static void interrupts()
+{
+    cout << "# interrupts\n";
+
+    LuisaVM c;
+    auto load = [&](uint32_t pos, string const& code) {
+        vector<uint8_t> data = Assembler().AssembleString("test", "section .text\n" + code);
+        for(uint32_t i=0; i<data.size(); ++i) {
+            c.Set(pos + i, data[i]);
+        }
+    };
+    load(0x0, R"(
+            mov     SP, 0x800
+            movd    [0xF0010004], 0x5
+            wait
+            mov     A, 1
+            wait
+    halt:   jmp     halt)");
+    load(0x400, "add B, 0x1\n iret");
+    load(0x500, "add B, 0x10\n iret");
+    c.Set32(0x1000 + 4 * InterruptController::KEYBOARD, 0x400);
+    c.Set32(0x1000 + 4 * InterruptController::VBLANK, 0x500);
+    c.Set32(InterruptController::POS + InterruptController::VECTORS, 0x1000);
+
+    InterruptController& ic = c.interrupts();
+    c.Run(100);
+    c.RaiseInterrupt(InterruptController::TIMER);
+    equals(c.cpu().Waiting, true, "masked line doesn't wake up the CPU");
+    c.Run(100);
+    equals(c.cpu().B, 0, "masked line not delivered");
+    equals(ic.Get32(InterruptController::PENDING), 1u << InterruptController::TIMER, "masked line pending");
+    c.Set32(InterruptController::POS + InterruptController::PENDING, 1u << InterruptController::TIMER);
+    equals(ic.Get32(InterruptController::PENDING), 0, "pending line cleared");
+
+    c.RaiseInterrupt(InterruptController::VBLANK);
+    c.RegisterKeyEvent({ 'a', NONE, PRESSED });
+    c.Run(100);
+    equals(c.cpu().B, 0x11, "interrupts delivered");
+    equals(c.cpu().A, 1, "iret returns after the wait");
+    equals(c.cpu().SP, 0x800, "iret pops PC and FL");
+    equals(ic.Get32(InterruptController::PENDING), 0, "lines cleared on delivery");
+
+    c.RaiseInterrupt(InterruptController::VBLANK);
+    c.RegisterKeyEvent({ 'a', NONE, RELEASED });
+    c.Step();
+    equals(c.cpu().PC, 0x403, "line with the highest priority delivered first");
+    equals(c.cpu().Flag(Flag::IM), true, "interrupts masked in the handler");
+    c.Step();
+    equals(c.cpu().B, 0x12, "no interrupt while in the handler");
+    equals(c.cpu().Flag(Flag::IM), false, "iret restores the flags");
+    c.Step();
+    equals(c.cpu().PC, 0x503, "interrupt delivered after iret");
+
+    LuisaVM v;
+    v.AddDevice<Video>(v, Video::Callbacks { [](uint8_t, uint8_t, uint8_t, uint8_t) {}, [](uint8_t) {}, [](uint8_t) {},
+            [](uint16_t, uint16_t, uint8_t*) { return 0u; }, [](uint32_t, uint16_t, uint16_t) {},
+            [](uint32_t, uint16_t&, uint16_t&) {}, [] {} });   // without the debugger, that would stop the CPU
+    vector<uint8_t> data = Assembler().AssembleString("test", R"(section .text
+            mov     SP, 0x800
+            movd    [0xF0010004], 0x4
+    loop:   wait
+            jmp     loop)");
+    for(uint32_t i=0; i<data.size(); ++i) {
+        v.Set(i, data[i]);
+    }
+    data = Assembler().AssembleString("test", "section .text\n add B, 0x1\n iret");
+    for(uint32_t i=0; i<data.size(); ++i) {
+        v.Set(0x500 + i, data[i]);
+    }
+    v.Set32(0x1000 + 4 * InterruptController::VBLANK, 0x500);
+    v.Set32(InterruptController::POS + InterruptController::VECTORS, 0x1000);
+    v.Run(Video::FRAME_CYCLES - 10);
+    equals(v.cpu().B, 0, "no vblank before the end of the frame");
+    v.Run(2 * Video::FRAME_CYCLES + 20);
+    equals(v.cpu().B, 3, "vblank raised at the end of each frame, in guest time");
+}
+
+static void timer()
+{
+    cout << "# timer\n";
+
+    auto load = [](LuisaVM& c, uint32_t pos, string const& code) {
+        vector<uint8_t> data = Assembler().AssembleString("test", "section .text\n" + code);
+        for(uint32_t i=0; i<data.size(); ++i) {
+            c.Set(pos + i, data[i]);
+        }
+    };
+
+    LuisaVM c;
+    load(c, 0x0, R"(
+            movd    A, [0xF0011000]
+            nop
+            nop
+            nop
+            movd    B, [0xF0011000]
+            movd    C, [0xF0011004]
+    halt:   jmp     halt)");
+    c.Run(100);
+    equals(c.cpu().B - c.cpu().A, 5, "counter read while running");
+    equals(c.cpu().C, 0, "counter high half");
+
+    for(bool jit: { false, true }) {
+        string engine = jit ? " (JIT)" : "";
+        LuisaVM v;
+        v.EnableJIT(jit);
+        load(v, 0x0, R"(
+                mov     SP, 0x800
+                movd    [0xF0010008], 0x1000
+                movd    [0xF0010004], 0x2
+                movd    [0xF001100C], 100
+                movd    [0xF0011008], 0x3
+        loop:   wait
+                jmp     loop)");
+        load(v, 0x400, "add B, 0x1\n movd [0xF0011010], 0x1\n iret");
+        v.Set32(0x1000 + 4 * InterruptController::TIMER, 0x400);
+
+        v.Run(1000);
+        equals(v.cpu().B, 9, "periodic timer" + engine);
+        equals(v.Get32(Timer::POS + Timer::STATUS), 0, "status cleared by the handler" + engine);
+        equals(v.Get32(Timer::POS + Timer::REMAINING), 7, "remaining" + engine);
+    }
+
+    LuisaVM o;
+    load(o, 0x0, "halt: jmp halt");
+    o.Set32(Timer::POS + Timer::PERIOD, 50);
+    o.Set32(Timer::POS + Timer::CONTROL, Timer::ENABLE);
+    o.Run(40);
+    equals(o.Get32(Timer::POS + Timer::STATUS), 0, "one-shot: not expired yet");
+    o.Run(40);
+    equals(o.Get32(Timer::POS + Timer::STATUS), 1, "one-shot expired");
+    equals(o.Get32(Timer::POS + Timer::CONTROL), 0, "one-shot stops");
+    equals(o.interrupts().Get32(InterruptController::PENDING), 1u << InterruptController::TIMER, "timer raises its line");
+}
+
+static void mmu()
+{
+    cout << "# mmu\n";
+
+    LuisaVM c(1024 * 1024);
+    vector<uint8_t> data = Assembler().AssembleString("test", R"(section .text
+            mov     A, 0x1
+            movd    [0x100], 0x42
+            movd    [0x2000], 0x1)");
+    for(uint32_t i=0; i<data.size(); ++i) {
+        c.Set(0x10000 + i, data[i]);
+    }
+
+    c.Set32(MMU::POS + MMU::BASE, 0x10000);
+    c.Set32(MMU::POS + MMU::LIMIT, 0x2000);
+    c.Set32(MMU::POS + MMU::CONTROL, 1);
+    equals(c.Get(0), data[0], "translated read");
+
+    StopReason stop = c.Run(10);
+    equals(stop.kind, StopReason::SEGMENT_FAULT, "outside of the segment");
+    equals(stop.address, 0x2000, "outside of the segment: address");
+    equals(c.Get32(0x100), 0x42, "translated write");
+
+    c.Set32(0xFFE, 0x12345678);
+    equals(c.Get32(0xFFE), 0x12345678, "across a page boundary");
+
+    c.Set(2, 0x5);   // the immediate of the first instruction, already decoded
+    c.cpu().PC = 0;
+    c.Run(1);
+    equals(c.cpu().A, 0x5, "decoded instruction invalidated by its translated address");
+
+    c.cpu().PC = 0x1FFE;
+    c.Set16(0x1FFE, 0x0002);   // mov A, ... cut by the end of the segment
+    stop = c.Run(1);
+    equals(stop.kind, StopReason::SEGMENT_FAULT, "instruction fetched outside of the segment");
+
+    c.mmu().Enable(false);   // the device area is out of reach while translating
+    equals(c.Get32(0x10100), 0x42, "physical address of the write");
+    equals(c.Get32(0x10FFE), 0x12345678, "physical address across a page boundary");
+
+    LuisaVM s(1024 * 1024);
+    auto load = [&](uint32_t pos, string const& code) {
+        vector<uint8_t> code_data = Assembler().AssembleString("test", "section .text\n" + code);
+        for(uint32_t i=0; i<code_data.size(); ++i) {
+            s.Set(pos + i, code_data[i]);
+        }
+    };
+    load(0x0, R"(
+            mov     SP, 0x800
+            movd    [0xF0000004], 0x10000
+            movd    [0xF0000008], 0x1000
+            movd    [0xF000000C], 0x900
+            movd    [0xF0010008], 0x600
+            movd    [0xF0010004], 0x2
+            mov     A, 0xF00
+            pushd   A
+            mov     A, 0x0
+            pushd   A
+            mov     A, 0x80
+            pushd   A
+            iret)");
+    load(0x400, "add C, 0x1\n iret");
+    s.Set32(0x600 + 4 * InterruptController::TIMER, 0x400);
+    load(0x10000, "loop: add B, 0x1\n jmp loop");
+    load(0x10100, "movd [0xF0000000], 0x0");
+
+    s.Run(100);
+    equals(s.mmu().Enabled(), true, "iret with UM starts a task in user mode");
+    equals(s.cpu().SP, 0xF00, "iret with UM pops the task's SP");
+    equals(s.cpu().B > 0, true, "task running");
+
+    s.RaiseInterrupt(InterruptController::TIMER);
+    s.Step();
+    equals(s.mmu().Enabled(), false, "interrupt switches to the supervisor");
+    equals(s.cpu().SP, 0x900 - 12, "interrupt uses the supervisor stack");
+    equals(s.Get32(0x900 - 3), 0xF00, "task's SP pushed");
+    equals((s.Get32(0x900 - 11) >> Flag::UM) & 1, 1, "UM set in the FL pushed");
+    equals(s.cpu().Flag(Flag::UM), false, "UM clear in the handler");
+    s.Run(10);
+    equals(s.cpu().C, 1, "handler run");
+    equals(s.mmu().Enabled(), true, "iret returns to user mode");
+    equals(s.cpu().SP, 0xF00, "iret restores the task's SP");
+
+    s.cpu().PC = 0x100;
+    StopReason fault = s.Run(10);
+    equals(fault.kind, StopReason::SEGMENT_FAULT, "device area out of reach in user mode");
+    equals(fault.address, 0xF0000000, "device area out of reach in user mode: address");
+    equals(s.mmu().Enabled(), true, "task can't disable the MMU");
+
+    load(0x200, "mov A, 0x0\n pushd A\n mov A, 0xC0\n pushd A\n iret");   // FL with IM and UM
+    load(0x300, "mov FL, 0xC0");
+    s.cpu().PC = 0x200;
+    s.cpu().SP = 0xF00;
+    for(int i=0; i<5; ++i) {
+        s.Step();
+    }
+    equals(s.cpu().PC, 0x0, "iret in user mode");
+    equals(s.cpu().Flag(Flag::IM), false, "iret in user mode can't mask the interrupts");
+    equals(s.cpu().SP, 0xF00, "iret in user mode doesn't pop SP");
+    s.cpu().PC = 0x300;
+    s.Step();
+    equals(s.cpu().Flag(Flag::IM) || s.cpu().Flag(Flag::UM), false, "a task can't write IM or UM to FL");
+    s.RaiseInterrupt(InterruptController::TIMER);
+    s.Step();
+    equals(s.mmu().Enabled(), false, "task still preempted");
+}
+
 // }}}
 
 // {{{ assembler_tests
@@ -201,6 +939,10 @@ static void assembler_tests()
     .resb 4
     test: .resb 4 )", V { 0x65, 9, 0, 0, 0 });
 
+    test_assembler("value widened to the opcode", R"(
+    section .text
+    jmp 0x10 )", V { 0x65, 0x10, 0, 0, 0 });
+
     test_assembler("include", R"(%import data/test.s)", 
             V { 0x1, 0x1 });
 
@@ -218,6 +960,9 @@ static void assembler_tests()
 0:5:5
 0:6:8
 0:8:13
+**
+halt:13
+next:3
 )");
 }
 
@@ -248,8 +993,8 @@ static void mov()
 {
     cout << "# mov\n";
 
-    LuisaVM c = code(cpu.B = 0x42, "mov A, B", cpu.A, 0x42);
-    equals(c.cpu().PC, 2);
+    unique_ptr<LuisaVM> c = code(cpu.B = 0x42, "mov A, B", cpu.A, 0x42);
+    equals(c->cpu().PC, 2);
 
     code({}, "mov A, 0x34", cpu.A, 0x34);
     code({}, "mov A, 0x1234", cpu.A, 0x1234);
@@ -257,10 +1002,10 @@ static void mov()
 
     cout << "# movement flags\n";
     c = code({}, "mov A, 0", cpu.Flag(Flag::Z), true);
-    equals(c.cpu().Flag(Flag::S), false);
+    equals(c->cpu().Flag(Flag::S), false);
 
     c = code({}, "mov A, 0xF0000001", cpu.Flag(Flag::Z), false);
-    equals(c.cpu().Flag(Flag::S), true);
+    equals(c->cpu().Flag(Flag::S), true);
 }
 
 
@@ -319,8 +1064,8 @@ static void swap()
 {
     cout << "# swap\n";
         
-    LuisaVM c = code({ cpu.A = 0xA; cpu.B = 0xB; }, "swap A, B", cpu.A, 0xB);
-    equals(c.cpu().B, 0xA);
+    unique_ptr<LuisaVM> c = code({ cpu.A = 0xA; cpu.B = 0xB; }, "swap A, B", cpu.A, 0xB);
+    equals(c->cpu().B, 0xA);
 }
 
 
@@ -328,11 +1073,11 @@ static void logic()
 {
     cout << "# logic operators\n";
 
-    LuisaVM c = code({ cpu.A = 0b1010; cpu.B = 0b1100; }, "or A, B", cpu.A, 0b1110);        
-    equals(c.cpu().Flag(Flag::S), false);
-    equals(c.cpu().Flag(Flag::Z), false);
-    equals(c.cpu().Flag(Flag::Y), false);
-    equals(c.cpu().Flag(Flag::V), false);
+    unique_ptr<LuisaVM> c = code({ cpu.A = 0b1010; cpu.B = 0b1100; }, "or A, B", cpu.A, 0b1110);        
+    equals(c->cpu().Flag(Flag::S), false);
+    equals(c->cpu().Flag(Flag::Z), false);
+    equals(c->cpu().Flag(Flag::Y), false);
+    equals(c->cpu().Flag(Flag::V), false);
 
     code({ cpu.A = 0b11; }, "or A, 0x4", cpu.A, 0b111);
     code({ cpu.A = 0b111; }, "or A, 0x4000", cpu.A, 0x4007);
@@ -342,7 +1087,7 @@ static void logic()
     code({ cpu.A = 0xFF0; }, "xor A, 0xFF00", cpu.A, 0xF0F0);
     code({ cpu.A = 0x148ABD12; }, "xor A, 0x2A426653", cpu.A, 0x3EC8DB41);
     c = code({ cpu.A = 0b11; cpu.B = 0b1100; }, "and A, B", cpu.A, 0);
-    equals(c.cpu().Flag(Flag::Z), true);
+    equals(c->cpu().Flag(Flag::Z), true);
 
     code({ cpu.A = 0b11; }, "and A, 0x7", cpu.A, 0b11);
     code({ cpu.A = 0xFF0; }, "and A, 0xFF00", cpu.A, 0xF00);
@@ -363,23 +1108,23 @@ static void integer_math()
     code({ cpu.A = 0x12; }, "add A, 0x20", cpu.A, 0x32);
     code({ cpu.A = 0x12; cpu.setFlag(Flag::Y, true); }, "add A, 0x20", cpu.A, 0x33); // with carry
     code({ cpu.A = 0x12; }, "add A, 0x2000", cpu.A, 0x2012);
-    LuisaVM c = code({ cpu.A = 0x10000012; }, "add A, 0xF0000000", cpu.A, 0x12);
-    equals(c.cpu().Flag(Flag::Y), true);
+    unique_ptr<LuisaVM> c = code({ cpu.A = 0x10000012; }, "add A, 0xF0000000", cpu.A, 0x12);
+    equals(c->cpu().Flag(Flag::Y), true);
 
     c = code({ cpu.A = 0x30; cpu.B = 0x20; }, "sub A, B", cpu.A, 0x10);
-    equals(c.cpu().Flag(Flag::S), false);
+    equals(c->cpu().Flag(Flag::S), false);
 
     c = code({ cpu.A = 0x20; cpu.B = 0x30; }, "sub A, B", cpu.A, 0xFFFFFFF0); // sub A, B (negative)
-    equals(c.cpu().Flag(Flag::S), true);
+    equals(c->cpu().Flag(Flag::S), true);
 
     code({ cpu.A = 0x22; }, "sub A, 0x20", cpu.A, 0x2);
     code({ cpu.A = 0x22; cpu.setFlag(Flag::Y, true); }, "sub A, 0x20", cpu.A, 0x1); // sub A, 0x20 (with carry)
     c = code({ cpu.A = 0x12; }, "sub A, 0x2000", cpu.A, 0xFFFFE012);
-    equals(c.cpu().Flag(Flag::S), true);
-    equals(c.cpu().Flag(Flag::Y), true);
+    equals(c->cpu().Flag(Flag::S), true);
+    equals(c->cpu().Flag(Flag::Y), true);
 
     c = code({ cpu.A = 0x10000012; }, "sub A, 0xF0000000", cpu.A, 0x20000012);
-    equals(c.cpu().Flag(Flag::Y), true);
+    equals(c->cpu().Flag(Flag::Y), true);
 
     code({}, "cmp A, B", cpu.Flag(Flag::Z), true);
     code({}, "cmp A, 0x12", cpu.Flag(Flag::LT) && !cpu.Flag(Flag::GT), true);
@@ -390,29 +1135,29 @@ static void integer_math()
     code({ cpu.A = 0xF0; cpu.B = 0xF000; }, "mul A, B", cpu.A, 0xE10000);
     code({ cpu.A = 0x1234; }, "mul A, 0x12", cpu.A, 0x147A8);
     c = code({ cpu.A = 0x1234; }, "mul A, 0x12AF", cpu.A, 0x154198C);
-    equals(c.cpu().Flag(Flag::V), false);
+    equals(c->cpu().Flag(Flag::V), false);
 
     c = code({ cpu.A = 0x1234; }, "mul A, 0x12AF87AB", cpu.A, 0x233194BC);
-    equals(c.cpu().Flag(Flag::V), true);
+    equals(c->cpu().Flag(Flag::V), true);
 
     code({ cpu.A = 0xF000; cpu.B = 0xF0; }, "idiv A, B", cpu.A, 0x100);
     code({ cpu.A = 0x1234; }, "idiv A, 0x12", cpu.A, 0x102);
     code({ cpu.A = 0x1234; }, "idiv A, 0x2AF", cpu.A, 0x6);
     code({ cpu.A = 0x123487AB; }, "idiv A, 0x12AF", cpu.A, 0xF971);
     c = code({ cpu.A = 0xF000; cpu.B = 0xF0; }, "mod A, B", cpu.A, 0x0);
-    equals(c.cpu().Flag(Flag::Z), true);
+    equals(c->cpu().Flag(Flag::Z), true);
 
     code({ cpu.A = 0x1234; }, "mod A, 0x12", cpu.A, 0x10);
     code({ cpu.A = 0x1234; }, "mod A, 0x2AF", cpu.A, 0x21A);
     code({ cpu.A = 0x123487AB; }, "mod A, 0x12AF", cpu.A, 0x116C);
     code({ cpu.A = 0x42; }, "inc A", cpu.A, 0x43);
     c = code({ cpu.A = 0xFFFFFFFF; }, "inc A", cpu.A, 0x0); // inc A (overflow)
-    equals(c.cpu().Flag(Flag::Y), true);
-    equals(c.cpu().Flag(Flag::Z), true);
+    equals(c->cpu().Flag(Flag::Y), true);
+    equals(c->cpu().Flag(Flag::Z), true);
 
     code({ cpu.A = 0x42; }, "dec A", cpu.A, 0x41);
     c = code({ cpu.A = 0x0; }, "dec A", cpu.A, 0xFFFFFFFF); // dec A (underflow)
-    equals(c.cpu().Flag(Flag::Z), false);
+    equals(c->cpu().Flag(Flag::Z), false);
 }
 
 
@@ -518,6 +1263,335 @@ static void stack_allreg()
 }
 
 
+static void self_modifying()
+{
+    cout << "# self-modifying code\n";
+
+    LuisaVM comp;
+    CPU& cpu = comp.cpu();
+
+    vector<uint8_t> data = Assembler().AssembleString("test", "section .text\nmov A, 0x34\nmovb [0x2], 0x56\njmp 0");
+    for(uint32_t i=0; i<data.size(); ++i) {
+        comp.Set(i, data[i]);
+    }
+
+    comp.Step();
+    equals(cpu.A, 0x34, "before modification");
+
+    comp.Step();
+    comp.Step();
+    comp.Step();
+    equals(cpu.A, 0x56, "immediate modified by guest");
+
+    cpu.PC = 0;
+    comp.Set(2, 0x78);
+    comp.Step();
+    equals(cpu.A, 0x78, "immediate modified by host");
+}
+
+
+static void run()
+{
+    cout << "# run\n";
+
+    string code = R"(section .text
+            mov     A, 0
+            mov     B, 0x1000
+            mov     C, 100
+    next:   add     A, 3
+            movd    [B], A
+            add     B, 4
+            dec     C
+            bnz     next
+    halt:   jmp     halt)";
+
+    LuisaVM comp, comp_step;
+    vector<uint8_t> data = Assembler().AssembleString("test", code);
+    for(uint32_t i=0; i<data.size(); ++i) {
+        comp.Set(i, data[i]);
+        comp_step.Set(i, data[i]);
+    }
+
+    equals(comp.Run(1000).cycles, 1000, "cycles executed");
+    for(int i=0; i<1000; ++i) {
+        comp_step.Step();
+    }
+
+    equals(comp.cpu().A, 300, "loop result");
+    equals(comp.Get32(0x1000 + 99*4), 300, "stored in memory");
+    for(size_t i=0; i<16; ++i) {
+        equals(comp.cpu().Register[i], comp_step.cpu().Register[i], "register " + to_string(i) + " (run == step)");
+    }
+
+    LuisaVM c;
+    data = Assembler().AssembleString("test", "section .text\nmul A, 3\nmovd [0x1000], A\nidiv A, B");
+    for(uint32_t i=0; i<data.size(); ++i) {
+        c.Set(i, data[i]);
+    }
+    equals(c.Run(1).cycles, 4, "cycles of a slow instruction");
+    StopReason stop = c.Run(100);
+    equals(stop.kind, StopReason::DIVISION_BY_ZERO, "cycles until a trap");
+    equals(stop.cycles, 2, "faulting instruction not counted");
+}
+
+
+static void traps()
+{
+    cout << "# traps\n";
+
+    auto run = [](vector<uint8_t> const& data, LuisaVM& comp) {
+        for(uint32_t i=0; i<data.size(); ++i) {
+            comp.Set(i, data[i]);
+        }
+        return comp.Run(100);
+    };
+
+    LuisaVM c1;
+    StopReason stop = run({ 0x02, 0x00, 0x01, 0xFF }, c1);   // mov A, 1
+    equals(stop.kind, StopReason::INVALID_OPCODE, "invalid opcode");
+    equals(stop.pc, 3, "invalid opcode: pc");
+    equals(stop.cycles, 1, "invalid opcode: cycles");
+    equals(c1.cpu().PC, 3, "invalid opcode: PC points to the instruction");
+
+    LuisaVM c2;
+    stop = run(Assembler().AssembleString("test", "section .text\nmov A, 10\nmov B, 0\nidiv A, B"), c2);
+    equals(stop.kind, StopReason::DIVISION_BY_ZERO, "division by zero");
+    equals(stop.pc, 6, "division by zero: pc");
+    equals(c2.cpu().A, 10, "division by zero: destination unchanged");
+
+    LuisaVM c3;
+    stop = run(Assembler().AssembleString("test", "section .text\nmovb A, [0xFFFF0010]"), c3);
+    equals(stop.kind, StopReason::UNMAPPED_MEMORY, "unmapped memory");
+    equals(stop.address, 0xFFFF0010, "unmapped memory: address");
+    equals(c3.cpu().PC, 0, "unmapped memory: PC points to the instruction");
+
+    LuisaVM c4;
+    stop = run({ 0x02, 0x20, 0x05 }, c4);   // mov (register 32), 5
+    equals(stop.kind, StopReason::INVALID_REGISTER, "invalid register");
+}
+
+
+static void fusion()
+{
+    cout << "# fusion\n";
+
+    string code = R"(section .text
+            mov     C, 50
+    next:   mov     A, C
+            add     A, 7
+            add     B, A
+            cmp     C, 25
+            bnz     skip
+            inc     D
+            jmp     middle
+    skip:   cmp     A, 0
+    middle: bz      next
+            dec     C
+            bnz     next
+    halt:   jmp     halt)";
+
+    LuisaVM comp, comp_plain;
+    for(int f=0; f<CPU::FUSION_COUNT; ++f) {
+        comp_plain.cpu().EnableFusion(static_cast<CPU::Fusion>(f), false);
+    }
+    vector<uint8_t> data = Assembler().AssembleString("test", code);
+    for(uint32_t i=0; i<data.size(); ++i) {
+        comp.Set(i, data[i]);
+        comp_plain.Set(i, data[i]);
+    }
+
+    equals(comp.Run(2000).cycles, 2000, "cycles executed");
+    comp_plain.Run(2000);
+
+    equals(comp.cpu().B, 1625, "loop result");
+    for(size_t i=0; i<16; ++i) {
+        equals(comp.cpu().Register[i], comp_plain.cpu().Register[i], "register " + to_string(i) + " (fused == not fused)");
+    }
+    equals(comp.cpu().FusionCount(CPU::FUSE_DEC_BNZ), 50, "dec+bnz fused");
+    equals(comp.cpu().FusionCount(CPU::FUSE_MOV_ADD), 50, "mov+add fused");
+    equals(comp.cpu().FusionCount(CPU::FUSE_CMP_BNZ), 50, "cmp+bnz fused");
+    equals(comp.cpu().FusionCount(CPU::FUSE_CMP_BZ), 49, "cmp+bz fused, except when jumping into it");
+    equals(comp_plain.cpu().FusionCount(CPU::FUSE_MOV_ADD), 0, "disabled fusion");
+}
+
+
+static void no_allocations()
+{
+    cout << "# no allocations\n";
+
+    if(!allocations) {
+        cout << "Allocation counter not available, skipping.\n";
+        return;
+    }
+
+    string code = R"(section .text
+            mov     SP, 0xFFF
+            mov     B, 0x1000
+    next:   add     A, 3
+            movd    [B], A
+            movb    C, [B]
+            add     B, 4
+            and     B, 0x1FFF
+            pushd   A
+            popd    D
+            jsr     sub
+            cmp     A, B
+            bnz     next
+            jmp     next
+    sub:    inc     E
+            ret)";
+
+    LuisaVM comp;
+    vector<uint8_t> data = Assembler().AssembleString("test", code);
+    for(uint32_t i=0; i<data.size(); ++i) {
+        comp.Set(i, data[i]);
+    }
+
+    size_t before = allocations();
+    comp.Run(10000);
+    size_t n = allocations() - before;
+    equals(n, 0, "heap allocations while running");
+}
+
+
+static void jit()
+{
+    cout << "# jit\n";
+
+    if(!JIT::Supported()) {
+        cout << "JIT not supported in this platform, skipping.\n";
+        return;
+    }
+
+    string code = R"(section .text
+            mov     SP, 0xFFF
+            mov     B, 0x1000
+            mov     C, 200
+    next:   add     A, 3
+            movd    [B], A
+            add     B, 4
+            mov     D, A
+            mul     D, 7
+            mod     D, 5
+            add     E, D
+            jsr     sub
+            cmp     C, 100
+            bgt     skip
+            movb    F, [0x100000]
+    skip:   dec     C
+            bnz     next
+    smc:    mov     I, 0
+            movb    J, [0x39]
+            inc     J
+            movb    [0x39], J
+            cmp     J, 60
+            blt     smc
+    halt:   jmp     halt
+    sub:    pushd   E
+            popd    G
+            inc     H
+            ret)";
+
+    LuisaVM comp, comp_int;
+    comp.EnableJIT(true);
+    vector<uint8_t> data = Assembler().AssembleString("test", code);
+    for(uint32_t i=0; i<data.size(); ++i) {
+        comp.Set(i, data[i]);
+        comp_int.Set(i, data[i]);
+    }
+
+    equals(comp.Run(20000).cycles, 20000, "cycles executed");
+    comp_int.Run(20000);
+
+    equals(comp.jit()->TranslatedBlocks() > 0, true, "blocks were translated");
+    equals(comp.cpu().I, 59, "self-modifying code");
+    for(size_t i=0; i<16; ++i) {
+        equals(comp.cpu().Register[i], comp_int.cpu().Register[i], "register " + to_string(i) + " (jit == interpreter)");
+    }
+    bool memory_equal = true;
+    for(uint32_t i=0; i<0x2000; ++i) {
+        memory_equal &= (comp.Get(i) == comp_int.Get(i));
+    }
+    equals(memory_equal, true, "memory (jit == interpreter)");
+}
+
+
+static void native()
+{
+    cout << "# native\n";
+
+    string code = R"(section .text
+            mov     SP, 0xFFF
+            mov     B, 0x1000
+            mov     C, 100
+    next:   add     A, 3
+            movd    [B], A
+            add     B, 4
+            mov     D, A
+            mod     D, 5
+            add     E, D
+            jsr     sub
+            mov     F, after
+            add     F, 2
+            jmp     F
+    after:  nop
+            nop
+            dec     C
+            bnz     next
+    halt:   jmp     halt
+    sub:    pushd   E
+            popd    G
+            inc     H
+            ret)";
+
+    string mp;
+    vector<uint8_t> data = Assembler().AssembleString("test", code, mp);
+    string source = Translator().Translate(data, mp);
+    equals(source.find("luisavm_aot_run") != string::npos, true, "dispatcher generated");
+
+    if(system("c++ --version > /dev/null 2>&1") != 0) {
+        cout << "C++ compiler not found, skipping.\n";
+        return;
+    }
+
+    string base = "/tmp/luisavm-aot-" + to_string(getpid());
+    ofstream(base + ".cc") << source;
+    int r = system(("c++ -O1 -shared -fPIC -Ilib " + base + ".cc -o " + base + ".so").c_str());
+    equals(r, 0, "generated code compiles");
+
+    LuisaVM comp, comp_int;
+    for(uint32_t i=0; i<data.size(); ++i) {
+        comp.Set(i, data[i]);
+        comp_int.Set(i, data[i]);
+    }
+    comp.LoadNative(base + ".so");
+    unlink((base + ".cc").c_str());
+    unlink((base + ".so").c_str());
+
+    string rom = base + ".rom";
+    ofstream(rom, ios::binary).write(reinterpret_cast<char const*>(data.data()), static_cast<streamsize>(data.size()));
+    comp.LoadROM(rom, "");
+    unlink(rom.c_str());
+    equals(comp.native()->Abandoned(), false, "native code kept after loading the ROM");
+
+    equals(comp.Run(20000).cycles, 20000, "cycles executed");
+    comp_int.Run(20000);
+
+    for(size_t i=0; i<16; ++i) {
+        equals(comp.cpu().Register[i], comp_int.cpu().Register[i], "register " + to_string(i) + " (native == interpreter)");
+    }
+    bool memory_equal = true;
+    for(uint32_t i=0; i<0x2000; ++i) {
+        memory_equal &= (comp.Get(i) == comp_int.Get(i));
+    }
+    equals(memory_equal, true, "memory (native == interpreter)");
+    equals(comp.native()->Abandoned(), false, "native code kept while the guest doesn't write over it");
+
+    comp.Set(0x0, 0x0);   // written by the guest, as far as the VM can tell
+    equals(comp.native()->Abandoned(), true, "native code abandoned when its code is written");
+}
+
+
 static void others()
 {
     code({}, "nop", cpu.PC, 1);
@@ -542,6 +1616,13 @@ static void cpu_tests()
     branches();
     stack();
     stack_allreg();
+    self_modifying();
+    run();
+    traps();
+    fusion();
+    no_allocations();
+    jit();
+    native();
     others();
 }
 
@@ -0,0 +1,164 @@
+#include "timer.hh"
+
+#include <stdexcept>
+using namespace std;
+
+#include "luisavm.hh"
+
+namespace luisavm {
+
+void Timer::Reset()
+{
+    _control = _period = _status = _latch = 0;
+    _deadline = STOPPED;
+    comp.Unschedule(*this);
+}
+
+
+// Expirations missed by a late event are skipped, rather than raised one
+// after the other.
+void Timer::Step()
+{
+    uint64_t now = comp.Cycles();
+    if(_deadline == STOPPED || now < _deadline) {
+        return;
+    }
+    _status |= 1;
+    comp.RaiseInterrupt(InterruptController::TIMER);
+    if((_control & PERIODIC) && _period > 0) {
+        _deadline += ((now - _deadline) / _period + 1) * _period;
+        comp.Schedule(*this, _deadline - now);
+    } else {
+        _control &= ~static_cast<uint32_t>(ENABLE);
+        _deadline = STOPPED;
+    }
+}
+
+
+void Timer::Start(uint64_t cycles)
+{
+    if((_control & ENABLE) && cycles > 0 && cycles != STOPPED) {
+        _deadline = comp.Cycles() + cycles;
+        comp.Schedule(*this, cycles);
+    } else {
+        _deadline = STOPPED;
+        comp.Unschedule(*this);
+    }
+}
+
+
+vector<uint8_t> Timer::SaveState() const
+{
+    uint64_t now = comp.Cycles();
+    uint64_t remaining = (_deadline == STOPPED) ? STOPPED : (_deadline > now ? _deadline - now : 1);
+    vector<uint8_t> data;
+    for(uint32_t reg: { _control, _period, _status, _latch }) {
+        for(int i=0; i<4; ++i) {
+            data.push_back(static_cast<uint8_t>(reg >> (8 * i)));
+        }
+    }
+    for(int i=0; i<8; ++i) {
+        data.push_back(static_cast<uint8_t>(remaining >> (8 * i)));
+    }
+    return data;
+}
+
+
+// save states from before the timer existed have no state for it
+void Timer::LoadState(vector<uint8_t> const& data)
+{
+    if(data.empty()) {
+        Reset();
+        return;
+    } else if(data.size() != 24) {
+        throw runtime_error("Invalid timer state.");
+    }
+    auto take = [&](size_t pos, size_t sz) {
+        uint64_t value = 0;
+        for(size_t i=0; i<sz; ++i) {
+            value |= static_cast<uint64_t>(data[pos + i]) << (8 * i);
+        }
+        return value;
+    };
+    _control = static_cast<uint32_t>(take(0, 4));
+    _period = static_cast<uint32_t>(take(4, 4));
+    _status = static_cast<uint32_t>(take(8, 4));
+    _latch = static_cast<uint32_t>(take(12, 4));
+    Start(take(16, 8));
+}
+
+
+uint32_t Timer::Read(uint32_t reg)
+{
+    uint64_t now = comp.Cycles();
+    switch(reg) {
+        case COUNTER_LO:
+            _latch = static_cast<uint32_t>(now >> 32);
+            return static_cast<uint32_t>(now);
+        case COUNTER_HI: return _latch;
+        case CONTROL:    return _control;
+        case PERIOD:     return _period;
+        case STATUS:     return _status;
+        case REMAINING:
+            if(_deadline == STOPPED || _deadline <= now) {
+                return 0;
+            }
+            return static_cast<uint32_t>(min<uint64_t>(_deadline - now, UINT32_MAX));
+        default:
+            return 0;
+    }
+}
+
+
+// `bits` are the bits of the register being written
+void Timer::Write(uint32_t reg, uint32_t value, uint32_t bits)
+{
+    switch(reg) {
+        case CONTROL:
+            _control = ((_control & ~bits) | value) & (ENABLE | PERIODIC);
+            Start(_period);
+            break;
+        case PERIOD:
+            _period = (_period & ~bits) | value;
+            Start(_period);
+            break;
+        case STATUS:
+            _status &= ~value;
+            break;
+        default:
+            break;
+    }
+}
+
+
+uint8_t Timer::Get(uint32_t pos)
+{
+    return (pos < MemorySize()) ? static_cast<uint8_t>(Read(pos & ~3u) >> (8 * (pos % 4))) : 0;
+}
+
+
+void Timer::Set(uint32_t pos, uint8_t data)
+{
+    if(pos < MemorySize()) {
+        uint32_t shift = 8 * (pos % 4);
+        Write(pos & ~3u, static_cast<uint32_t>(data) << shift, 0xFFu << shift);
+    }
+}
+
+
+uint32_t Timer::Get32(uint32_t pos)
+{
+    return (pos % 4 == 0 && pos < MemorySize()) ? Read(pos) : Device::Get32(pos);
+}
+
+
+void Timer::Set32(uint32_t pos, uint32_t data)
+{
+    if(pos % 4 == 0 && pos < MemorySize()) {
+        Write(pos, data, 0xFFFFFFFF);
+    } else {
+        Device::Set32(pos, data);
+    }
+}
+
+}  // namespace luisavm
@@ -0,0 +1,69 @@
+#ifndef TIMER_HH_
+#define TIMER_HH_
+
+#include <cstdint>
+#include <vector>
+using namespace std;
+
+#include "device.hh"
+
+namespace luisavm {
+
+// Counts the time of the VM in cycles. The counter runs freely; the timer
+// counts down PERIOD cycles from when CONTROL or PERIOD is written, and then
+// sets STATUS and raises the TIMER interrupt line. In periodic mode it starts
+// again, keeping in step even if an expiration was late. It is driven by the
+// VM's scheduler, so it costs nothing while it counts.
+//
+// Registers (32 bits each, little-endian):
+//   0x00  COUNTER_LO  low half of LuisaVM::Cycles(); reading it latches the
+//   0x04  COUNTER_HI  high half, so that the two read together are consistent
+//   0x08  CONTROL     bit 0 enables the timer, bit 1 makes it periodic
+//   0x0C  PERIOD      cycles until it expires
+//   0x10  STATUS      bit 0 is set when it expires; writing 1 clears it
+//   0x14  REMAINING   cycles left until it expires, 0 if stopped (read-only)
+class Timer : public Device {
+public:
+    explicit Timer(class LuisaVM& comp) : comp(comp) {}
+
+    static const uint32_t POS = 0xF0011000;
+    enum Register : uint32_t { COUNTER_LO = 0x00, COUNTER_HI = 0x04, CONTROL = 0x08, PERIOD = 0x0C, STATUS = 0x10, REMAINING = 0x14 };
+    enum Control : uint32_t { ENABLE = 0x1, PERIODIC = 0x2 };
+
+    void Step() override;
+    void Reset() override;
+
+    vector<uint8_t> SaveState() const override;   // the registers, and the time left
+    void            LoadState(vector<uint8_t> const& data) override;
+
+    uint32_t MemoryPos() const override  { return POS; }
+    uint32_t MemorySize() const override { return 0x18; }
+
+    uint8_t  Get(uint32_t pos) override;
+    void     Set(uint32_t pos, uint8_t data) override;
+    uint32_t Get32(uint32_t pos) override;
+    void     Set32(uint32_t pos, uint32_t data) override;
+
+    // the counter and the time left follow the time
+    bool Steady(uint32_t pos) const override {
+        return (pos & ~3u) != COUNTER_LO && (pos & ~3u) != REMAINING;
+    }
+
+private:
+    static const uint64_t STOPPED = UINT64_MAX;
+
+    uint32_t Read(uint32_t reg);
+    void     Write(uint32_t reg, uint32_t value, uint32_t bits);
+    void     Start(uint64_t cycles);
+
+    LuisaVM& comp;
+    uint32_t _control = 0,
+             _period = 0,
+             _status = 0,
+             _latch = 0;         // COUNTER_HI, as of the last read of COUNTER_LO
+    uint64_t _deadline = STOPPED;
+};
+
+}  // namespace luisavm
+
+#endif
@@ -0,0 +1,465 @@
+#include "translator.hh"
+
+#include <cstdio>
+#include <sstream>
+#include <stdexcept>
+using namespace std;
+
+namespace luisavm {
+
+static const char* const reg_name[] = {
+    "A", "B", "C", "D", "E", "F", "G", "H", "I", "J", "K", "L", "FP", "SP", "PC", "FL"
+};
+
+static string hex(uint32_t value)
+{
+    char buf[16];
+    snprintf(buf, sizeof buf, "0x%Xu", value);
+    return buf;
+}
+
+// {{{ translation
+
+string Translator::Translate(vector<uint8_t> const& rom, string const& mp, string const& name)
+{
+    _code.clear();
+    _labels.clear();
+    _leaders.clear();
+
+    ParseMap(mp, rom);
+    FindLeaders();
+
+    stringstream ss;
+    ss << "// Generated by lac from " << name << ". Do not edit.\n\n";
+    ss << "#include \"aot.hh\"\n\n";
+    ss << "using namespace luisavm::aot;\n\n";
+
+    // split the code in blocks
+    vector<vector<Decoded const*>> blocks;
+    bool open = false;
+    for(auto const& kv: _code) {
+        Decoded const& d = kv.second;
+        if(!Translatable(d)) {
+            open = false;
+            continue;
+        }
+        if(!open || _leaders.find(d.pc) != _leaders.end()) {
+            blocks.emplace_back();
+        }
+        blocks.back().push_back(&d);
+        open = !Terminator(d) && _code.find(d.pc + d.sz) != _code.end();
+    }
+
+    for(auto const& block: blocks) {
+        ss << Block(block) << "\n";
+    }
+
+    // entry point
+    uint32_t code_end = _code.empty() ? 0 : (_code.rbegin()->second.pc + _code.rbegin()->second.sz);
+    ss << "extern \"C\" const uint32_t luisavm_aot_version = ABI_VERSION;\n";
+    ss << "extern \"C\" const uint32_t luisavm_aot_code_end = " << hex(code_end) << ";\n\n";
+    ss << "extern \"C\" uint64_t luisavm_aot_run(Context* c, uint64_t max_cycles)\n";
+    ss << "{\n";
+    ss << "    uint64_t cycles = 0, n;\n";
+    ss << "    while(!c->code_written) {\n";
+    ss << "        switch(c->reg[14]) {\n";
+    for(auto const& block: blocks) {
+        uint32_t pc = block.front()->pc;
+        size_t block_cycles = 0;
+        for(Decoded const* d: block) {
+            block_cycles += d->opcode->cycles;
+        }
+        ss << "            case " << hex(pc) << ":\n";
+        ss << "                if(max_cycles - cycles < " << block_cycles << ") {\n";
+        ss << "                    return cycles;\n";
+        ss << "                }\n";
+        ss << "                n = block_" << hex(pc).substr(2, string::npos) << "(c);\n";
+        ss << "                if(n == 0) {\n";
+        ss << "                    return cycles;   // the first instruction is left to the interpreter\n";
+        ss << "                }\n";
+        ss << "                cycles += n;\n";
+        ss << "                break;\n";
+    }
+    ss << "            default:\n";
+    ss << "                return cycles;   // unknown address: leave it to the interpreter\n";
+    ss << "        }\n";
+    ss << "    }\n";
+    ss << "    return cycles;\n";
+    ss << "}\n";
+
+    return ss.str();
+}
+
+// }}}
+
+// {{{ code discovery
+
+void Translator::ParseMap(string const& mp, vector<uint8_t> const& rom)
+{
+    stringstream ss(mp);
+    string line;
+    int section = 0;   // files, lines, labels
+    while(getline(ss, line)) {
+        if(line == "**") {
+            ++section;
+            continue;
+        }
+        size_t p = line.rfind(':');
+        if(section == 0 || p == string::npos) {
+            continue;
+        }
+
+        uint32_t pc = static_cast<uint32_t>(stoul(line.substr(p + 1)));
+        if(section == 1) {
+            Decoded d;
+            if(!Decode(rom, pc, d)) {
+                throw runtime_error("Invalid instruction at " + hex(pc) + ".");
+            }
+            _code[pc] = d;
+        } else if(_labels.find(pc) == _labels.end()) {
+            _labels[pc] = line.substr(0, p);
+        }
+    }
+}
+
+
+bool Translator::Decode(vector<uint8_t> const& rom, uint32_t pc, Decoded& d) const
+{
+    if(pc >= rom.size() || rom[pc] == 0 || rom[pc] >= opcodes.size() || !opcodes[rom[pc]].Valid()) {
+        return false;
+    }
+    d.pc = pc;
+    d.opcode = &opcodes[rom[pc]];
+    d.par.clear();
+
+    size_t pos = pc + 1;
+    auto get = [&](size_t n) {
+        uint32_t value = 0;
+        for(size_t i=0; i<n; ++i) {
+            value |= static_cast<uint32_t>(pos + i < rom.size() ? rom[pos + i] : 0) << (8 * i);
+        }
+        pos += n;
+        return value;
+    };
+
+    ParameterType const* pt = d.opcode->parameter;
+    if(d.opcode->Packed()) {
+        uint32_t regs = get(1);
+        d.par.push_back({ pt[0], regs >> 4 });
+        d.par.push_back({ pt[1], regs & 0xF });
+    } else {
+        for(uint8_t i=0; i<d.opcode->n_pars; ++i) {
+            ParameterType t = pt[i];
+            switch(t) {
+                case REG: case INDREG: case V8: d.par.push_back({ t, get(1) }); break;
+                case V16:                       d.par.push_back({ t, get(2) }); break;
+                case V32: case INDV32:          d.par.push_back({ t, get(4) }); break;
+            }
+        }
+    }
+    d.sz = static_cast<uint8_t>(pos - pc);
+    return pos <= rom.size();
+}
+
+
+// Instructions that use PC as a parameter are left to the interpreter, as
+// well as the ones that might make the CPU wait (`wait`, and a branch to
+// itself or back over a polling loop) and `iret`, which might enable the MMU.
+bool Translator::Translatable(Decoded const& d) const
+{
+    auto ins = d.opcode->instruction;   // `Instruction` is also a member
+    if(ins == WAIT || ins == IRET) {
+        return false;
+    } else if(((ins >= BZ && ins <= BNV) || ins == JMP) && d.par[0].type == V32 && d.par[0].value <= d.pc) {
+        vector<Decoded const*> body;
+        uint32_t pc = d.par[0].value;
+        for(auto it = _code.find(pc); it != _code.end() && pc < d.pc && body.size() < MAX_POLLING_LOOP; it = _code.find(pc)) {
+            body.push_back(&it->second);
+            pc += it->second.sz;
+        }
+        if(pc == d.pc && PollingLoop(body.data(), body.size())) {
+            return false;
+        }
+    }
+    for(Parameter const& p: d.par) {
+        if((p.type == REG || p.type == INDREG) && p.value >= 14 && !(p.value == 15 && p.type == REG)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+bool Translator::Terminator(Decoded const& d) const
+{
+    return d.opcode->instruction >= BZ && d.opcode->instruction <= RET;
+}
+
+
+// Blocks start at the first instruction, at the labels, at the targets of
+// the branches and after the branches.
+void Translator::FindLeaders()
+{
+    if(!_code.empty()) {
+        _leaders.insert(_code.begin()->first);
+    }
+    for(auto const& kv: _labels) {
+        _leaders.insert(kv.first);
+    }
+    for(auto const& kv: _code) {
+        Decoded const& d = kv.second;
+        if(Terminator(d)) {
+            if(!d.par.empty() && d.par[0].type == V32) {
+                _leaders.insert(d.par[0].value);
+            }
+            _leaders.insert(d.pc + d.sz);
+        }
+    }
+}
+
+// }}}
+
+// {{{ code generation
+
+string Translator::Block(vector<Decoded const*> const& block) const
+{
+    stringstream ss;
+    uint32_t pc = block.front()->pc;
+
+    auto label = _labels.find(pc);
+    if(label != _labels.end()) {
+        ss << "// " << label->second << "\n";
+    }
+    ss << "static uint64_t block_" << hex(pc).substr(2, string::npos) << "(Context* c)\n";
+    ss << "{\n";
+    ss << "    uint32_t r[16];\n";
+    ss << "    Fetch(c, r);\n\n";
+    size_t cycles = 0;
+    for(size_t i=0; i<block.size(); ++i) {
+        cycles += block[i]->opcode->cycles;
+        ss << Instruction(*block[i], cycles);
+    }
+
+    Decoded const& last = *block.back();
+    if(!Terminator(last)) {
+        ss << "    r[14] = " << hex(last.pc + last.sz) << ";\n";
+        ss << "    Leave(c, r);\n";
+        ss << "    return " << cycles << ";\n";
+    }
+    ss << "}\n";
+    return ss.str();
+}
+
+
+// Mirrors CPU::Execute. `n` is the number of cycles run in the block, 
+// including this instruction.
+string Translator::Instruction(Decoded const& d, size_t n) const
+{
+    stringstream ss;
+    vector<Parameter> const& par = d.par;
+    string next = hex(d.pc + d.sz);
+    string leave = "{ Leave(c, r); return " + to_string(n) + "; }";
+    string written = "    if(c->code_written) { r[14] = " + next + "; Leave(c, r); return " + to_string(n) + "; }\n";
+    string jump = par.empty() ? "" : "{ r[14] = " + Take(par[0]) + "; Leave(c, r); return " + to_string(n) + "; }";
+    string trap = "{ r[14] = " + hex(d.pc) + "; Leave(c, r); return " + to_string(n - d.opcode->cycles) + "; }";   // the interpreter reports it
+
+    auto branch = [&](string const& condition) {
+        ss << "    if(" << condition << ") " << jump << "\n";
+    };
+
+    ss << "    // " << hex(d.pc).substr(0, hex(d.pc).size() - 1) << ": " << Disassemble(d) << "\n";
+
+    switch(d.opcode->instruction) {
+        case MOV:
+            ss << Apply(par[0], Take(par[1]), 0, written);
+            break;
+        case MOVB:
+            ss << Apply(par[0], "(" + Take(par[1]) + " & 0xFFu)", 1, written);
+            break;
+        case MOVW:
+            ss << Apply(par[0], "(" + Take(par[1]) + " & 0xFFFFu)", 2, written);
+            break;
+        case MOVD:
+            ss << Apply(par[0], Take(par[1]), 4, written);
+            break;
+        case SWAP:
+            ss << "    { uint32_t tmp = " << Take(par[1]) << ";\n";
+            ss << Apply(par[1], Take(par[0]), 0, written);
+            ss << Apply(par[0], "tmp", 0, written);
+            ss << "    }\n";
+            break;
+        case OR:
+            ss << Apply(par[0], Take(par[0]) + " | " + Take(par[1]), 0, written);
+            break;
+        case XOR:
+            ss << Apply(par[0], Take(par[0]) + " ^ " + Take(par[1]), 0, written);
+            break;
+        case AND:
+            ss << Apply(par[0], Take(par[0]) + " & " + Take(par[1]), 0, written);
+            break;
+        case SHL:
+            ss << Apply(par[0], Take(par[0]) + " << (" + Take(par[1]) + " & 31u)", 0, written);
+            break;
+        case SHR:
+            ss << Apply(par[0], Take(par[0]) + " >> (" + Take(par[1]) + " & 31u)", 0, written);
+            break;
+        case NOT:
+            ss << Apply(par[0], "~" + Take(par[0]), 0, written);
+            break;
+        case ADD:
+            ss << "    { uint64_t value = static_cast<uint64_t>(" << Take(par[0]) << ") + " << Take(par[1]) << " + (r[15] & 1u);\n";
+            ss << "      bool y = value > 0xFFFFFFFFu;\n";
+            ss << Apply(par[0], "static_cast<uint32_t>(value)", 0, written);
+            ss << "      SetFlag(r[15], 0, y); }\n";
+            break;
+        case SUB:
+            ss << "    { int64_t value = static_cast<int64_t>(" << Take(par[0]) << ") - static_cast<int64_t>(" << Take(par[1]) << ") - static_cast<int64_t>(r[15] & 1u);\n";
+            ss << "      bool y = value < 0;\n";
+            ss << Apply(par[0], "static_cast<uint32_t>(value)", 0, written);
+            ss << "      SetFlag(r[15], 0, y); }\n";
+            break;
+        case CMP:
+            ss << "    Compare(r[15], " << Take(par[0]) << ", " << Take(par[par.size() == 1 ? 0 : 1]) << ");\n";
+            break;
+        case MUL:
+            ss << "    { uint64_t value = static_cast<uint64_t>(" << Take(par[0]) << ") * " << Take(par[1]) << ";\n";
+            ss << "      bool v = value > 0xFFFFFFFFu;\n";
+            ss << Apply(par[0], "static_cast<uint32_t>(value)", 0, written);
+            ss << "      SetFlag(r[15], 1, v); }\n";
+            break;
+        case IDIV:
+            ss << "    if(" << Take(par[1]) << " == 0) " << trap << "\n";
+            ss << Apply(par[0], Take(par[0]) + " / " + Take(par[1]), 0, written);
+            break;
+        case MOD:
+            ss << "    if(" << Take(par[1]) << " == 0) " << trap << "\n";
+            ss << Apply(par[0], Take(par[0]) + " % " + Take(par[1]), 0, written);
+            break;
+        case INC:
+            ss << "    { bool y = " << Take(par[0]) << " == 0xFFFFFFFFu;\n";
+            ss << Apply(par[0], Take(par[0]) + " + 1u", 0, written);
+            ss << "      SetFlag(r[15], 0, y); }\n";
+            break;
+        case DEC:
+            ss << Apply(par[0], Take(par[0]) + " - 1u", 0, written);
+            break;
+        case BZ:   branch("(r[15] & 0x04u) != 0"); break;
+        case BNZ:  branch("(r[15] & 0x04u) == 0"); break;
+        case BNEG: branch("(r[15] & 0x08u) != 0"); break;
+        case BPOS: branch("(r[15] & 0x08u) == 0"); break;
+        case BGT:  branch("(r[15] & 0x14u) == 0x10u"); break;
+        case BGTE: branch("(r[15] & 0x14u) == 0x14u"); break;
+        case BLT:  branch("(r[15] & 0x24u) == 0x20u"); break;
+        case BLTE: branch("(r[15] & 0x24u) == 0x24u"); break;
+        case BV:   branch("(r[15] & 0x02u) != 0"); break;
+        case BNV:  branch("(r[15] & 0x02u) == 0"); break;
+        case JMP:
+            ss << "    " << jump << "\n";
+            break;
+        case JSR:
+            ss << "    Push(c, r, " << next << ", 4);\n";
+            ss << "    " << jump << "\n";
+            break;
+        case RET:
+            ss << "    r[14] = Pop(c, r, 4);\n";
+            ss << "    " << leave << "\n";
+            break;
+        case PUSHB:
+            ss << "    Push(c, r, " << Take(par[0]) << " & 0xFFu, 1);\n" << written;
+            break;
+        case PUSHW:
+            ss << "    Push(c, r, " << Take(par[0]) << " & 0xFFFFu, 2);\n" << written;
+            break;
+        case PUSHD:
+            ss << "    Push(c, r, " << Take(par[0]) << ", 4);\n" << written;
+            break;
+        case PUSH_A:
+            ss << "    for(int i=0; i<=11; ++i) { Push(c, r, r[i], 4); }\n" << written;
+            break;
+        case POPB:
+            ss << Apply(par[0], "Pop(c, r, 1)", 0, written);
+            break;
+        case POPW:
+            ss << Apply(par[0], "Pop(c, r, 2)", 0, written);
+            break;
+        case POPD:
+            ss << Apply(par[0], "Pop(c, r, 4)", 0, written);
+            break;
+        case POP_A:
+            ss << "    for(int i=11; i>=0; --i) { r[i] = Pop(c, r, 4); }\n";
+            break;
+        case POPX:
+            ss << "    r[13] += " << Take(par[0]) << ";\n";
+            break;
+        case NOP:
+            break;
+        case WAIT:
+        case IRET:
+        case INVALID:
+        default:
+            throw logic_error("Invalid instruction");
+    }
+    if(Terminator(d) && d.opcode->instruction != JMP && d.opcode->instruction != JSR
+            && d.opcode->instruction != RET) {
+        ss << "    r[14] = " << next << ";\n";
+        ss << "    " << leave << "\n";
+    }
+    ss << "\n";
+    return ss.str();
+}
+
+
+// Mirrors CPU::Take.
+string Translator::Take(Parameter const& p) const
+{
+    switch(p.type) {
+        case REG:                    return "r[" + to_string(p.value) + "]";
+        case V8: case V16: case V32: return hex(p.value);
+        case INDV32:                 return "Load(c, " + hex(p.value) + ", 4)";
+        case INDREG:                 return "Load(c, r[" + to_string(p.value) + "], 4)";
+        default:
+            throw logic_error("Invalid option");
+    }
+}
+
+
+// Mirrors CPU::Apply: `written` leaves the block if a store overwrites the
+// translated code.
+string Translator::Apply(Parameter const& p, string const& value, int sz, string const& written) const
+{
+    string s = "    { uint32_t v = " + value + "; Flags(r[15], v); ";
+    switch(p.type) {
+        case REG:
+            return s + "r[" + to_string(p.value) + "] = v; }\n";
+        case INDREG:
+            return s + "Store(c, r[" + to_string(p.value) + "], v, " + to_string(sz) + "); }\n" + written;
+        case INDV32:
+            return s + "Store(c, " + hex(p.value) + ", v, " + to_string(sz) + "); }\n" + written;
+        case V8: case V16: case V32: default:
+            throw logic_error("Invalid option");
+    }
+}
+
+
+string Translator::Disassemble(Decoded const& d) const
+{
+    string s = d.opcode->mnemonic;
+    for(size_t i=0; i<d.par.size(); ++i) {
+        Parameter const& p = d.par[i];
+        string h = hex(p.value);
+        h.pop_back();
+        string name = (p.value < 16) ? reg_name[p.value] : "??";
+        s += (i == 0) ? " " : ", ";
+        switch(p.type) {
+            case REG:    s += name; break;
+            case INDREG: s += "[" + name + "]"; break;
+            case INDV32: s += "[" + h + "]"; break;
+            case V8: case V16: case V32: s += h; break;
+        }
+    }
+    return s;
+}
+
+// }}}
+
+}  // namespace luisavm
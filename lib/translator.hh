@@ -0,0 +1,55 @@
+#ifndef TRANSLATOR_HH_
+#define TRANSLATOR_HH_
+
+#include <cstdint>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "opcodes.hh"
+
+namespace luisavm {
+
+// Translates an assembled ROM into C++ source, with one function per basic
+// block. The map generated by the assembler tells what is code, and its
+// labels are used as block entry points. The source is compiled into a
+// shared object and loaded with LuisaVM::LoadNative.
+class Translator {
+public:
+    string Translate(vector<uint8_t> const& rom, string const& mp, string const& name="rom");
+
+private:
+    struct Parameter {
+        ParameterType type;
+        uint32_t      value;
+    };
+
+    struct Decoded {
+        uint32_t          pc;
+        uint8_t           sz;
+        Opcode const*     opcode;
+        vector<Parameter> par;
+    };
+
+    void ParseMap(string const& mp, vector<uint8_t> const& rom);
+    bool Decode(vector<uint8_t> const& rom, uint32_t pc, Decoded& d) const;
+    bool Translatable(Decoded const& d) const;
+    bool Terminator(Decoded const& d) const;
+    void FindLeaders();
+
+    string Block(vector<Decoded const*> const& block) const;
+    string Instruction(Decoded const& d, size_t n) const;
+    string Take(Parameter const& p) const;
+    string Apply(Parameter const& p, string const& value, int sz, string const& exit) const;
+    string Disassemble(Decoded const& d) const;
+
+    map<uint32_t, Decoded> _code;
+    map<uint32_t, string>  _labels;
+    set<uint32_t>          _leaders;
+};
+
+}  // namespace luisavm
+
+#endif
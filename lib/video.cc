@@ -3,6 +3,7 @@
 #include <array>
 
 #include "font.xbm"
+#include "luisavm.hh"
 
 static const int CHAR_W = 6;
 static const int CHAR_H = 9;
@@ -30,7 +31,7 @@ static uint32_t default_palette[255] = {
 };
 
 
-Video::Video(Callbacks const& cb) : cb(cb)
+Video::Video(LuisaVM& comp, Callbacks const& cb) : comp(comp), cb(cb)
 {
     // initialize palette
     for(uint8_t i=0; i<255; ++i) {
@@ -51,6 +52,28 @@ Video::Video(Callbacks const& cb) : cb(cb)
         bg.fill(i);
         _char_bg[i] = cb.upload_sprite(CHAR_W, CHAR_H, &bg[0]);
     }
+
+    Reset();
+}
+
+
+void Video::Reset()
+{
+    _next_frame = comp.Cycles() + FRAME_CYCLES;
+    comp.Schedule(*this, FRAME_CYCLES);
+}
+
+
+// Frames missed by a late event are skipped, as the timer does.
+void Video::Step()
+{
+    uint64_t now = comp.Cycles();
+    if(now < _next_frame) {
+        return;
+    }
+    comp.RaiseInterrupt(InterruptController::VBLANK);
+    _next_frame += ((now - _next_frame) / FRAME_CYCLES + 1) * FRAME_CYCLES;
+    comp.Schedule(*this, _next_frame - now);
 }
 
 
@@ -5,6 +5,7 @@
 #include <array>
 #include <functional>
 #include <map>
+#include <string>
 using namespace std;
 
 #include "device.hh"
@@ -27,7 +28,14 @@ public:
         function<void()>                                   update_screen;
     };
 
-    explicit Video(Callbacks const& cb);
+    // A frame lasts FRAME_CYCLES of guest time (60 Hz at the default 4 MHz
+    // clock). The VBLANK interrupt line is raised at the end of each one.
+    static const uint32_t FRAME_CYCLES = 66667;
+
+    Video(class LuisaVM& comp, Callbacks const& cb);
+
+    void Step() override;
+    void Reset() override;
 
     void DrawChar(char c, uint16_t x, uint16_t y, uint8_t fg, uint8_t bg) const;
     void DrawBox(uint16_t x1, uint16_t y1, uint16_t x2, uint16_t y2, uint8_t fg, uint8_t bg, bool clear=true, bool shadow=false) const;
@@ -49,7 +57,9 @@ public:
 private:
     uint32_t LoadCharSprite(char c, uint8_t fg) const;
 
+    LuisaVM&  comp;
     Callbacks cb;
+    uint64_t  _next_frame = 0;
     array<uint8_t,16> _char_bg;
     mutable map<uint32_t, uint32_t> _char_sprite;
 };
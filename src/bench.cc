@@ -0,0 +1,174 @@
+#include "luisavm.hh"
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+using namespace std;
+
+#include <unistd.h>
+using namespace luisavm;
+
+// Measures the costs that are paid all the time, such as the bookkeeping
+// done on every memory write.
+
+template<typename F>
+static double Seconds(F&& f)
+{
+    auto start = chrono::steady_clock::now();
+    f();
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+
+static void Load(LuisaVM& comp, string const& code)
+{
+    vector<uint8_t> data = Assembler().AssembleString("bench", code);
+    for(uint32_t i=0; i<data.size(); ++i) {
+        comp.Set(i, data[i]);
+    }
+}
+
+
+// the whole memory as a single segment, so that every access is translated
+static void EnableMMU(LuisaVM& comp)
+{
+    comp.Set32(MMU::POS + MMU::LIMIT, static_cast<uint32_t>(comp.PhysicalMemory().size()));
+    comp.Set32(MMU::POS + MMU::CONTROL, 1);
+}
+
+
+// a loop that writes to memory in every other instruction
+static void StoreLoop(bool mmu)
+{
+    LuisaVM comp(1024 * 1024);
+    Load(comp, R"(section .text
+            mov     B, 0x10000
+    next:   movd    [B], A
+            add     A, 1
+            movd    [B], A
+            add     B, 4
+            and     B, 0xFFFFF
+            or      B, 0x10000
+            jmp     next)");
+
+    if(mmu) {
+        EnableMMU(comp);
+    }
+
+    const uint64_t n = 50000000;
+    double s = Seconds([&]() { comp.Run(n); });
+    printf("%-28s%8.2f Mcycles/s\n", mmu ? "interpreter, MMU stores:" : "interpreter, store loop:", static_cast<double>(n) / s / 1e6);
+}
+
+
+static void Set32(bool mmu)
+{
+    LuisaVM comp(1024 * 1024);
+    if(mmu) {
+        EnableMMU(comp);
+    }
+    const uint32_t n = 50000000;
+    double s = Seconds([&]() {
+        for(uint32_t i=0; i<n; ++i) {
+            comp.Set32((i * 4) & 0xFFFFC, i);
+        }
+    });
+    printf("%-28s%8.2f ns/call\n", mmu ? "Set32, MMU:" : "Set32:", s / n * 1e9);
+}
+
+
+// Stepping one instruction at a time, with idle devices added: the devices
+// are only stepped when they have scheduled an event.
+static void Step(int idle_devices)
+{
+    LuisaVM comp;
+    Load(comp, "section .text\nnext: add A, 1\njmp next");
+    for(int i=0; i<idle_devices; ++i) {
+        comp.AddDevice<Device>();
+    }
+
+    const int n = 20000000;
+    double s = Seconds([&]() {
+        for(int i=0; i<n; ++i) {
+            comp.Step();
+        }
+    });
+    char label[32];
+    snprintf(label, sizeof label, "Step, %d idle devices:", idle_devices);
+    printf("%-28s%8.2f ns/instr\n", label, s / n * 1e9);
+}
+
+
+static void CollectDirtyPages()
+{
+    LuisaVM comp(256 * 1024 * 1024);
+    uint32_t pages = static_cast<uint32_t>(comp.PhysicalMemory().size() / PageTable::PAGE_SIZE);
+
+    double clean = Seconds([&]() { comp.CollectDirtyPages(); });
+    for(uint32_t i=0; i<pages; ++i) {
+        comp.Set(i * PageTable::PAGE_SIZE, 1);
+    }
+    double dirty = Seconds([&]() { comp.CollectDirtyPages(); });
+    printf("CollectDirtyPages, 256 MB:  %8.2f us (clean), %.2f us (all %u pages dirty)\n", 
+            clean * 1e6, dirty * 1e6, pages);
+}
+
+
+// a warm 100 MB guest, with every page in use
+static void SaveState()
+{
+    LuisaVM comp(100 * 1024 * 1024), loaded(100 * 1024 * 1024);
+    for(uint32_t pos=0; pos<comp.PhysicalMemory().size(); pos+=64) {
+        comp.Set32(pos, pos);
+    }
+
+    string filename = "/tmp/luisavm-bench-" + to_string(getpid());
+    double save = Seconds([&]() { comp.SaveState(filename); });
+    double load = Seconds([&]() { loaded.LoadState(filename); });
+    unlink(filename.c_str());
+    printf("save state, 100 MB:         %8.2f ms (save), %.2f ms (load)\n", save * 1e3, load * 1e3);
+}
+
+
+// A 100 MB guest that changes a tenth of its pages between checkpoints: 
+// the guest is only held back while the pages are copied.
+static void Checkpoint()
+{
+    LuisaVM comp(100 * 1024 * 1024);
+    for(uint32_t pos=0; pos<comp.PhysicalMemory().size(); pos+=64) {
+        comp.Set32(pos, pos);
+    }
+
+    string filename = "/tmp/luisavm-bench-" + to_string(getpid());
+    double capture = 0, total;
+    {
+        Checkpointer ck(comp, filename);
+        ck.Checkpoint();
+        ck.Wait();
+        total = Seconds([&]() {
+            for(int n=0; n<10; ++n) {
+                for(uint32_t pos=0; pos<comp.PhysicalMemory().size(); pos+=10*PageTable::PAGE_SIZE) {
+                    comp.Set32(pos + static_cast<uint32_t>(n) * 4, pos);
+                }
+                capture += Seconds([&]() { ck.Checkpoint(); });
+            }
+            ck.Wait();
+        });
+    }
+    unlink(filename.c_str());
+    printf("checkpoint, 10 MB changed:  %8.2f ms (guest stall), %.2f ms (written)\n", capture / 10 * 1e3, total / 10 * 1e3);
+}
+
+
+int main()
+{
+    StoreLoop(false);
+    StoreLoop(true);
+    Set32(false);
+    Set32(true);
+    Step(0);
+    Step(16);
+    CollectDirtyPages();
+    SaveState();
+    Checkpoint();
+}
@@ -0,0 +1,121 @@
+#include "luisavm.hh"
+#include "translator.hh"
+
+#include <cstdint>
+#include <cstdlib>
+#include <getopt.h>
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+using namespace std;
+
+// {{{ COMMANDLINE OPTIONS
+
+struct Options {
+    string   input_file = "";
+    string   output_file = "";
+    string   map_file = "";
+
+    Options(int argc, char* argv[])
+    {
+        int c;
+
+        while(true) {
+            int option_index = 0;
+            static struct option long_options[] = {
+                {"output",  required_argument, nullptr,  'o' },
+                {"map",     required_argument, nullptr,  'm' },
+                {"help",    no_argument,       nullptr,  'h' },
+                {nullptr,   0,                 nullptr,   0  }
+            };
+
+            c = getopt_long(argc, argv, "o:m:h", long_options, &option_index);
+            if(c == -1) {
+                break;
+            }
+
+            switch(c) {
+                case 'm':
+                    map_file = optarg;
+                    break;
+                case 'o':
+                    output_file = optarg;
+                    break;
+                case 'h':
+                    cout << "LuisaVM ahead-of-time compiler\n";
+                    cout << "Usage: lac -m MAPFILE [-o OUTPUT] ROMFILE\n";
+                    cout << "Options:\n";
+                    cout << "   -m, --map         map file generated by las\n";
+                    cout << "   -o, --output      output file (C++ source)\n";
+                    cout << "   -h, --help        this help\n";
+                    cout << "Compile the output with: c++ -O2 -shared -fPIC OUTPUT -o ROM.so\n";
+                    exit(EXIT_SUCCESS);
+                case '?':
+                    exit(EXIT_FAILURE);
+                default:
+                    abort();
+            }
+        }
+
+        if(optind < argc) {
+            input_file = argv[optind];
+        }
+    }
+};
+
+// }}}
+
+static bool read_file(string const& filename, string& contents)
+{
+    ifstream t(filename, ios::binary);
+    if(!t.is_open()) {
+        cerr << "Could not open file " + filename + "\n";
+        return false;
+    }
+    stringstream buf;
+    buf << t.rdbuf();
+    contents = buf.str();
+    return true;
+}
+
+
+int main(int argc, char* argv[])
+{
+    // parse options
+    Options opt(argc, argv);
+
+    if(opt.input_file == "" || opt.map_file == "") {
+        cerr << "Please define an input file and a map file.\n";
+        return EXIT_FAILURE;
+    }
+
+    if(opt.output_file == "") {
+        size_t lastindex = opt.input_file.find_last_of("."); 
+        opt.output_file = opt.input_file.substr(0, lastindex) + ".cc";
+    }
+
+    // read rom and map
+    string rom, mp;
+    if(!read_file(opt.input_file, rom) || !read_file(opt.map_file, mp)) {
+        return EXIT_FAILURE;
+    }
+
+    // translate
+    string source;
+    try {  // NOLINT
+        source = luisavm::Translator().Translate(vector<uint8_t>(begin(rom), end(rom)), mp, opt.input_file);
+    } catch(runtime_error& e) {
+        cerr << e.what() << "\n";
+        return EXIT_FAILURE;
+    }
+
+    // store source
+    ofstream output(opt.output_file);
+    if(!output.is_open()) {
+        cerr << "Could not open file " + opt.output_file + "\n";
+        return EXIT_FAILURE;
+    }
+    output << source;
+}
@@ -1,6 +1,7 @@
 #include "luisavm.hh"
 
 #include <cstdint>
+#include <cstdio>
 #include <cstdlib>
 #include <getopt.h>
 
@@ -98,14 +99,24 @@ int main(int argc, char* argv[])
         return EXIT_FAILURE;
     }
 
-    // store binary
-    ofstream output(opt.output_file, ios::out | ios::binary);
+    // store binary: a VM might have the old one mapped (see LuisaVM::LoadROM),
+    // so it's replaced rather than rewritten
+    string temp = opt.output_file + ".tmp";
+    ofstream output(temp, ios::out | ios::binary);
     if(!output.is_open()) {
-        cerr << "Could not open file " + opt.output_file + "\n";
+        cerr << "Could not open file " + temp + "\n";
         return EXIT_FAILURE;
     }
     output.write(reinterpret_cast<const char*>(&data[0]), data.size());
     output.close();
+#if defined(_WIN32)
+    remove(opt.output_file.c_str());
+#endif
+    if(!output || rename(temp.c_str(), opt.output_file.c_str()) != 0) {
+        remove(temp.c_str());
+        cerr << "Could not write file " + opt.output_file + "\n";
+        return EXIT_FAILURE;
+    }
 
     // store map
     if(opt.map_file != "") {
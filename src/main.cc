@@ -1,11 +1,13 @@
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <getopt.h>
 
 #include "luisavm.hh"
 #include <SDL2/SDL.h>
 
 #include <iostream>
+#include <memory>
 #include <string>
 #include <vector>
 using namespace std;
@@ -18,6 +20,12 @@ struct Options {
     uint32_t memory_size = 16;
     uint8_t  zoom = 2;
     bool     start_with_debugger = true;
+    bool     jit = false;
+    uint64_t clock = 4000000;   // Hz, or 0 to run as fast as possible
+    bool     profile = false;
+    string   fusions = "all";
+    string   autosave_file;
+    string   restore_file;
 
     Options(int argc, char* argv[])
     {
@@ -29,11 +37,17 @@ struct Options {
                 {"memory",  required_argument, nullptr,  'M' },
                 {"map",     required_argument, nullptr,  'm' },
                 {"zoom",    required_argument, nullptr,  'z' },
+                {"jit",     no_argument,       nullptr,  'j' },
+                {"clock",   required_argument, nullptr,  'c' },
+                {"fuse",    required_argument, nullptr,  'f' },
+                {"profile", no_argument,       nullptr,  'p' },
+                {"autosave", required_argument, nullptr, 'a' },
+                {"restore", required_argument, nullptr,  'r' },
                 {"help",    no_argument,       nullptr,  'h' },
                 {nullptr,   0,                 nullptr,   0  }
             };
 
-            c = getopt_long(argc, argv, "m:M:z:h", long_options, &option_index);
+            c = getopt_long(argc, argv, "m:M:z:jc:f:pa:r:h", long_options, &option_index);
             if(c == -1) {
                 break;
             }
@@ -48,11 +62,40 @@ struct Options {
                 case 'z':
                     zoom = strtol(optarg, nullptr, 10);
                     break;
+                case 'j':
+                    if(!luisavm::JIT::Supported()) {
+                        cerr << "The JIT is not supported in this platform.\n";
+                        exit(EXIT_FAILURE);
+                    }
+                    jit = true;
+                    break;
+                case 'c':
+                    clock = ParseClock(optarg);
+                    break;
+                case 'f':
+                    fusions = optarg;
+                    break;
+                case 'p':
+                    profile = true;
+                    break;
+                case 'a':
+                    autosave_file = optarg;
+                    break;
+                case 'r':
+                    restore_file = optarg;
+                    break;
                 case 'h':
                     cout << "LuisaVM emulator version " VERSION "\n";
                     cout << "Options:\n";
                     cout << "   -m, --memory      memory size, in kB\n";
                     cout << "   -z, --zoom        zoom of the display\n";
+                    cout << "   -j, --jit         translate the code to native code\n";
+                    cout << "   -c, --clock       speed of the CPU (such as 4MHz), or max\n";
+                    cout << "   -f, --fuse        instruction pairs to fuse, separated by commas\n";
+                    cout << "                     (cmp+bz, cmp+bnz, dec+bnz, mov+add, all or none)\n";
+                    cout << "   -p, --profile     print execution statistics when leaving\n";
+                    cout << "   -a, --autosave    write a checkpoint to this file every few seconds\n";
+                    cout << "   -r, --restore     start from the last checkpoint in this file\n";
                     cout << "   -T, --test        run unit tests\n";
                     cout << "   -h, --help        this help\n";
                     exit(EXIT_SUCCESS);
@@ -67,6 +110,31 @@ struct Options {
             rom_file = argv[optind];
         }
     }
+
+private:
+    // "max", or a frequency such as "4MHz", "500kHz" or "2000000"
+    static uint64_t ParseClock(string const& value)
+    {
+        if(value == "max") {
+            return 0;
+        }
+        char* suffix;
+        double hz = strtod(value.c_str(), &suffix);
+        if(strcasecmp(suffix, "GHz") == 0) {
+            hz *= 1e9;
+        } else if(strcasecmp(suffix, "MHz") == 0) {
+            hz *= 1e6;
+        } else if(strcasecmp(suffix, "kHz") == 0) {
+            hz *= 1e3;
+        } else if(*suffix != '\0' && strcasecmp(suffix, "Hz") != 0) {
+            hz = 0;
+        }
+        if(!(hz >= 1)) {
+            cerr << "Invalid clock: " << value << "\n";
+            exit(EXIT_FAILURE);
+        }
+        return static_cast<uint64_t>(hz);
+    }
 };
 
 // }}}
@@ -79,7 +147,10 @@ public:
         : opt(argc, argv), comp(opt.memory_size * 1024) 
     {
         zoom = opt.zoom;
+        comp.EnableJIT(opt.jit);
+        SetupFusions();
         LoadROM();
+        SetupCheckpoints();
         InitializeSDL();
         /* luisavm::Video& video = */SetupVideo();
     }
@@ -87,6 +158,10 @@ public:
 
     ~Emulator()
     {
+        if(opt.profile) {
+            PrintProfile();
+        }
+
         for(auto& s: sprites) {
             SDL_DestroyTexture(s);
         }
@@ -97,20 +172,94 @@ public:
     }
 
 
+    // The VM runs in slices of SLICE_MS of guest time. With a clock set, the
+    // time left in each slice is slept; if the host falls behind, the time 
+    // lost is not made up for.
     void MainLoop()
     {
+        uint64_t slice = opt.clock ? max<uint64_t>(opt.clock * SLICE_MS / 1000, 1) : UNTHROTTLED_SLICE;
+        Uint32 slice_end = SDL_GetTicks();
         bool active = true;
         while(active) {
             if(!GetEvents()) {
                 active = false;
             }
-            comp.Step();
-            SDL_Delay(1);
+            luisavm::StopReason stop = comp.Run(slice);
+            if(stop.Trapped()) {
+                cerr << "CPU trap: " << stop.Description() << "\n";   // the debugger takes over
+            }
+            if(checkpointer && SDL_GetTicks() - last_autosave >= AUTOSAVE_INTERVAL) {
+                checkpointer->Checkpoint();
+                last_autosave = SDL_GetTicks();
+            }
+
+            Uint32 now = SDL_GetTicks();
+            slice_end += SLICE_MS;
+            if(stop.cycles == 0) {   // the debugger is active: it only reacts to keys
+                SDL_WaitEventTimeout(nullptr, static_cast<int>(IDLE_TIMEOUT));
+                slice_end = SDL_GetTicks();
+            } else if(comp.cpu().Waiting) {
+                Idle();
+                slice_end = SDL_GetTicks();
+            } else if(opt.clock != 0 && slice_end > now) {
+                SDL_Delay(slice_end - now);
+            } else {
+                slice_end = now;
+            }
+        }
+        if(checkpointer) {
+            checkpointer->Checkpoint();
         }
     }
 
 
 private:
+    // Nothing happens in the guest until the next device event (such as the
+    // end of a frame) or until the user does something, so the host sleeps
+    // until then. The guest time skips ahead by the time slept.
+    void Idle()
+    {
+        uint64_t cycles = comp.CyclesToNextEvent();
+        Uint32 timeout = IDLE_TIMEOUT;
+        if(cycles != UINT64_MAX) {
+            if(opt.clock == 0) {
+                comp.Run(cycles);   // no clock: straight to the event
+                return;
+            }
+            timeout = static_cast<Uint32>(min<double>(timeout, static_cast<double>(cycles) * 1000 / static_cast<double>(opt.clock)));
+        }
+
+        Uint32 start = SDL_GetTicks();
+        SDL_WaitEventTimeout(nullptr, static_cast<int>(timeout));
+        if(opt.clock != 0) {
+            comp.Run(min<uint64_t>(cycles, opt.clock * (SDL_GetTicks() - start) / 1000));
+        }
+    }
+
+
+    void SetupFusions()
+    {
+        string list = "," + opt.fusions + ",";
+        for(int i=0; i<luisavm::CPU::FUSION_COUNT; ++i) {
+            auto f = static_cast<luisavm::CPU::Fusion>(i);
+            string name = luisavm::CPU::FusionName(f);
+            bool enabled = (opt.fusions == "all") || (list.find("," + name + ",") != string::npos);
+            comp.cpu().EnableFusion(f, enabled);
+        }
+    }
+
+
+    void PrintProfile() const
+    {
+        cout << "Fused instructions:\n";
+        for(int i=0; i<luisavm::CPU::FUSION_COUNT; ++i) {
+            auto f = static_cast<luisavm::CPU::Fusion>(i);
+            cout << "   " << luisavm::CPU::FusionName(f) << ": " 
+                 << (comp.cpu().FusionEnabled(f) ? to_string(comp.cpu().FusionCount(f)) : "disabled") << "\n";
+        }
+    }
+
+
     void LoadROM() 
     {
         if(opt.rom_file != "") {
@@ -119,6 +268,17 @@ private:
     }
 
 
+    void SetupCheckpoints()
+    {
+        if(opt.restore_file != "") {
+            luisavm::Checkpointer::Restore(comp, opt.restore_file);
+        }
+        if(opt.autosave_file != "") {
+            checkpointer = make_unique<luisavm::Checkpointer>(comp, opt.autosave_file);
+        }
+    }
+
+
     void InitializeSDL() 
     {
         if(SDL_Init(SDL_INIT_VIDEO) != 0) {
@@ -312,9 +472,17 @@ private:
     const int HEIGHT = 234;
     const int BORDER =  20;
 
+    const Uint32   SLICE_MS = 10;
+    const uint64_t UNTHROTTLED_SLICE = 1000000;   // cycles
+    const Uint32   IDLE_TIMEOUT = 1000;           // ms, so that autosaving goes on
+    const Uint32   AUTOSAVE_INTERVAL = 10000;   // ms
+
     Options          opt;
     luisavm::LuisaVM comp;
 
+    unique_ptr<luisavm::Checkpointer> checkpointer;
+    Uint32                            last_autosave = 0;
+
     double               zoom = 2;
     SDL_Window*          window = nullptr;
     SDL_Renderer*        ren = nullptr;
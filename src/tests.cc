@@ -1,6 +1,30 @@
 #include "luisavm.hh"
 
+#include <cstdlib>
+#include <new>
+
+static size_t allocations = 0;
+
+void* operator new(size_t sz)
+{
+    ++allocations;
+    if(void* p = malloc(sz ? sz : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    free(p);
+}
+
 int main()
 {
-    luisavm::run_tests();
+    luisavm::run_tests([]() { return allocations; });
 }